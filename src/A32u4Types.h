@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <cinttypes> // for PRId64 and similar
 #include <climits> // for SIZE_MAX
+#include <stddef.h>
 
 typedef uint8_t regind_t;
 typedef uint8_t reg_t;
@@ -13,6 +14,21 @@ typedef uint16_t sizemcu_t;
 
 #define ADDRMCU_T_MAX 0xFFFF
 
+namespace A32u4 {
+	// pointer and length of a block of memory (std::span needs C++20)
+	template<typename T>
+	struct Span {
+		T* ptr = nullptr;
+		size_t len = 0;
+
+		T* data() const { return ptr; }
+		size_t size() const { return len; }
+		T* begin() const { return ptr; }
+		T* end() const { return ptr + len; }
+		T& operator[](size_t ind) const { return ptr[ind]; }
+	};
+}
+
 #define MCU_PRIuSIZEMCU PRIu16
 #define MCU_PRIxSIZEMCU PRIx16
 #define MCU_PRIuADDR PRIu16
@@ -4,6 +4,8 @@
 #include "StreamUtils.h"
 #include "DataUtils.h"
 
+#include "utils/StateBuffer.h"
+
 #define LU_MODULE "Inst Handler"
 #include "components/InstHandlerTemplates.h"
 #undef LU_MODULE
@@ -18,7 +20,7 @@
 
 
 
-A32u4::ATmega32u4::ATmega32u4(): cpu(this), dataspace(this), flash(this)
+A32u4::ATmega32u4::ATmega32u4(): cpu(this), dataspace(this), flash(this), usb(this)
 #if MCU_INCLUDE_EXTRAS
 ,debugger(this)
 #endif
@@ -27,7 +29,7 @@ A32u4::ATmega32u4::ATmega32u4(): cpu(this), dataspace(this), flash(this)
 }
 A32u4::ATmega32u4::ATmega32u4(const ATmega32u4& src): 
 logCallB(src.logCallB), running(src.running),
-cpu(src.cpu), dataspace(src.dataspace), flash(src.flash)
+cpu(src.cpu), dataspace(src.dataspace), flash(src.flash), usb(src.usb)
 #if MCU_INCLUDE_EXTRAS
 , debugger(src.debugger)
 , analytics(src.analytics)
@@ -42,6 +44,7 @@ A32u4::ATmega32u4& A32u4::ATmega32u4::operator=(const ATmega32u4& src){
 	cpu = src.cpu;
 	dataspace = src.dataspace;
 	flash = src.flash;
+	usb = src.usb;
 
 #if MCU_INCLUDE_EXTRAS
 	debugger = src.debugger;
@@ -56,6 +59,7 @@ void A32u4::ATmega32u4::setMcu() {
 	cpu.mcu = this;
 	dataspace.mcu = this;
 	flash.mcu = this;
+	usb.mcu = this;
 #if MCU_INCLUDE_EXTRAS
 	debugger.mcu = this;
 #endif
@@ -87,25 +91,61 @@ void A32u4::ATmega32u4::reset() { //add: reason
 void A32u4::ATmega32u4::resetHardware() {
 	dataspace.reset();
 	cpu.reset();
+	usb.reset();
+}
+void A32u4::ATmega32u4::watchdogReset() {
+	LU_LOG(LogUtils::LogLevel_Output, "Watchdog Reset");
+
+#if MCU_INCLUDE_EXTRAS
+	debugger.reset();
+#endif
+
+	// the clock keeps running through a watchdog reset
+	const uint64_t totalCycls = cpu.getTotalCycles();
+	const uint64_t targetCycls = cpu.targetCycls;
+	const uint8_t mcusr = dataspace.data[DataSpace::Consts::MCUSR];
+
+	resetHardware();
+
+	cpu.totalCycls = totalCycls;
+	cpu.targetCycls = targetCycls;
+	dataspace.lastSet.Timer0Update = totalCycls;
+	dataspace.lastSet.Timer3Update = totalCycls;
+	dataspace.lastSet.Timer4Update = totalCycls;
+
+	// WDRF forces the watchdog to stay enabled (with the shortest timeout) until the program clears it
+	dataspace.data[DataSpace::Consts::MCUSR] = mcusr | (1 << DataSpace::Consts::MCUSR_WDRF);
+	dataspace.data[DataSpace::Consts::WDTCSR] = 1 << DataSpace::Consts::WDTCSR_WDE;
+	dataspace.lastSet.WDTReset = totalCycls;
+	dataspace.updateWDT();
 }
 void A32u4::ATmega32u4::powerOn() {
 	reset();
-	dataspace.setRegBit(A32u4::DataSpace::Consts::MCUSR, A32u4::DataSpace::Consts::MCUSR_PORF, true);
+	dataspace.data[DataSpace::Consts::MCUSR] |= 1 << DataSpace::Consts::MCUSR_PORF; // MCUSR flags cant be set by writing to it
 }
 
-void A32u4::ATmega32u4::execute(uint64_t cyclAmt, bool debug) {
+uint8_t A32u4::ATmega32u4::execute(uint64_t cyclAmt, bool debug) {
 	if (!running)
 		abort();
 
 	if(!flash.isProgramLoaded())
-		return;
+		return StopReason_NoProgram;
 
+	dataspace.pollHostInputs();
+
+	uint8_t reason;
 	if (!debug) {
-		cpu.execute<false>(cyclAmt);
+		reason = cpu.execute<false>(cyclAmt);
 	}
 	else {
-		cpu.execute<true>(cyclAmt);
+		reason = cpu.execute<true>(cyclAmt);
 	}
+
+	dataspace.flushOutputs();
+	return reason;
+}
+void A32u4::ATmega32u4::requestStop() {
+	stopRequested.store(true, std::memory_order_release);
 }
 
 
@@ -156,13 +196,60 @@ void A32u4::ATmega32u4::setPinChangeCallB(const std::function<void(uint8_t pinRe
 	pinChangeCallB = callB;
 }
 
+void A32u4::ATmega32u4::setPinChangeQueueSize(size_t size) {
+	pinChangeQueue.resize(size);
+	pinChangeQueue.shrink_to_fit();
+	pinChangeQueueStart = 0;
+	pinChangeQueueLen = 0;
+	pinChangeQueueOverflows = 0;
+}
+size_t A32u4::ATmega32u4::getPinChangeQueueSize() const {
+	return pinChangeQueue.size();
+}
+size_t A32u4::ATmega32u4::getPinChangeQueueLen() const {
+	return pinChangeQueueLen;
+}
+size_t A32u4::ATmega32u4::drainPinChanges(PinChange* out, size_t maxLen) {
+	const size_t amt = std::min(maxLen, pinChangeQueueLen);
+	for (size_t i = 0; i < amt; i++) {
+		out[i] = pinChangeQueue[pinChangeQueueStart];
+		if (++pinChangeQueueStart == pinChangeQueue.size())
+			pinChangeQueueStart = 0;
+	}
+	pinChangeQueueLen -= amt;
+	return amt;
+}
+uint64_t A32u4::ATmega32u4::getPinChangeQueueOverflows() const {
+	return pinChangeQueueOverflows;
+}
+void A32u4::ATmega32u4::queuePinChange(uint8_t pinReg, reg_t oldVal, reg_t val) {
+	const size_t size = pinChangeQueue.size();
+	size_t ind = pinChangeQueueStart + pinChangeQueueLen;
+	if (ind >= size)
+		ind -= size;
+
+	if (pinChangeQueueLen == size) { // full => drop the oldest entry
+		if (++pinChangeQueueStart == size)
+			pinChangeQueueStart = 0;
+		pinChangeQueueOverflows++;
+	}
+	else {
+		pinChangeQueueLen++;
+	}
+
+	pinChangeQueue[ind] = { cpu.getTotalCycles(), pinReg, oldVal, val };
+}
+
 
 void A32u4::ATmega32u4::getState(std::ostream& output){
+	StreamUtils::write(output, stateStreamMagic);
+	StreamUtils::write(output, stateStreamVersion);
 	StreamUtils::write(output, running);
 
 	cpu.getState(output);
 	dataspace.getState(output);
 	flash.getState(output);
+	usb.getState(output);
 
 #if MCU_INCLUDE_EXTRAS
 	debugger.getState(output);
@@ -174,24 +261,138 @@ void A32u4::ATmega32u4::getState(std::ostream& output){
 #endif
 }
 void A32u4::ATmega32u4::setState(std::istream& input){
+	uint32_t version = 0;
+	const int first = input.peek();
+	if (first != 0 && first != 1) { // a version 0 stream starts with the running flag
+		uint32_t magic = 0;
+		StreamUtils::read(input, &magic);
+		StreamUtils::read(input, &version);
+		if (!input || magic != stateStreamMagic || version > stateStreamVersion) {
+			LU_LOGF(LogUtils::LogLevel_Error, "Couldn't read state: unknown stream format or version %" PRIu32, version);
+			input.setstate(std::ios::failbit);
+			return;
+		}
+	}
+
 	StreamUtils::read(input, &running);
 
 	cpu.setState(input);
-	dataspace.setState(input);
-	flash.setState(input);
+	if (version == 0) {
+		dataspace.setStateV0(input);
+		flash.setStateV0(input);
+		// there was no usb emulation yet, a running controller starts over with a bus reset
+		usb.reset();
+		usb.updateRunning();
+	}
+	else {
+		dataspace.setState(input);
+		flash.setState(input);
+		usb.setState(input);
+	}
 
 #if MCU_INCLUDE_EXTRAS
 	debugger.setState(input);
-	analytics.setState(input);
+	if (version == 0)
+		analytics.setStateV0(input);
+	else
+		analytics.setState(input);
+#endif
+
+	if (version == 0) {
+		A32U4_SKIP_HASH(); // covers a different set of fields
+	}
+	else {
+		A32U4_CHECK_HASH("ATmega32u4");
+	}
+}
+
+// buffer layout: size (uint32_t), flags, running, cpu, dataspace, usb, [flash], [debugger, analytics]
+static constexpr size_t stateBufHeaderSize = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(bool);
+
+size_t A32u4::ATmega32u4::getStateSize(uint8_t flags) {
+	size_t size = stateBufHeaderSize + CPU::getStateBufSize() + DataSpace::getStateBufSize() + USB::getStateBufSize();
+	if (flags & StateFlag_Flash)
+		size += Flash::getStateBufSize();
+
+#if MCU_INCLUDE_EXTRAS
+	if (flags & StateFlag_Extras) {
+		StateStreamBuf counter((uint8_t*)nullptr, 0);
+		std::ostream stream(&counter);
+		debugger.getState(stream);
+		analytics.getState(stream);
+		size += counter.written();
+	}
 #endif
+	return size;
+}
+size_t A32u4::ATmega32u4::saveState(uint8_t* buf, size_t len, uint8_t flags) {
+#if !MCU_INCLUDE_EXTRAS
+	flags &= ~StateFlag_Extras;
+#endif
+	const size_t size = getStateSize(flags);
+	if (len < size)
+		return 0;
 
-	A32U4_CHECK_HASH("ATmega32u4");
+	StateWriter output{ buf };
+	output.write((uint32_t)size);
+	output.write(flags);
+	output.write(running);
+
+	cpu.getState(output);
+	dataspace.getState(output);
+	usb.getState(output);
+	if (flags & StateFlag_Flash)
+		flash.getState(output);
+
+#if MCU_INCLUDE_EXTRAS
+	if (flags & StateFlag_Extras) {
+		StateStreamBuf streamBuf(output.ptr, size - (size_t)(output.ptr - buf));
+		std::ostream stream(&streamBuf);
+		debugger.getState(stream);
+		analytics.getState(stream);
+	}
+#endif
+	return size;
+}
+size_t A32u4::ATmega32u4::loadState(const uint8_t* buf, size_t len) {
+	if (len < stateBufHeaderSize)
+		return 0;
+
+	StateReader input{ buf };
+	uint32_t size;
+	uint8_t flags;
+	input.read(&size);
+	input.read(&flags);
+
+	const size_t fixedSize = getStateSize(flags & ~StateFlag_Extras);
+	if (size > len || size < fixedSize || (!(flags & StateFlag_Extras) && size != fixedSize)) {
+		LU_LOGF(LogUtils::LogLevel_Warning, "State buffer has the wrong size: %" CU_PRIuSIZE " (expected %" CU_PRIuSIZE ")", (size_t)size, fixedSize);
+		return 0;
+	}
+
+	input.read(&running);
+
+	cpu.setState(input);
+	dataspace.setState(input);
+	usb.setState(input);
+	if (flags & StateFlag_Flash)
+		flash.setState(input);
+
+#if MCU_INCLUDE_EXTRAS
+	if (flags & StateFlag_Extras) {
+		StateStreamBuf streamBuf(input.ptr, size - (size_t)(input.ptr - buf));
+		std::istream stream(&streamBuf);
+		debugger.setState(stream);
+		analytics.setState(stream);
+	}
+#endif
+	return size;
 }
 
 
 bool A32u4::ATmega32u4::operator==(const ATmega32u4& other) const{
 #define _CMP_(x) (x==other.x)
-	return _CMP_(running) && _CMP_(cpu) && _CMP_(dataspace) && _CMP_(flash)
+	return _CMP_(running) && _CMP_(cpu) && _CMP_(dataspace) && _CMP_(flash) && _CMP_(usb)
 #if MCU_INCLUDE_EXTRAS
 		&& _CMP_(debugger) && _CMP_(analytics)
 #endif
@@ -208,6 +409,7 @@ size_t A32u4::ATmega32u4::sizeBytes() const {
 	sum += cpu.sizeBytes();
 	sum += dataspace.sizeBytes();
 	sum += flash.sizeBytes();
+	sum += usb.sizeBytes();
 
 #if MCU_INCLUDE_EXTRAS
 	sum += debugger.sizeBytes();
@@ -222,6 +424,7 @@ uint32_t A32u4::ATmega32u4::hash() const noexcept {
 	DU_HASHC(h, cpu);
 	DU_HASHC(h, dataspace);
 	DU_HASHC(h, flash);
+	DU_HASHC(h, usb);
 
 #if MCU_INCLUDE_EXTRAS
 	DU_HASHC(h, analytics);
@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <functional>
+#include <vector>
+#include <atomic>
 
 #include "config.h"
 
@@ -11,6 +13,7 @@
 #include "components/CPU.h"
 #include "components/DataSpace.h"
 #include "components/Flash.h"
+#include "components/USB.h"
 
 #if MCU_INCLUDE_EXTRAS
 #include "extras/Debugger.h"
@@ -24,8 +27,8 @@
 
 #if MCU_RANGE_CHECK
 #if MCU_RANGE_CHECK_ERROR
-#define A32U4_ASSERT_INRANGE(val,from,to,action,msg,...) if((val) < (from) || (val) >= (to)) { LU_LOGF_(LogUtils::LogLevel_Error, msg, __VA_ARGS__); mcu->cpu.executeError(); action;}
-#define A32U4_ASSERT_INRANGE2(val,from,to,action,msg) if((val) < (from) || (val) >= (to)) { LU_LOGF_(LogUtils::LogLevel_Error, msg, val, val); mcu->cpu.executeError(); action;}
+#define A32U4_ASSERT_INRANGE(val,from,to,action,msg,...) if((val) < (from) || (val) >= (to)) { LU_LOGF(LogUtils::LogLevel_Error, msg, __VA_ARGS__); mcu->cpu.executeError(); action;}
+#define A32U4_ASSERT_INRANGE2(val,from,to,action,msg) if((val) < (from) || (val) >= (to)) { LU_LOGF(LogUtils::LogLevel_Error, msg, val, val); mcu->cpu.executeError(); action;}
 #else
 #define A32U4_ASSERT_INRANGE(val,from,to,action,msg,...) if((val) < (from) || (val) >= (to)) { action;}
 #define A32U4_ASSERT_INRANGE2(val,from,to,action,msg) if((val) < (from) || (val) >= (to)) { action;}
@@ -37,21 +40,45 @@
 
 #define MCU_ADDR_FORMAT "%" MCU_PRIuADDR "(0x%" MCU_PRIxADDR ")"
 
+// the _ variant is for classes without an mcu to log to (devices, analytics)
 #if MCU_CHECK_HASH
-#define A32U4_CHECK_HASH(_module_) uint32_t hash_; StreamUtils::read(input, &hash_); if (hash_ != hash()) { LU_LOG_(LogUtils::LogLevel_Warning, _module_ " read state hash does not match"); }
+#define A32U4_CHECK_HASH(_module_) uint32_t hash_; StreamUtils::read(input, &hash_); if (hash_ != hash()) { LU_LOG(LogUtils::LogLevel_Warning, _module_ " read state hash does not match"); }
+#define A32U4_CHECK_HASH_(_module_) uint32_t hash_; StreamUtils::read(input, &hash_); if (hash_ != hash()) { LU_LOG_(LogUtils::LogLevel_Warning, _module_ " read state hash does not match"); }
+#define A32U4_SKIP_HASH() uint32_t hash_; StreamUtils::read(input, &hash_)
 #else
 #define A32U4_CHECK_HASH(_module_) 
+#define A32U4_CHECK_HASH_(_module_) 
+#define A32U4_SKIP_HASH()
 #endif
 
 namespace A32u4 {
 	class ATmega32u4 {
 	private:
 		friend DataSpace;
+		friend CPU;
+		friend class InterleavedScheduler;
+		friend class SaveState;
 		LogUtils::LogCallB logCallB = defaultLogHandler;
 		void* logCallBUserData = nullptr;
 
 		bool running = false;
+		std::atomic<bool> stopRequested{false}; // not copied
 		std::function<void(uint8_t pinReg, reg_t oldVal, reg_t val)> pinChangeCallB = nullptr;
+	public:
+		struct PinChange {
+			uint64_t cycle;
+			uint8_t pinReg;
+			reg_t oldVal;
+			reg_t val;
+		};
+	private:
+		// ring buffer of pin changes, only used if it has a size
+		std::vector<PinChange> pinChangeQueue;
+		size_t pinChangeQueueStart = 0;
+		size_t pinChangeQueueLen = 0;
+		uint64_t pinChangeQueueOverflows = 0;
+
+		void queuePinChange(uint8_t pinReg, reg_t oldVal, reg_t val);
 	public:
 		struct InterruptInfo {
 			addrmcu_t addr;
@@ -104,6 +131,13 @@ namespace A32u4 {
 			{ 0x0054, "TIMER4 FPF", "Timer/Counter4 Fault Protection Interrupt" },
 		};
 
+		enum {
+			StopReason_Done = 0,   // executed the requested amount of cycles
+			StopReason_Requested,  // requestStop() was called
+			StopReason_Halted,     // the debugger halted
+			StopReason_NoProgram
+		};
+
 		enum {
 			PinChange_PORTB = 0,
 			PinChange_PORTC,
@@ -119,6 +153,7 @@ namespace A32u4 {
 		A32u4::CPU cpu;
 		A32u4::DataSpace dataspace;
 		A32u4::Flash flash;
+		A32u4::USB usb;
 
 #if MCU_INCLUDE_EXTRAS
 		A32u4::Debugger debugger;
@@ -129,12 +164,19 @@ namespace A32u4 {
 
 		void resetHardware();
 
+		void watchdogReset();
+
 		void powerOn();
 
-		void execute(uint64_t cyclAmt, bool debug);
+		uint8_t execute(uint64_t cyclAmt, bool debug); // returns StopReason_x
+
+		// may be called from any thread, stops the running (or otherwise the next) execute within CPU::stopCheckCycls cycles
+		void requestStop();
 
 		bool loadFile(const char* path);
 
+		// makes this instance the global target of logs that have no instance (e.g. from the Disassembler)
+		// everything else always logs to its own instance, so this is not needed when running multiple instances
 		void activateLog();
 
 		static void _log(uint8_t logLevel, const char* msg, const char* fileName, int lineNum, const char* module, void* userData);
@@ -144,8 +186,28 @@ namespace A32u4 {
 
 		void setPinChangeCallB(const std::function<void(uint8_t pinReg, reg_t oldVal, reg_t val)>& callB);
 
+		void setPinChangeQueueSize(size_t size); // 0 disables the queue, pending entries are discarded
+		size_t getPinChangeQueueSize() const;
+		size_t getPinChangeQueueLen() const;
+		size_t drainPinChanges(PinChange* out, size_t maxLen); // returns the amount of entries written to out (oldest first)
+		uint64_t getPinChangeQueueOverflows() const; // amount of entries that were dropped because the queue was full
+
+		// the stream starts with stateStreamMagic and stateStreamVersion, bump the version (and handle the old one in setState) when the layout changes
+		// streams without the magic are version 0, the layout from before it was versioned
+		static constexpr uint32_t stateStreamMagic = 0x53323341; // "A32S", its first byte is never a valid running flag
+		static constexpr uint32_t stateStreamVersion = 1;
 		void getState(std::ostream& output);
-		void setState(std::istream& input);
+		void setState(std::istream& input); // sets the failbit of input if the stream has an unknown version
+
+		enum {
+			StateFlag_Flash = 1<<0,  // not needed as long as the program doesnt change (e.g. for rewinding)
+			StateFlag_Extras = 1<<1  // debugger and analytics, they go through their stream getState so this is slower
+		};
+		// fixed layout state in a caller provided buffer: cpu, data space, eeprom and usb are copied with a few memcpys, without hashes
+		// the stream getState/setState stay the portable format, this one is meant for rewinding and searching within one build
+		size_t getStateSize(uint8_t flags); // with StateFlag_Extras it depends on the current state of the extras
+		size_t saveState(uint8_t* buf, size_t len, uint8_t flags = 0); // returns the amount of bytes written, 0 if len is too small
+		size_t loadState(const uint8_t* buf, size_t len); // returns the amount of bytes read, 0 if buf doesnt hold a state of the right size
 		
 		bool operator==(const ATmega32u4& other) const;
 		size_t sizeBytes() const;
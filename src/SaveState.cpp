@@ -0,0 +1,370 @@
+#include "SaveState.h"
+
+#include <cstring>
+#include <fstream>
+
+#include "ATmega32u4.h"
+#include "utils/StateBuffer.h"
+
+#define LU_MODULE "SaveState"
+
+static_assert(sizeof(A32u4::SaveState::Header) == 40, "SaveState::Header has padding");
+static_assert(sizeof(A32u4::SaveState::Section) == 32, "SaveState::Section has padding");
+
+namespace {
+	struct Crc32Table {
+		uint32_t t[256];
+		constexpr Crc32Table() : t() {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++) {
+					c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+				}
+				t[i] = c;
+			}
+		}
+	};
+	constexpr Crc32Table crcTable;
+
+	size_t alignUp(size_t v) {
+		return (v + A32u4::SaveState::sectionAlign - 1) & ~(A32u4::SaveState::sectionAlign - 1);
+	}
+}
+
+uint32_t A32u4::SaveState::checksum(const uint8_t* data, size_t len) {
+	uint32_t c = 0xFFFFFFFF;
+	for (size_t i = 0; i < len; i++) {
+		c = crcTable.t[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+	}
+	return c ^ 0xFFFFFFFF;
+}
+
+bool A32u4::SaveState::migrateSection(uint32_t id, uint32_t version, std::vector<uint8_t>* data) {
+	// one case per layout change, converting version to version+1, e.g.:
+	// case Section_CPU: if (version == 1) { /* insert the new field with its reset value */ return true; } break;
+	switch (id) {
+		default:
+			break;
+	}
+	(void)version;
+	(void)data;
+	return false;
+}
+
+A32u4::SaveState::SaveState() {
+
+}
+
+bool A32u4::SaveState::save(ATmega32u4* mcu, std::vector<uint8_t>* out, uint8_t flags) {
+#if !MCU_INCLUDE_EXTRAS
+	flags &= ~ATmega32u4::StateFlag_Extras;
+#endif
+
+	size_t sizes[Section_COUNT] = {};
+	sizes[Section_MCU] = sizeof(mcu->running);
+	sizes[Section_CPU] = CPU::getStateBufSize();
+	sizes[Section_RAM] = DataSpace::Consts::data_size;
+	sizes[Section_EEPROM] = DataSpace::Consts::eeprom_size;
+	sizes[Section_Periph] = DataSpace::getPeriphStateBufSize();
+	sizes[Section_USB] = USB::getStateBufSize();
+
+	uint32_t ids[Section_COUNT];
+	uint32_t numSections = 0;
+	for (uint32_t id = Section_MCU; id <= Section_USB; id++) {
+		ids[numSections++] = id;
+	}
+	if (flags & ATmega32u4::StateFlag_Flash) {
+		sizes[Section_FlashImage] = Flash::sizeMax;
+		sizes[Section_FlashInfo] = Flash::getInfoStateBufSize();
+		ids[numSections++] = Section_FlashImage;
+		ids[numSections++] = Section_FlashInfo;
+	}
+#if MCU_INCLUDE_EXTRAS
+	if (flags & ATmega32u4::StateFlag_Extras) {
+		StateStreamBuf counter((uint8_t*)nullptr, 0);
+		std::ostream stream(&counter);
+		mcu->debugger.getState(stream);
+		mcu->analytics.getState(stream);
+		sizes[Section_Extras] = counter.written();
+		ids[numSections++] = Section_Extras;
+	}
+#endif
+
+	Section table[Section_COUNT];
+	size_t off = alignUp(sizeof(Header) + numSections * sizeof(Section));
+	for (uint32_t i = 0; i < numSections; i++) {
+		table[i] = { ids[i], sectionVersions[ids[i]], off, sizes[ids[i]], 0, 0 };
+		off = alignUp(off + sizes[ids[i]]);
+	}
+
+	out->assign(off, 0);
+	uint8_t* buf = out->data();
+	for (uint32_t i = 0; i < numSections; i++) {
+		StateWriter output{ buf + table[i].offset };
+		switch (table[i].id) {
+			case Section_MCU:
+				output.write(mcu->running);
+				break;
+			case Section_CPU:
+				mcu->cpu.getState(output);
+				break;
+			case Section_RAM:
+				mcu->dataspace.getRamState(output);
+				break;
+			case Section_EEPROM:
+				mcu->dataspace.getEepromState(output);
+				break;
+			case Section_Periph:
+				mcu->dataspace.getPeriphState(output);
+				break;
+			case Section_USB:
+				mcu->usb.getState(output);
+				break;
+			case Section_FlashImage:
+				mcu->flash.getImageState(output);
+				break;
+			case Section_FlashInfo:
+				mcu->flash.getInfoState(output);
+				break;
+#if MCU_INCLUDE_EXTRAS
+			case Section_Extras: {
+				StateStreamBuf streamBuf(output.ptr, (size_t)table[i].size);
+				std::ostream stream(&streamBuf);
+				mcu->debugger.getState(stream);
+				mcu->analytics.getState(stream);
+				break;
+			}
+#endif
+		}
+		table[i].checksum = checksum(buf + table[i].offset, (size_t)table[i].size);
+	}
+
+	Header header;
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = formatVersion;
+	header.byteOrder = byteOrderMark;
+	header.headerSize = sizeof(Header);
+	header.sectionEntrySize = sizeof(Section);
+	header.numSections = numSections;
+	header.tableChecksum = checksum((const uint8_t*)table, numSections * sizeof(Section));
+	header.fileSize = off;
+
+	std::memcpy(buf, &header, sizeof(header));
+	std::memcpy(buf + sizeof(Header), table, numSections * sizeof(Section));
+	return true;
+}
+bool A32u4::SaveState::save(ATmega32u4* mcu, const char* path, uint8_t flags) {
+	std::vector<uint8_t> buf;
+	if (!save(mcu, &buf, flags))
+		return false;
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file.write((const char*)buf.data(), buf.size())) {
+		LU_LOGF(LogUtils::LogLevel_Error, "Couldn't write save state to \"%s\"", path);
+		return false;
+	}
+	return true;
+}
+
+bool A32u4::SaveState::open(const char* path) {
+	close();
+	if (!file.open(path, MappedFile::Mode_Read))
+		return false;
+	base = file.data();
+	len = file.size();
+	if (!parse()) {
+		close();
+		return false;
+	}
+	return true;
+}
+bool A32u4::SaveState::openMemory(const uint8_t* data, size_t len_) {
+	close();
+	base = data;
+	len = len_;
+	if (!parse()) {
+		close();
+		return false;
+	}
+	return true;
+}
+void A32u4::SaveState::close() {
+	file.close();
+	base = nullptr;
+	len = 0;
+	version = 0;
+	sections.clear();
+}
+bool A32u4::SaveState::isOpen() const {
+	return base != nullptr;
+}
+
+bool A32u4::SaveState::parse() {
+	if (!base || len == 0)
+		return false;
+
+	Header header;
+	if (len < sizeof(Header) || std::memcmp(base, magic, sizeof(magic)) != 0) {
+		version = 0; // plain stream, it can only be checked by loading it
+		return true;
+	}
+	std::memcpy(&header, base, sizeof(header));
+
+	// later versions may only add fields to the end of the header and the section entries
+	if (header.version == 0 || header.version > formatVersion || header.byteOrder != byteOrderMark)
+		return false;
+	if (header.headerSize < sizeof(Header) || header.sectionEntrySize < sizeof(Section) || header.fileSize > len)
+		return false;
+	const uint64_t tableSize = (uint64_t)header.numSections * header.sectionEntrySize;
+	if (header.headerSize + tableSize > header.fileSize)
+		return false;
+	if (header.sectionEntrySize == sizeof(Section) && checksum(base + header.headerSize, (size_t)tableSize) != header.tableChecksum)
+		return false;
+
+	sections.resize(header.numSections);
+	for (uint32_t i = 0; i < header.numSections; i++) {
+		std::memcpy(&sections[i], base + header.headerSize + (size_t)i * header.sectionEntrySize, sizeof(Section));
+		const Section& s = sections[i];
+		if (s.offset > header.fileSize || s.size > header.fileSize - s.offset)
+			return false;
+	}
+	version = header.version;
+	return true;
+}
+
+uint32_t A32u4::SaveState::getVersion() const {
+	return version;
+}
+size_t A32u4::SaveState::getNumSections() const {
+	return sections.size();
+}
+const A32u4::SaveState::Section* A32u4::SaveState::getSectionEntry(size_t ind) const {
+	return ind < sections.size() ? &sections[ind] : nullptr;
+}
+const A32u4::SaveState::Section* A32u4::SaveState::findSection(uint32_t id) const {
+	for (const auto& s : sections) {
+		if (s.id == id)
+			return &s;
+	}
+	return nullptr;
+}
+A32u4::Span<const uint8_t> A32u4::SaveState::getSection(uint32_t id) const {
+	const Section* s = findSection(id);
+	if (!s)
+		return {};
+	return { base + s->offset, (size_t)s->size };
+}
+A32u4::Span<const uint8_t> A32u4::SaveState::getCurrentSection(uint32_t id, std::vector<uint8_t>* tmp) const {
+	const Section* s = findSection(id);
+	if (!s || s->version > sectionVersions[id])
+		return {};
+	if (s->version == sectionVersions[id])
+		return { base + s->offset, (size_t)s->size };
+
+	tmp->assign(base + s->offset, base + s->offset + s->size);
+	for (uint32_t v = s->version; v < sectionVersions[id]; v++) {
+		if (!migrateSection(id, v, tmp))
+			return {};
+	}
+	return { tmp->data(), tmp->size() };
+}
+
+bool A32u4::SaveState::verify() const {
+	for (const auto& s : sections) {
+		if (checksum(base + s.offset, (size_t)s.size) != s.checksum)
+			return false;
+	}
+	return true;
+}
+
+bool A32u4::SaveState::load(ATmega32u4* mcu, bool verifyChecksums) const {
+	if (!isOpen())
+		return false;
+
+	if (version == 0) {
+		// the stream can only be checked by reading it, so it goes into a scratch instance first
+		ATmega32u4 tmp;
+		tmp.setLogCallB(mcu->logCallB, mcu->logCallBUserData);
+		StateStreamBuf streamBuf(base, len);
+		std::istream stream(&streamBuf);
+		tmp.setState(stream);
+		if (!stream) {
+			LU_LOG(LogUtils::LogLevel_Error, "Couldn't load save state: the stream ended early or has an unknown version");
+			return false;
+		}
+
+		const uint8_t flags = ATmega32u4::StateFlag_Flash | ATmega32u4::StateFlag_Extras;
+		std::vector<uint8_t> buf(tmp.getStateSize(flags));
+		const size_t size = tmp.saveState(buf.data(), buf.size(), flags);
+		return size != 0 && mcu->loadState(buf.data(), size) == size;
+	}
+
+	if (verifyChecksums && !verify()) {
+		LU_LOG(LogUtils::LogLevel_Error, "Couldn't load save state: checksum mismatch");
+		return false;
+	}
+
+	// check everything before touching the instance, so a broken file doesnt leave it half loaded
+	std::vector<uint8_t> tmp[Section_COUNT];
+	Span<const uint8_t> content[Section_COUNT];
+	size_t expected[Section_COUNT] = {};
+	expected[Section_MCU] = sizeof(mcu->running);
+	expected[Section_CPU] = CPU::getStateBufSize();
+	expected[Section_RAM] = DataSpace::Consts::data_size;
+	expected[Section_EEPROM] = DataSpace::Consts::eeprom_size;
+	expected[Section_Periph] = DataSpace::getPeriphStateBufSize();
+	expected[Section_USB] = USB::getStateBufSize();
+	expected[Section_FlashImage] = Flash::sizeMax;
+	expected[Section_FlashInfo] = Flash::getInfoStateBufSize();
+
+	for (uint32_t id = 0; id < Section_COUNT; id++) {
+		const bool present = findSection(id) != nullptr;
+		const bool optional = id == Section_FlashImage || id == Section_FlashInfo || id == Section_Extras;
+		if (!present) {
+			if (optional)
+				continue;
+			LU_LOGF(LogUtils::LogLevel_Error, "Couldn't load save state: section %" PRIu32 " is missing", id);
+			return false;
+		}
+
+		content[id] = getCurrentSection(id, &tmp[id]);
+		if (content[id].data() == nullptr || (id != Section_Extras && content[id].size() != expected[id])) {
+			LU_LOGF(LogUtils::LogLevel_Error, "Couldn't load save state: section %" PRIu32 " has an unknown version or the wrong size", id);
+			return false;
+		}
+	}
+	if ((content[Section_FlashImage].data() == nullptr) != (content[Section_FlashInfo].data() == nullptr)) {
+		LU_LOG(LogUtils::LogLevel_Error, "Couldn't load save state: only one of the flash sections is present");
+		return false;
+	}
+
+	StateReader input{ content[Section_MCU].data() };
+	input.read(&mcu->running);
+	input.ptr = content[Section_CPU].data();
+	mcu->cpu.setState(input);
+	input.ptr = content[Section_RAM].data();
+	mcu->dataspace.setRamState(input);
+	input.ptr = content[Section_EEPROM].data();
+	mcu->dataspace.setEepromState(input);
+	input.ptr = content[Section_Periph].data();
+	mcu->dataspace.setPeriphState(input);
+	input.ptr = content[Section_USB].data();
+	mcu->usb.setState(input);
+
+	if (content[Section_FlashImage].data()) {
+		input.ptr = content[Section_FlashImage].data();
+		mcu->flash.setImageState(input);
+		input.ptr = content[Section_FlashInfo].data();
+		mcu->flash.setInfoState(input);
+	}
+
+#if MCU_INCLUDE_EXTRAS
+	if (content[Section_Extras].data()) {
+		StateStreamBuf streamBuf(content[Section_Extras].data(), content[Section_Extras].size());
+		std::istream stream(&streamBuf);
+		mcu->debugger.setState(stream);
+		mcu->analytics.setState(stream);
+	}
+#endif
+	return true;
+}
@@ -0,0 +1,106 @@
+#ifndef __A32U4_SAVESTATE_H__
+#define __A32U4_SAVESTATE_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "config.h"
+#include "A32u4Types.h"
+#include "utils/MappedFile.h"
+
+namespace A32u4 {
+	class ATmega32u4;
+
+	// versioned container for the state of an instance
+	//
+	// layout (host byte order, Header::byteOrder tells which one that was):
+	//   Header                       at 0
+	//   Section[Header::numSections] at Header::headerSize, each Header::sectionEntrySize bytes
+	//   the content of the sections, each aligned to sectionAlign, so ram and flash can be used in place from a mapped file
+	// every section has its own layout version and checksum (crc32), the table has one too
+	// sections with an older version are converted by migrateSection when loading, unknown sections are skipped
+	//
+	// files without the magic are treated as version 0: the plain stream of ATmega32u4::getState (any of its versions, see ATmega32u4::stateStreamVersion)
+	class SaveState {
+	public:
+		static constexpr uint32_t formatVersion = 1;
+		static constexpr char magic[8] = { 'A','3','2','U','4','S','S','\0' };
+		static constexpr uint32_t byteOrderMark = 0x01020304;
+		static constexpr size_t sectionAlign = 64;
+
+		enum {
+			Section_MCU = 0,     // running
+			Section_CPU,         // CPU::getState(StateWriter&)
+			Section_RAM,         // the whole data space (DataSpace::Consts::data_size bytes)
+			Section_EEPROM,      // DataSpace::Consts::eeprom_size bytes
+			Section_Periph,      // DataSpace::getPeriphState
+			Section_USB,         // USB::getState(StateWriter&)
+			Section_FlashImage,  // Flash::sizeMax bytes, optional
+			Section_FlashInfo,   // Flash::getInfoState, present if the image is
+			Section_Extras,      // debugger and analytics in their stream format, optional
+			Section_COUNT
+		};
+		// current layout version of every section, bump it (and add a case to migrateSection) when a layout changes
+		static constexpr uint32_t sectionVersions[Section_COUNT] = { 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+
+		struct Header {
+			char magic[8];
+			uint32_t version; // formatVersion
+			uint32_t byteOrder; // byteOrderMark
+			uint32_t headerSize;
+			uint32_t sectionEntrySize;
+			uint32_t numSections;
+			uint32_t tableChecksum; // crc32 of the section table
+			uint64_t fileSize;
+		};
+		struct Section {
+			uint32_t id; // Section_x
+			uint32_t version;
+			uint64_t offset;
+			uint64_t size;
+			uint32_t checksum; // crc32 of the content
+			uint32_t reserved;
+		};
+	private:
+		MappedFile file;
+		const uint8_t* base = nullptr;
+		size_t len = 0;
+		uint32_t version = 0;
+		std::vector<Section> sections;
+
+		bool parse();
+		const Section* findSection(uint32_t id) const;
+		// points into the file if the section has the current version, otherwise it is migrated into tmp
+		Span<const uint8_t> getCurrentSection(uint32_t id, std::vector<uint8_t>* tmp) const;
+	public:
+		SaveState();
+		SaveState(const SaveState&) = delete;
+		SaveState& operator=(const SaveState&) = delete;
+
+		// flags are ATmega32u4::StateFlag_x
+		static bool save(ATmega32u4* mcu, std::vector<uint8_t>* out, uint8_t flags = 0);
+		static bool save(ATmega32u4* mcu, const char* path, uint8_t flags = 0);
+
+		// the file is mapped read only, it is not read until a section is accessed
+		bool open(const char* path);
+		// data has to stay valid while this is open
+		bool openMemory(const uint8_t* data, size_t len);
+		void close();
+		bool isOpen() const;
+
+		uint32_t getVersion() const; // 0 for the plain stream format
+		size_t getNumSections() const;
+		const Section* getSectionEntry(size_t ind) const;
+		// raw content as stored (version getSectionEntry().version), empty if there is no such section
+		Span<const uint8_t> getSection(uint32_t id) const;
+
+		bool verify() const; // checks the checksums of all sections
+		bool load(ATmega32u4* mcu, bool verifyChecksums = true) const;
+
+		static uint32_t checksum(const uint8_t* data, size_t len);
+		// converts data from version to the next one, returns false if there is no way to
+		static bool migrateSection(uint32_t id, uint32_t version, std::vector<uint8_t>* data);
+	};
+}
+
+#endif
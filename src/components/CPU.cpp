@@ -3,6 +3,7 @@
 #include <functional>
 
 #include "../utils/bitMacros.h"
+#include "../utils/StateBuffer.h"
 #include "StreamUtils.h"
 #include "DataUtils.h"
 
@@ -62,15 +63,14 @@ void A32u4::CPU::executeInterrupts() {
 }
 void A32u4::CPU::directExecuteInterrupt(uint8_t num) {
 	insideInterrupt = true;
-	static uint64_t count = 0;
-	count++;
-	//printf("cnt: %llu\n", count);
 
 	if (CPU_sleep) {
 		CPU_sleep = false;
 		totalCycls += 5;
 	}
 
+	mcu->dataspace.sreg[DataSpace::Consts::SREG_I] = 0; // global interrupt enable gets cleared when entering an interrupt, RETI sets it again
+
 	mcu->dataspace.pushAddrToStack(mcu->cpu.PC);
 
 	pc_t targetPC = num*2;
@@ -81,6 +81,16 @@ void A32u4::CPU::directExecuteInterrupt(uint8_t num) {
 	mcu->cpu.PC = targetPC;
 }
 
+bool A32u4::CPU::canWakeBy(uint8_t intrNum) const {
+	return !CPU_sleep || (sleepWakeIntrMask[getSleepMode()] & ((uint64_t)1 << intrNum));
+}
+void A32u4::CPU::skipSleepCycles(uint64_t amt) {
+	totalCycls += amt;
+	if (getSleepMode() != SleepMode_Idle) {
+		mcu->dataspace.stallTimers(amt); // clk_IO is halted in every mode except idle, so the timers dont advance
+	}
+}
+
 void A32u4::CPU::breakOutOfOptimisation() {
 	totalCycls |= (uint64_t)1 << 63;
 }
@@ -435,6 +445,9 @@ uint64_t A32u4::CPU::getTotalCycles() const {
 bool A32u4::CPU::isSleeping() const {
 	return CPU_sleep;
 }
+uint8_t A32u4::CPU::getSleepMode() const {
+	return (mcu->dataspace.data[DataSpace::Consts::SMCR] >> DataSpace::Consts::SMCR_SM0) & 0b111;
+}
 
 void A32u4::CPU::getState(std::ostream& output){
 	StreamUtils::write(output, PC);
@@ -465,6 +478,32 @@ void A32u4::CPU::setState(std::istream& input){
 	A32U4_CHECK_HASH("CPU");
 }
 
+size_t A32u4::CPU::getStateBufSize() {
+	return sizeof(PC) + sizeof(totalCycls) + sizeof(targetCycls) + sizeof(interruptFlags) + sizeof(insideInterrupt) + sizeof(CPU_sleep) + sizeof(sleepCycsLeft);
+}
+void A32u4::CPU::getState(StateWriter& output) const {
+	output.write(PC);
+	output.write(totalCycls);
+	output.write(targetCycls);
+
+	output.write(interruptFlags);
+	output.write(insideInterrupt);
+
+	output.write(CPU_sleep);
+	output.write(sleepCycsLeft);
+}
+void A32u4::CPU::setState(StateReader& input) {
+	input.read(&PC);
+	input.read(&totalCycls);
+	input.read(&targetCycls);
+
+	input.read(&interruptFlags);
+	input.read(&insideInterrupt);
+
+	input.read(&CPU_sleep);
+	input.read(&sleepCycsLeft);
+}
+
 bool A32u4::CPU::operator==(const CPU& other) const{
 #define _CMP_(x) (x==other.x)
 	return _CMP_(PC) && _CMP_(totalCycls) && _CMP_(targetCycls) &&
@@ -10,15 +10,29 @@
 
 namespace A32u4 {
 	class ATmega32u4;
+	struct StateWriter;
+	struct StateReader;
 
 	class CPU {
 	public:
 		static constexpr uint64_t ClockFreq = 16000000;
+		static constexpr uint64_t stopCheckCycls = ClockFreq / 1000; // max cycles between checks for a stop request
+
+		enum {
+			SleepMode_Idle = 0,
+			SleepMode_ADCNoiseReduction = 1,
+			SleepMode_PowerDown = 2,
+			SleepMode_PowerSave = 3,
+			SleepMode_Standby = 6,
+			SleepMode_ExtendedStandby = 7
+		};
 	private:
 		friend class ATmega32u4;
 		friend class InstHandler;
 		friend class DataSpace;
 		friend class Debugger;
+		friend class USB;
+		friend class InterleavedScheduler;
 	private:
 		ATmega32u4* mcu;
 
@@ -32,18 +46,40 @@ namespace A32u4 {
 		bool CPU_sleep = false;
 		uint64_t sleepCycsLeft = 0;
 
+		// interrupts (as bits of their vector number) that are able to wake the cpu up in each sleep mode (see datasheet table 7-1)
+		// INT3:0, INT6, PCINT0, USB General, WDT and TWI are asynchronous and can wake it from every mode,
+		// ADC Noise Reduction additionally keeps ADC, EEPROM ready and SPM ready alive, Idle can be woken by everything
+		static constexpr uint64_t sleepWakeIntrMask_Async = 
+			((uint64_t)1 << 1) | ((uint64_t)1 << 2) | ((uint64_t)1 << 3) | ((uint64_t)1 << 4) | ((uint64_t)1 << 7) | // INT0-3, INT6
+			((uint64_t)1 << 9) | ((uint64_t)1 << 10) | ((uint64_t)1 << 12) | ((uint64_t)1 << 36); // PCINT0, USB General, WDT, TWI
+		static constexpr uint64_t sleepWakeIntrMask[8] = {
+			(uint64_t)-1, // Idle
+			sleepWakeIntrMask_Async | ((uint64_t)1 << 29) | ((uint64_t)1 << 30) | ((uint64_t)1 << 37), // ADC Noise Reduction (+ ADC, EE READY, SPM READY)
+			sleepWakeIntrMask_Async, // Power-down
+			sleepWakeIntrMask_Async, // Power-save
+			0, // Reserved
+			0, // Reserved
+			sleepWakeIntrMask_Async, // Standby
+			sleepWakeIntrMask_Async  // Extended Standby
+		};
+
 		CPU(ATmega32u4* mcu_);
 
+		// return ATmega32u4::StopReason_x
+		template<bool debug>
+		uint8_t execute(uint64_t amt);
 		template<bool debug>
-		void execute(uint64_t amt);
+		uint8_t execute4T(uint64_t amt);
 		template<bool debug>
-		void execute4T(uint64_t amt);
+		bool executeBlock(); // runs until targetCycls, returns false if the debugger halted
 
 		void executeError();
 
 		void queueInterrupt(uint16_t addr);
 		void executeInterrupts();
 		void directExecuteInterrupt(uint8_t num);
+		bool canWakeBy(uint8_t intrNum) const;
+		void skipSleepCycles(uint64_t amt);
 
 		void setFlags_NZ(uint8_t res);
 		void setFlags_NZ(uint16_t res);
@@ -58,6 +94,8 @@ namespace A32u4 {
 
 		void reset();
 
+		// makes the cpu loop reevaluate interrupts and events after the current instruction
+		// only for use on the emulating thread, use ATmega32u4::requestStop from others
 		void breakOutOfOptimisation();
 	public:
 		pc_t& getPCRef();
@@ -65,9 +103,14 @@ namespace A32u4 {
 		addrmcu_t getPCAddr() const;
 		uint64_t getTotalCycles() const;
 		bool isSleeping() const;
+		uint8_t getSleepMode() const;
 
 		void getState(std::ostream& output);
 		void setState(std::istream& input);
+		// fixed layout without hashes, for ATmega32u4::saveState
+		static size_t getStateBufSize();
+		void getState(StateWriter& output) const;
+		void setState(StateReader& input);
 
 		bool operator==(const CPU& other) const;
 		size_t sizeBytes() const;
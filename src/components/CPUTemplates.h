@@ -2,25 +2,47 @@
 #include "../A32u4Types.h"
 
 template<bool debug>
-void A32u4::CPU::execute(uint64_t amt) {
+uint8_t A32u4::CPU::execute(uint64_t amt) {
 #if MCU_INCLUDE_EXTRAS
 	if (debug) {
 		if (mcu->debugger.execShouldReturn()) {
-			return;
+			return ATmega32u4::StopReason_Halted;
 		}
 	}
 #endif
-	execute4T<debug>(amt);
+	return execute4T<debug>(amt);
 }
 
 #define CHECK_BUG 0
 
 template<bool debug>
-void A32u4::CPU::execute4T(uint64_t amt) {
-	targetCycls += amt;
+uint8_t A32u4::CPU::execute4T(uint64_t amt) {
+	// run in blocks of at most stopCheckCycls, so a stop request from another thread is seen without checking it on every instruction
+	const uint64_t startTarget = targetCycls;
+	const uint64_t target = targetCycls + amt;
+	for (;;) {
+		if (mcu->stopRequested.load(std::memory_order_relaxed) && mcu->stopRequested.exchange(false, std::memory_order_acquire)) {
+			targetCycls = std::max(startTarget, totalCycls); // drop the rest
+			return ATmega32u4::StopReason_Requested;
+		}
+
+		targetCycls = std::min(target, std::max(targetCycls, totalCycls) + stopCheckCycls);
+		if (!executeBlock<debug>()) {
+			targetCycls = std::max(startTarget, totalCycls);
+			return ATmega32u4::StopReason_Halted;
+		}
+
+		if (targetCycls >= target)
+			return ATmega32u4::StopReason_Done;
+	}
+}
 
+template<bool debug>
+bool A32u4::CPU::executeBlock() {
 	totalCycls &= ~((uint64_t)1 << 63); // clear highest bit, that could be set by breakOutOfOptim
 
+	mcu->dataspace.checkForIntr(); // flags might have been raised from the outside since the last call (e.g. pin changes)
+
 #if CHECK_BUG
 	size_t cnt = 0;
 #endif
@@ -36,8 +58,7 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 
 #if MCU_INCLUDE_EXTRAS
 		if (mcu->debugger.isHalted() && !mcu->debugger.doStep) {
-			targetCycls = std::max(targetCycls - amt, totalCycls);
-			return;
+			return false;
 		}
 #endif
 
@@ -47,11 +68,18 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 					InstHandler::inst_effect_t res = InstHandler::handleCurrentInstT<debug>(mcu);
 					totalCycls += res.addToCycs;
 					PC += res.addToPC;
+					if((totalCycls & ((uint64_t)1 << 63)) || totalCycls >= mcu->dataspace.events.next) { // something requested a reevaluation or an event is due, so check if an interrupt can occur now
+						totalCycls &= ~((uint64_t)1 << 63);
+						mcu->dataspace.processEvents();
+						mcu->dataspace.checkForIntr();
+					}
 				}else{
 					InstHandler::inst_effect_t res = InstHandler::handleCurrentInstT<debug>(mcu);
 					totalCycls += res.addToCycs;
 					PC += res.addToPC;
 					mcu->dataspace.doTicks(res.addToCycs);
+					if(getTotalCycles() >= mcu->dataspace.events.next)
+						mcu->dataspace.processEvents();
 					mcu->dataspace.checkForIntr();
 				}
 				totalCycls &= ~((uint64_t)1 << 63); // clear highest bit, that could be set by breakOutOfOptim
@@ -61,6 +89,9 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 				
 				uint64_t currTargetCycls = cycsToNextInt==(size_t)-1 ? -1 : totalCycls + cycsToNextInt;
 				
+				if (currTargetCycls > mcu->dataspace.events.next) {
+					currTargetCycls = mcu->dataspace.events.next;
+				}
 				if (currTargetCycls > targetCycls) {
 					currTargetCycls = targetCycls;
 				}
@@ -72,6 +103,7 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 				}
 				totalCycls &= ~((uint64_t)1 << 63); // clear highest bit, that could be set by breakOutOfOptim
 
+				mcu->dataspace.processEvents();
 				mcu->dataspace.updateTimers();
 			}
 		}
@@ -81,18 +113,16 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 			addCycles((uint8_t)1);
 			mcu->dataspace.timers.update();
 #else
+			sleepCycsLeft = mcu->dataspace.cycsToNextWakeEvent();
 			if (sleepCycsLeft == 0) {
-				sleepCycsLeft = mcu->dataspace.cycsToNextTimerInt();
-				if(sleepCycsLeft == 0) {
-					printf("AAAA");
-				}
-				//printf("entering sleep for: %llu, with t:%d at %llu\n", sleepCycsLeft, mcu->dataspace.getByteRefAtAddr(DataSpace::Consts::TCNT0), mcu->cpu.totalCycls);
+				sleepCycsLeft = 1; // the wake event is due but couldnt wake us (e.g. interrupts disabled), so dont get stuck on it
 			}
 
 			if (sleepCycsLeft <= (targetCycls - totalCycls) ) {
-				// done sleeping
-				totalCycls += sleepCycsLeft;
+				// skip directly to the wake event
+				skipSleepCycles(sleepCycsLeft);
 
+				mcu->dataspace.processEvents();
 				mcu->dataspace.updateTimers();
 
 #if MCU_INCLUDE_EXTRAS
@@ -100,11 +130,11 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 					mcu->analytics.sleepSum += sleepCycsLeft;
 				}
 #endif
-				//printf("done: slept for: %llu at %llu\n", sleepCycsLeft, mcu->cpu.totalCycls);
 				sleepCycsLeft = 0;
 				totalCycls &= ~((uint64_t)1 << 63); // clear highest bit, that could be set by breakOutOfOptim
 			}
 			else {
+				// nothing will wake us in this slice, so just skip to its end
 				uint64_t skipCycs = targetCycls - totalCycls;
 				sleepCycsLeft -= skipCycs;
 
@@ -114,9 +144,7 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 				}
 #endif
 
-				totalCycls += skipCycs;
-				//mcu->dataspace.updateTimers();
-				//printf("slept for: %llu, %llu left, continuing later\n", skipCycs, sleepCycsLeft);
+				skipSleepCycles(skipCycs);
 			}
 #endif
 		}
@@ -125,4 +153,5 @@ void A32u4::CPU::execute4T(uint64_t amt) {
 	}
 	
 	DU_ASSERT(totalCycls == getTotalCycles());
+	return true;
 }
\ No newline at end of file
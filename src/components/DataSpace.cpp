@@ -1,13 +1,18 @@
 #include "DataSpace.h"
 
 #include <iostream>
+#include <algorithm>
 
 #include "../utils/bitMacros.h"
+#include "../utils/StateBuffer.h"
 #include "StreamUtils.h"
 #include "DataUtils.h"
 
 #include "../ATmega32u4.h"
 #include "../extras/Debugger.h"
+#include "../devices/SSD1306.h"
+#include "../devices/AudioSink.h"
+#include "../devices/SPIFlash.h"
 
 #define LU_MODULE "DataSpace"
 
@@ -18,6 +23,9 @@ void A32u4::DataSpace::LastSet::getState(std::ostream& output){
 	StreamUtils::write(output, Timer0Update);
 	StreamUtils::write(output, Timer3Update);
 	StreamUtils::write(output, Timer4Update);
+	StreamUtils::write(output, WDTCSR_WDCE);
+	StreamUtils::write(output, WDTReset);
+	StreamUtils::write(output, SPMCSR_SPMEN);
 }
 void A32u4::DataSpace::LastSet::setState(std::istream& input){
 	StreamUtils::read(input, &EECR_EEMPE);
@@ -26,6 +34,9 @@ void A32u4::DataSpace::LastSet::setState(std::istream& input){
 	StreamUtils::read(input, &Timer0Update);
 	StreamUtils::read(input, &Timer3Update);
 	StreamUtils::read(input, &Timer4Update);
+	StreamUtils::read(input, &WDTCSR_WDCE);
+	StreamUtils::read(input, &WDTReset);
+	StreamUtils::read(input, &SPMCSR_SPMEN);
 }
 
 void A32u4::DataSpace::LastSet::resetAll() {
@@ -35,12 +46,16 @@ void A32u4::DataSpace::LastSet::resetAll() {
 	Timer0Update = 0;
 	Timer3Update = 0;
 	Timer4Update = 0;
+	WDTCSR_WDCE = 0;
+	WDTReset = 0;
+	SPMCSR_SPMEN = 0;
 }
 
 bool A32u4::DataSpace::LastSet::operator==(const LastSet& other) const{
 #define _CMP_(x) (x==other.x)
 	return _CMP_(EECR_EEMPE) && _CMP_(PLLCSR_PLLE) && _CMP_(ADCSRA_ADSC) && 
-	_CMP_(Timer0Update) && _CMP_(Timer3Update) && _CMP_(Timer4Update);
+	_CMP_(Timer0Update) && _CMP_(Timer3Update) && _CMP_(Timer4Update) &&
+	_CMP_(WDTCSR_WDCE) && _CMP_(WDTReset) && _CMP_(SPMCSR_SPMEN);
 #undef _CMP_
 }
 
@@ -52,6 +67,9 @@ size_t A32u4::DataSpace::LastSet::sizeBytes() const {
 	sum += sizeof(Timer0Update);
 	sum += sizeof(Timer3Update);
 	sum += sizeof(Timer4Update);
+	sum += sizeof(WDTCSR_WDCE);
+	sum += sizeof(WDTReset);
+	sum += sizeof(SPMCSR_SPMEN);
 	return sum;
 }
 uint32_t A32u4::DataSpace::LastSet::hash() const noexcept{
@@ -62,6 +80,121 @@ uint32_t A32u4::DataSpace::LastSet::hash() const noexcept{
 	DU_HASHC(h,Timer0Update);
 	DU_HASHC(h,Timer3Update);
 	DU_HASHC(h,Timer4Update);
+	DU_HASHC(h,WDTCSR_WDCE);
+	DU_HASHC(h,WDTReset);
+	DU_HASHC(h,SPMCSR_SPMEN);
+	return h;
+}
+
+// ##### Events #####
+
+A32u4::DataSpace::Events::Events() {
+	resetAll();
+}
+
+void A32u4::DataSpace::Events::schedule(uint8_t id, uint64_t cycs) {
+	DU_ASSERT(id < Event_COUNT);
+	const bool wasNext = at[id] == next;
+	at[id] = cycs;
+	if (cycs <= next) {
+		next = cycs;
+	}
+	else if (wasNext) { // the earliest event was moved back, so we need to look for the new earliest one
+		updateNext();
+	}
+}
+void A32u4::DataSpace::Events::cancel(uint8_t id) {
+	DU_ASSERT(id < Event_COUNT);
+	const bool wasNext = at[id] == next;
+	at[id] = None;
+	if (wasNext)
+		updateNext();
+}
+void A32u4::DataSpace::Events::updateNext() {
+	next = None;
+	for (size_t i = 0; i < Event_COUNT; i++) {
+		if (at[i] < next)
+			next = at[i];
+	}
+}
+
+void A32u4::DataSpace::Events::getState(std::ostream& output){
+	for (size_t i = 0; i < Event_COUNT; i++) {
+		StreamUtils::write(output, at[i]);
+	}
+}
+void A32u4::DataSpace::Events::setState(std::istream& input){
+	for (size_t i = 0; i < Event_COUNT; i++) {
+		StreamUtils::read(input, &at[i]);
+	}
+	updateNext();
+}
+
+void A32u4::DataSpace::Events::resetAll() {
+	for (size_t i = 0; i < Event_COUNT; i++) {
+		at[i] = None;
+	}
+	next = None;
+}
+
+bool A32u4::DataSpace::Events::operator==(const Events& other) const{
+	return std::equal(at, at+Event_COUNT, other.at);
+}
+
+size_t A32u4::DataSpace::Events::sizeBytes() const {
+	size_t sum = 0;
+	sum += sizeof(at);
+	sum += sizeof(next);
+	return sum;
+}
+uint32_t A32u4::DataSpace::Events::hash() const noexcept{
+	uint32_t h = 0;
+	DU_HASHCB(h, at, sizeof(at));
+	return h;
+}
+
+// ##### Usart #####
+
+void A32u4::DataSpace::Usart::getState(std::ostream& output){
+	StreamUtils::write(output, txShift);
+	StreamUtils::write(output, txBuf);
+	StreamUtils::write(output, txBusy);
+	StreamUtils::write(output, txBufFull);
+}
+void A32u4::DataSpace::Usart::setState(std::istream& input){
+	StreamUtils::read(input, &txShift);
+	StreamUtils::read(input, &txBuf);
+	StreamUtils::read(input, &txBusy);
+	StreamUtils::read(input, &txBufFull);
+}
+
+void A32u4::DataSpace::Usart::resetAll() {
+	txShift = 0;
+	txBuf = 0;
+	txBusy = false;
+	txBufFull = false;
+}
+
+bool A32u4::DataSpace::Usart::operator==(const Usart& other) const{
+#define _CMP_(x) (x==other.x)
+	return _CMP_(txShift) && _CMP_(txBuf) && _CMP_(txBusy) && _CMP_(txBufFull);
+#undef _CMP_
+}
+
+size_t A32u4::DataSpace::Usart::sizeBytes() const {
+	size_t sum = 0;
+	sum += sizeof(txShift);
+	sum += sizeof(txBuf);
+	sum += sizeof(txBusy);
+	sum += sizeof(txBufFull);
+	return sum;
+}
+uint32_t A32u4::DataSpace::Usart::hash() const noexcept{
+	uint32_t h = 0;
+	DU_HASHC(h,txShift);
+	DU_HASHC(h,txBuf);
+	DU_HASHC(h,txBusy);
+	DU_HASHC(h,txBufFull);
 	return h;
 }
 
@@ -69,8 +202,9 @@ uint32_t A32u4::DataSpace::LastSet::hash() const noexcept{
 
 A32u4::DataSpace::DataSpace(ATmega32u4* mcu) : mcu(mcu), 
 #if MCU_USE_HEAP
-data(new uint8_t[Consts::data_size]), eeprom(new uint8_t[Consts::eeprom_size])
+data(new uint8_t[Consts::data_size]), eeprom(new uint8_t[Consts::eeprom_size]),
 #endif
+usart1RxQueue(1024), usart1TxQueue(1024)
 {
 #if 1
 	std::memset(data, 0, Consts::data_size);
@@ -79,6 +213,7 @@ data(new uint8_t[Consts::data_size]), eeprom(new uint8_t[Consts::eeprom_size])
 }
 
 A32u4::DataSpace::~DataSpace() {
+	unmapEEPROM();
 #if MCU_USE_HEAP
 	delete[] data;
 	delete[] eeprom;
@@ -87,18 +222,30 @@ A32u4::DataSpace::~DataSpace() {
 
 A32u4::DataSpace::DataSpace(const DataSpace& src): 
 #if MCU_USE_HEAP
-data(new uint8_t[Consts::data_size]), eeprom(new uint8_t[Consts::eeprom_size])
+data(new uint8_t[Consts::data_size]), eeprom(new uint8_t[Consts::eeprom_size]),
 #endif
+usart1RxQueue(src.usart1RxQueue.capacity()), usart1TxQueue(src.usart1TxQueue.capacity())
 {
 	operator=(src);
 }
 A32u4::DataSpace& A32u4::DataSpace::operator=(const DataSpace& src){
 	std::memcpy(data, src.data, Consts::data_size);
 	std::memcpy(eeprom, src.eeprom, Consts::eeprom_size);
+	markEEPROMChanged();
 
 	std::memcpy(sreg, src.sreg, 8);
 
 	lastSet = src.lastSet;
+	events = src.events;
+	usart1 = src.usart1;
+	getDataLastCycs = (uint64_t)-1;
+
+	// pending host input belongs to the state a copy continues from (events holds the slots that process it)
+	// bytes already transmitted to the host are not copied, they would be read twice
+	inputQueue = src.inputQueue;
+	usart1RxQueue.resize(src.usart1RxQueue.capacity());
+	std::vector<uint8_t> rx(src.usart1RxQueue.size());
+	usart1RxQueue.push(rx.data(), src.usart1RxQueue.peek(rx.data(), rx.size()));
 
 	return *this;
 }
@@ -107,8 +254,13 @@ void A32u4::DataSpace::reset() {
 	std::memset(data, 0, Consts::data_size);
 	resetIO();
 	lastSet.resetAll();
+	events.resetAll();
+	usart1.resetAll();
+	scheduleInput();
+	scheduleDeviceEvents();
 
 	std::memset(sreg, 0, 8); // reset sreg cache
+	getDataLastCycs = (uint64_t)-1;
 }
 void A32u4::DataSpace::resetIO() {
 	//add: set all IO Registers to initial Values
@@ -118,8 +270,10 @@ void A32u4::DataSpace::resetIO() {
 	for (size_t i = 0; i < Consts::ext_io_size; i++) {
 		data[Consts::ext_io_start + i] = 0;
 	}
-	for (size_t i = 0; i < Consts::eeprom_size; i++) {
-		eeprom[i] = 0;
+	if (!isEEPROMMapped()) { // a file backed eeprom keeps its content
+		for (size_t i = 0; i < Consts::eeprom_size; i++) {
+			eeprom[i] = 0;
+		}
 	}
 
 	setSP(Consts::SP_initaddr);
@@ -250,11 +404,60 @@ void A32u4::DataSpace::checkForIntr() {
 	if(!sreg[Consts::SREG_I]) // check if interrupts are disabled
 		return;
 
+	// interrupts are checked in order of their priority (lower vector number => higher priority)
+
+	if (data[Consts::EIMSK]) {
+		const uint8_t extIntr = (data[Consts::EIFR] | getExtIntrLevelMask()) & data[Consts::EIMSK];
+		if (extIntr) {
+			constexpr uint8_t intrNums[] = {1, 2, 3, 4, 0, 0, 7}; // INT0-3, INT6
+			for (uint8_t i = 0; i < 7; i++) {
+				if ((extIntr & (1 << i)) && mcu->cpu.canWakeBy(intrNums[i])) {
+					// edge triggered interrupts are only woken up from by INT6 in idle mode (clk_IO needed)
+					if (i == Consts::EIMSK_INT6 && mcu->cpu.isSleeping() && mcu->cpu.getSleepMode() != CPU::SleepMode_Idle && (data[Consts::EIFR] & (1 << i)))
+						continue;
+					data[Consts::EIFR] &= ~(1 << i); // flag gets cleared when executing the interrupt (level interrupts dont have a flag)
+					mcu->cpu.directExecuteInterrupt(intrNums[i]);
+					return;
+				}
+			}
+		}
+	}
+
+	if ((data[Consts::PCIFR] & (1 << Consts::PCIFR_PCIF0)) && (data[Consts::PCICR] & (1 << Consts::PCICR_PCIE0))) {
+		if (mcu->cpu.canWakeBy(9)) {
+			data[Consts::PCIFR] &= ~(1 << Consts::PCIFR_PCIF0);
+			mcu->cpu.directExecuteInterrupt(9);
+			return;
+		}
+	}
+
+	if (data[Consts::USBCON] & (1 << Consts::USBCON_USBE)) {
+		if (mcu->usb.genIntrPending() && mcu->cpu.canWakeBy(10)) {
+			mcu->cpu.directExecuteInterrupt(10);
+			return;
+		}
+		if (mcu->usb.comIntrPending() && mcu->cpu.canWakeBy(11)) {
+			mcu->cpu.directExecuteInterrupt(11);
+			return;
+		}
+	}
+
+	if ((data[Consts::WDTCSR] & (1 << Consts::WDTCSR_WDIF)) && (data[Consts::WDTCSR] & (1 << Consts::WDTCSR_WDIE))) {
+		if (mcu->cpu.canWakeBy(12)) {
+			data[Consts::WDTCSR] &= ~(1 << Consts::WDTCSR_WDIF);
+			if (data[Consts::WDTCSR] & (1 << Consts::WDTCSR_WDE)) // interrupt and reset mode: the next timeout causes a reset
+				data[Consts::WDTCSR] &= ~(1 << Consts::WDTCSR_WDIE);
+			mcu->cpu.directExecuteInterrupt(12);
+			return;
+		}
+	}
+
 	if (data[Consts::TIFR0] & (1 << Consts::TIFR0_TOV0)) {
-		if (data[Consts::TIMSK0] & (1 << Consts::TIMSK0_TOIE0)) {
+		if (data[Consts::TIMSK0] & (1 << Consts::TIMSK0_TOIE0) && mcu->cpu.canWakeBy(23)) {
 			//mcu->cpu.queueInterrupt(23); // 0x2E timer0 overflow interrupt vector
 			data[Consts::TIFR0] &= ~(1 << Consts::TIFR0_TOV0);
 			mcu->cpu.directExecuteInterrupt(23);
+			return;
 		}
 	}
 
@@ -266,17 +469,50 @@ void A32u4::DataSpace::checkForIntr() {
 		}
 	}
 #endif
+	if (data[Consts::UCSR1B] & ((1 << Consts::UCSR1B_RXCIE1) | (1 << Consts::UCSR1B_UDRIE1) | (1 << Consts::UCSR1B_TXCIE1))) {
+		const uint8_t flags = data[Consts::UCSR1A] & data[Consts::UCSR1B] & ((1 << Consts::UCSR1A_RXC1) | (1 << Consts::UCSR1A_UDRE1) | (1 << Consts::UCSR1A_TXC1)); // flags and their enable bits are at the same positions
+		if ((flags & (1 << Consts::UCSR1A_RXC1)) && mcu->cpu.canWakeBy(25)) { // cleared by reading UDR1
+			mcu->cpu.directExecuteInterrupt(25);
+			return;
+		}
+		if ((flags & (1 << Consts::UCSR1A_UDRE1)) && mcu->cpu.canWakeBy(26)) { // cleared by writing UDR1
+			mcu->cpu.directExecuteInterrupt(26);
+			return;
+		}
+		if ((flags & (1 << Consts::UCSR1A_TXC1)) && mcu->cpu.canWakeBy(27)) {
+			data[Consts::UCSR1A] &= ~(1 << Consts::UCSR1A_TXC1);
+			mcu->cpu.directExecuteInterrupt(27);
+			return;
+		}
+	}
+
+	if ((data[Consts::EECR] & (1 << Consts::EECR_EERIE)) && !(data[Consts::EECR] & (1 << Consts::EECR_EEPE))) {
+		if (mcu->cpu.canWakeBy(30)) { // EE READY, stays pending as long as its enabled and no write is in progress
+			mcu->cpu.directExecuteInterrupt(30);
+			return;
+		}
+	}
+
 	if (data[Consts::TIFR3] & (1 << Consts::TIFR3_OCF3A)) {
-		if (data[Consts::TIMSK3] & (1 << Consts::TIMSK3_OCIE3A)) {
+		if (data[Consts::TIMSK3] & (1 << Consts::TIMSK3_OCIE3A) && mcu->cpu.canWakeBy(32)) {
 			data[Consts::TIFR3] &= ~(1 << Consts::TIFR3_OCF3A);
 			mcu->cpu.directExecuteInterrupt(32);
+			return;
+		}
+	}
+
+	if ((data[Consts::SPMCSR] & (1 << Consts::SPMCSR_SPMIE)) && !(data[Consts::SPMCSR] & (1 << Consts::SPMCSR_SPMEN))) {
+		if (mcu->cpu.canWakeBy(37)) { // SPM READY, stays pending as long as its enabled and SPMEN is cleared
+			mcu->cpu.directExecuteInterrupt(37);
+			return;
 		}
 	}
 
 	if (data[Consts::TIFR4] & (1 << Consts::TIFR4_TOV4)) {
-		if (data[Consts::TIMSK4] & (1 << Consts::TIMSK4_TOIE4)) {
+		if (data[Consts::TIMSK4] & (1 << Consts::TIMSK4_TOIE4) && mcu->cpu.canWakeBy(41)) {
 			data[Consts::TIFR4] &= ~(1 << Consts::TIFR4_TOV4);
 			mcu->cpu.directExecuteInterrupt(41);
+			return;
 		}
 	}
 }
@@ -352,6 +588,212 @@ uint64_t A32u4::DataSpace::cycsToNextTimerInt() {
 	}
 	return amt;
 }
+uint64_t A32u4::DataSpace::cycsToNextWakeEvent() {
+	uint64_t amt = -1;
+	if (mcu->cpu.getSleepMode() == CPU::SleepMode_Idle) { // timers only run in idle mode
+		amt = std::min(amt, cycsToNextTimerInt());
+	}
+	if (events.next != Events::None) { // scheduled events need to be processed even if they dont end up waking us
+		const uint64_t now = mcu->cpu.getTotalCycles();
+		amt = std::min(amt, events.next > now ? events.next - now : 0);
+	}
+	return amt;
+}
+void A32u4::DataSpace::stallTimers(uint64_t amt) {
+	// move the reference points forward, so the time that passed doesnt count
+	lastSet.Timer0Update += amt;
+	lastSet.Timer3Update += amt;
+	lastSet.Timer4Update += amt;
+}
+
+uint64_t A32u4::DataSpace::getUsart1FrameCycles() const {
+	const uint16_t ubrr = ((data[Consts::UBRR1H] & 0x0F) << 8) | data[Consts::UBRR1L];
+	const uint64_t bitCycs = (uint64_t)(ubrr + 1) * ((data[Consts::UCSR1A] & (1 << Consts::UCSR1A_U2X1)) ? 8 : 16);
+
+	const uint8_t ucsz = ((data[Consts::UCSR1C] >> Consts::UCSR1C_UCSZ10) & 0b11) | (((data[Consts::UCSR1B] >> Consts::UCSR1B_UCSZ12) & 1) << 2);
+	uint8_t bits = 1; // start bit
+	bits += ucsz == 0b111 ? 9 : (ucsz <= 0b011 ? 5 + ucsz : 8); // data bits (reserved values => 8)
+	bits += (data[Consts::UCSR1C] & (1 << Consts::UCSR1C_UPM11)) ? 1 : 0; // parity
+	bits += (data[Consts::UCSR1C] & (1 << Consts::UCSR1C_USBS1)) ? 2 : 1; // stop bits
+	return bitCycs * bits;
+}
+void A32u4::DataSpace::startUsart1Tx(uint8_t byte) {
+	usart1.txShift = byte;
+	usart1.txBusy = true;
+	events.schedule(Events::Event_USART1_TX, mcu->cpu.getTotalCycles() + getUsart1FrameCycles());
+}
+void A32u4::DataSpace::onUsart1TxDone() {
+	if (usart1TxQueue.push(usart1.txShift) == false)
+		usart1TxDropped++;
+
+	if (usart1.txBufFull) {
+		usart1.txBufFull = false;
+		startUsart1Tx(usart1.txBuf);
+		data[Consts::UCSR1A] |= 1 << Consts::UCSR1A_UDRE1;
+	}
+	else {
+		usart1.txBusy = false;
+		data[Consts::UCSR1A] |= 1 << Consts::UCSR1A_TXC1;
+	}
+	mcu->cpu.breakOutOfOptimisation();
+}
+void A32u4::DataSpace::onUsart1Rx() {
+	if (!(data[Consts::UCSR1B] & (1 << Consts::UCSR1B_RXEN1)))
+		return;
+
+	// we only take the next byte once the last one was read, the host side queue acts as flow control so no input is lost
+	uint8_t byte;
+	if (!(data[Consts::UCSR1A] & (1 << Consts::UCSR1A_RXC1)) && usart1RxQueue.pop(&byte, 1) == 1) {
+		data[Consts::UDR1] = byte;
+		data[Consts::UCSR1A] |= 1 << Consts::UCSR1A_RXC1;
+		mcu->cpu.breakOutOfOptimisation();
+	}
+	if (usart1RxQueue.size() > 0)
+		scheduleUsart1Rx();
+}
+void A32u4::DataSpace::scheduleUsart1Rx() {
+	if (events.at[Events::Event_USART1_RX] == Events::None && (data[Consts::UCSR1B] & (1 << Consts::UCSR1B_RXEN1)))
+		events.schedule(Events::Event_USART1_RX, mcu->cpu.getTotalCycles() + getUsart1FrameCycles());
+}
+
+void A32u4::DataSpace::processEvents() {
+	const uint64_t now = mcu->cpu.getTotalCycles();
+	while (events.next <= now) {
+		for (uint8_t i = 0; i < Events::Event_COUNT; i++) {
+			if (events.at[i] <= now) {
+				events.at[i] = Events::None; // handlers may reschedule themselves
+				handleEvent(i);
+			}
+		}
+		events.updateNext();
+	}
+}
+void A32u4::DataSpace::handleEvent(uint8_t id) {
+	switch (id) {
+		case Events::Event_WDT:
+			onWDTTimeout();
+			break;
+		case Events::Event_USART1_TX:
+			onUsart1TxDone();
+			break;
+		case Events::Event_USART1_RX:
+			onUsart1Rx();
+			break;
+		case Events::Event_USB_Frame:
+			mcu->usb.onFrame();
+			break;
+		case Events::Event_EEPROM_Write:
+			onEEPROMWriteDone();
+			break;
+		case Events::Event_SPM:
+			onSPMDone();
+			break;
+		case Events::Event_Input:
+			applyInputs();
+			break;
+		case Events::Event_Device:
+			runDeviceEvents();
+			break;
+	}
+}
+
+uint64_t A32u4::DataSpace::getEEPROMWriteCycles(uint8_t mode) {
+	// erase and write takes 3.4ms, erase only or write only 1.8ms
+	return mode == 0b00 ? (CPU::ClockFreq / 10000) * 34 : (CPU::ClockFreq / 10000) * 18;
+}
+void A32u4::DataSpace::onEEPROMWriteDone() {
+	data[Consts::EECR] &= ~(1 << Consts::EECR_EEPE);
+	if (data[Consts::EECR] & (1 << Consts::EECR_EERIE))
+		mcu->cpu.breakOutOfOptimisation();
+}
+void A32u4::DataSpace::markEEPROMDirty(sizemcu_t addr) {
+	eepromDirty |= 1 << (addr / eepromFlushPageSize);
+}
+
+void A32u4::DataSpace::executeSPM() {
+	const uint8_t spmcsr = data[Consts::SPMCSR];
+	if (!(spmcsr & (1 << Consts::SPMCSR_SPMEN)) || events.at[Events::Event_SPM] != Events::None)
+		return;
+	if (mcu->cpu.getTotalCycles() - lastSet.SPMCSR_SPMEN > 4) { // SPM has to follow within 4 cycles
+		data[Consts::SPMCSR] &= ~SPMCSR_cmdMask;
+		return;
+	}
+
+	const addrmcu_t addr = getZ();
+	bool busy = false;
+	switch (spmcsr & SPMCSR_cmdMask) {
+		case (1 << Consts::SPMCSR_SPMEN):
+			mcu->flash.fillPageBuffer(addr, ((uint16_t)getGPReg_(1) << 8) | getGPReg_(0));
+			break;
+		case (1 << Consts::SPMCSR_PGERS) | (1 << Consts::SPMCSR_SPMEN):
+			mcu->flash.erasePage(addr);
+			busy = true;
+			break;
+		case (1 << Consts::SPMCSR_PGWRT) | (1 << Consts::SPMCSR_SPMEN):
+			mcu->flash.writePage(addr);
+			busy = true;
+			break;
+		case (1 << Consts::SPMCSR_RWWSRE) | (1 << Consts::SPMCSR_SPMEN):
+			data[Consts::SPMCSR] &= ~(1 << Consts::SPMCSR_RWWSB);
+			mcu->flash.clearPageBuffer();
+			break;
+		default: // lock bits and the signature row are not emulated
+			break;
+	}
+
+	if (busy) {
+		// the flash already has its new content, the RWW section just reads as busy until it is reenabled
+		data[Consts::SPMCSR] |= 1 << Consts::SPMCSR_RWWSB;
+		events.schedule(Events::Event_SPM, mcu->cpu.getTotalCycles() + SPM_wait);
+	}
+	else {
+		onSPMDone();
+	}
+}
+void A32u4::DataSpace::onSPMDone() {
+	data[Consts::SPMCSR] &= ~SPMCSR_cmdMask;
+	if (data[Consts::SPMCSR] & (1 << Consts::SPMCSR_SPMIE))
+		mcu->cpu.breakOutOfOptimisation();
+}
+
+uint64_t A32u4::DataSpace::getWDTPeriod() const {
+	// the watchdog runs from a separate 128kHz oscillator, its prescaler divides that by 2K up to 1024K
+	uint8_t wdp = (data[Consts::WDTCSR] & 0b111) | (((data[Consts::WDTCSR] >> Consts::WDTCSR_WDP3) & 1) << 3);
+	if (wdp > 9) // reserved
+		wdp = 9;
+	return ((uint64_t)2048 << wdp) * (CPU::ClockFreq / 128000);
+}
+void A32u4::DataSpace::updateWDT() {
+	if (data[Consts::WDTCSR] & ((1 << Consts::WDTCSR_WDE) | (1 << Consts::WDTCSR_WDIE))) {
+		events.schedule(Events::Event_WDT, lastSet.WDTReset + getWDTPeriod());
+	}
+	else {
+		events.cancel(Events::Event_WDT);
+	}
+}
+void A32u4::DataSpace::resetWDT() {
+	// we dont reschedule here, the timeout event just checks if the watchdog was reset in the meantime
+	lastSet.WDTReset = mcu->cpu.getTotalCycles();
+}
+void A32u4::DataSpace::onWDTTimeout() {
+	const uint64_t timeout = lastSet.WDTReset + getWDTPeriod();
+	if (mcu->cpu.getTotalCycles() < timeout) { // watchdog was reset since this was scheduled
+		events.schedule(Events::Event_WDT, timeout);
+		return;
+	}
+	lastSet.WDTReset = timeout;
+
+	const uint8_t wdtcsr = data[Consts::WDTCSR];
+	if (wdtcsr & (1 << Consts::WDTCSR_WDIE)) {
+		// in interrupt and reset mode WDIE is only cleared once the interrupt is taken (see checkForIntr)
+		data[Consts::WDTCSR] |= (1 << Consts::WDTCSR_WDIF);
+		updateWDT();
+		mcu->cpu.breakOutOfOptimisation();
+	}
+	else if (wdtcsr & (1 << Consts::WDTCSR_WDE)) {
+		mcu->watchdogReset();
+	}
+}
 
 
 MCU_INLINE uint8_t& A32u4::DataSpace::getGPRegRef(regind_t ind) {
@@ -386,6 +828,11 @@ uint8_t A32u4::DataSpace::getByteAt(uint16_t addr) {
 
 	if (addr >= Consts::GPRs_size && addr <= Consts::io_start + Consts::io_size + Consts::ext_io_size) { //only io needs updates
 		update_Get(addr);
+		if (ioHooks) {
+			const IOHook& hook = ioHooks[addr - Consts::io_start];
+			if (hook.read)
+				data[addr] = hook.read(addr, data[addr], hook.readUserData);
+		}
 	}
 
 #if MCU_RW_RECORD
@@ -401,6 +848,11 @@ void A32u4::DataSpace::setByteAt(uint16_t addr, uint8_t val) {
 	data[addr] = val;
 	if (addr <= Consts::io_start + Consts::io_size + Consts::ext_io_size && addr >= Consts::GPRs_size) { //only io needs updates
 		update_Set(addr, val, oldVal);
+		if (ioHooks) {
+			const IOHook& hook = ioHooks[addr - Consts::io_start];
+			if (hook.write)
+				hook.write(addr, val, oldVal, hook.writeUserData);
+		}
 	}
 
 #if MCU_RW_RECORD
@@ -497,6 +949,15 @@ void A32u4::DataSpace::update_Get_impl(uint16_t addr) {
 			else CU_FALLTHROUGH;
 		}
 
+		case Consts::SPMCSR: {
+			if ((data[Consts::SPMCSR] & SPMCSR_cmdMask) && events.at[Events::Event_SPM] == Events::None &&
+				mcu->cpu.getTotalCycles() - lastSet.SPMCSR_SPMEN > 4) { // no SPM within 4 cycles of setting SPMEN
+				data[Consts::SPMCSR] &= ~SPMCSR_cmdMask;
+			}
+			CU_IF_LIKELY(onlyOne) break;
+			else CU_FALLTHROUGH;
+		}
+
 		case Consts::PLLCSR: {
 			if ((data[Consts::PLLCSR] & (1 << Consts::PLLCSR_PLLE)) && 
 				!(data[Consts::PLLCSR] & (1 << Consts::PLLCSR_PLOCK)) && 
@@ -507,6 +968,14 @@ void A32u4::DataSpace::update_Get_impl(uint16_t addr) {
 			else CU_FALLTHROUGH;
 		}
 
+		case Consts::WDTCSR: {
+			if ((data[Consts::WDTCSR] & (1 << Consts::WDTCSR_WDCE)) && mcu->cpu.getTotalCycles() - lastSet.WDTCSR_WDCE > 4) { // timed sequence ran out
+				data[Consts::WDTCSR] &= ~(1 << Consts::WDTCSR_WDCE);
+			}
+			CU_IF_LIKELY(onlyOne) break;
+			else CU_FALLTHROUGH;
+		}
+
 		case Consts::TCNT0: {
 			if(getTimer0PrescDiv() > 0) {
 				data[Consts::TCNT0] += (uint8_t)((mcu->cpu.getTotalCycles() - lastSet.Timer0Update) / getTimer0PrescDiv());
@@ -563,6 +1032,25 @@ void A32u4::DataSpace::update_Get_impl(uint16_t addr) {
 				}
 			}
 			CU_IF_LIKELY(onlyOne) break;
+			else CU_FALLTHROUGH;
+		}
+		case Consts::UDR1: {
+			if (onlyOne) { // an actual read of the received byte (not when updating everything)
+				data[Consts::UCSR1A] &= ~(1 << Consts::UCSR1A_RXC1);
+			}
+			CU_IF_LIKELY(onlyOne) break;
+			else CU_FALLTHROUGH;
+		}
+		case Consts::UEDATX: {
+			if (onlyOne) { // reading advances the fifo
+				mcu->usb.readUEDATX();
+			}
+			CU_IF_LIKELY(onlyOne) break;
+			else CU_FALLTHROUGH;
+		}
+		case Consts::UEINT: {
+			data[Consts::UEINT] = mcu->usb.getUEINT();
+			CU_IF_LIKELY(onlyOne) break;
 			//else CU_FALLTHROUGH;
 		}
 	}
@@ -585,13 +1073,17 @@ void A32u4::DataSpace::update_Set(uint16_t Addr, uint8_t val, uint8_t oldVal) {
 			setPLLCSR(val, oldVal);
 			break;
 
+		case Consts::SPMCSR:
+			setSPMCSR(val, oldVal);
+			break;
+
 		case Consts::SPDR:
 			setSPDR();
 			break;
 
 		case Consts::SREG:
 			updateSREGCache();
-			if((val & (1<<Consts::SREG_I)) && (data[Consts::TIFR0] & (1 << DataSpace::Consts::TIFR0_TOV0)))
+			if((val & (1<<Consts::SREG_I)) && !(oldVal & (1<<Consts::SREG_I)))
 				mcu->cpu.breakOutOfOptimisation(); // we need to break out of Optimisation to check if an interrupt can now occur (Global Interrupt Enable)
 			break;
 
@@ -616,6 +1108,40 @@ void A32u4::DataSpace::update_Set(uint16_t Addr, uint8_t val, uint8_t oldVal) {
 			setTCCR4B(val, oldVal);
 			break;
 
+		case Consts::WDTCSR:
+			setWDTCSR(val, oldVal);
+			break;
+
+		case Consts::MCUSR:
+			data[Consts::MCUSR] = oldVal & val; // flags can only be cleared
+			break;
+
+		case Consts::UDR1:
+			setUDR1(val, oldVal);
+			break;
+
+		case Consts::UCSR1A: {
+			constexpr uint8_t writable = (1 << Consts::UCSR1A_U2X1) | (1 << Consts::UCSR1A_MPCM1);
+			uint8_t res = (oldVal & ~writable) | (val & writable);
+			if (val & (1 << Consts::UCSR1A_TXC1)) // TXC1 is cleared by writing a one to it
+				res &= ~(1 << Consts::UCSR1A_TXC1);
+			data[Consts::UCSR1A] = res;
+			break;
+		}
+
+		case Consts::UCSR1B:
+			setUCSR1B(val, oldVal);
+			break;
+
+		case Consts::USBCON: case Consts::USBSTA: case Consts::USBINT:
+		case Consts::UDCON: case Consts::UDINT: case Consts::UDIEN:
+		case Consts::UDFNUML: case Consts::UDFNUMH:
+		case Consts::UEINTX: case Consts::UENUM: case Consts::UERST: case Consts::UECONX:
+		case Consts::UECFG1X: case Consts::UESTA0X: case Consts::UEIENX: case Consts::UEDATX:
+		case Consts::UEBCLX: case Consts::UEBCHX: case Consts::UEINT:
+			mcu->usb.update_Set(Addr, val, oldVal);
+			break;
+
 		case Consts::ADCSRA:
 			if (oldVal & (1 << Consts::ADCSRA_ADSC) && !(val & (1 << Consts::ADCSRA_ADSC))) { // ADCSRA_ADSC has been set to 0
 				data[Consts::ADCSRA] &= ~(1 << 1 << Consts::ADCSRA_ADSC); // clear again => should have no effect
@@ -627,6 +1153,30 @@ void A32u4::DataSpace::update_Set(uint16_t Addr, uint8_t val, uint8_t oldVal) {
 			}
 			break;
 
+		case Consts::EIFR:
+		case Consts::PCIFR:
+			data[Addr] = oldVal & ~val; // flags are cleared by writing a logical one to them
+			break;
+
+		case Consts::EIMSK:
+		case Consts::PCICR:
+			mcu->cpu.breakOutOfOptimisation(); // a pending flag might be able to trigger now
+			break;
+
+		case Consts::PINB:
+		case Consts::PINC:
+		case Consts::PIND:
+		case Consts::PINE:
+		case Consts::PINF: {
+			// the cpu writing ones to PINx toggles the PORTx bits, the input value itself stays
+			data[Addr] = oldVal;
+			const addrmcu_t port = Addr + (Consts::PORTB - Consts::PINB);
+			const uint8_t oldPort = data[port];
+			data[port] = oldPort ^ val;
+			update_Set(port, data[port], oldPort);
+			break;
+		}
+
 		case Consts::PORTB: pinChange(ATmega32u4::PinChange_PORTB, oldVal, val); break;
 		case Consts::PORTC: pinChange(ATmega32u4::PinChange_PORTC, oldVal, val); break;
 		case Consts::PORTD: pinChange(ATmega32u4::PinChange_PORTD, oldVal, val); break;
@@ -652,39 +1202,73 @@ uint16_t A32u4::DataSpace::getADCVal() {
 
 
 void A32u4::DataSpace::setEECR(uint8_t val, uint8_t oldVal){
+	const bool busy = events.at[Events::Event_EEPROM_Write] != Events::None;
+	if (busy) {
+		// EEPE is only cleared by hardware and the mode cant be changed while a write is in progress
+		constexpr uint8_t modeMask = (1 << Consts::EECR_EEPM1) | (1 << Consts::EECR_EEPM0);
+		val = (val & ~modeMask) | (oldVal & modeMask) | (1 << Consts::EECR_EEPE);
+		data[Consts::EECR] = val;
+	}
+
 	if (val & (1 << Consts::EECR_EERE)) {
-		data[Consts::EEDR] = eeprom[getWordRegRam(Consts::EEARL)];
+		if (!busy) { // reading is not possible during a write
+			data[Consts::EEDR] = eeprom[getWordRegRam(Consts::EEARL)];
+			mcu->cpu.totalCycls += 4;
+		}
 		val = val & ~(1 << Consts::EECR_EERE); //idk if this should be done bc its not stated anywhere but its the only logical thing
-		mcu->cpu.totalCycls += 4;
 	}
 
 	if ((val & (1 << Consts::EECR_EEMPE)) && !(oldVal & (1 << Consts::EECR_EEMPE))) {
 		lastSet.EECR_EEMPE = mcu->cpu.totalCycls;
 	}
 
-	if (val & (1 << Consts::EECR_EEPE)) {
+	if (!busy && (val & (1 << Consts::EECR_EEPE))) {
 		if (data[Consts::EECR] & (1 << Consts::EECR_EEMPE)) {
-			uint8_t mode = data[Consts::EECR] >> 4;
+			uint8_t mode = (data[Consts::EECR] >> Consts::EECR_EEPM0) & 0b11;
 			uint16_t Addr = getWordRegRam(Consts::EEARL);
 
 			A32U4_ASSERT_INRANGE2(Addr, 0, Consts::eeprom_size, return, "Eeprom addr out of bounds" MCU_ADDR_FORMAT);
 
+			// the cell already has its new value, nothing can read it before the write completes anyways
 			switch (mode) {
-			case 0b00:
+			case 0b00: // erase and write
 				eeprom[Addr] = data[Consts::EEDR];
 				break;
-			case 0b01:
-				eeprom[Addr] = 0;
+			case 0b01: // erase only
+				eeprom[Addr] = 0xFF;
 				break;
-			case 0b10:
-				eeprom[Addr] |= data[Consts::EEDR]; //idk if it actually works like that
+			case 0b10: // write only, programming can only clear bits
+				eeprom[Addr] &= data[Consts::EEDR];
 				break;
 			}
+			markEEPROMDirty(Addr);
 
-			// set EEPE to 0 to indicate being ready again
+			// EEPE stays set until the programming time has passed
+			events.schedule(Events::Event_EEPROM_Write, mcu->cpu.getTotalCycles() + getEEPROMWriteCycles(mode));
+		}
+		else {
 			data[Consts::EECR] &= ~(1 << Consts::EECR_EEPE);
 		}
 	}
+
+	if ((val & (1 << Consts::EECR_EERIE)) && !(oldVal & (1 << Consts::EECR_EERIE))) {
+		mcu->cpu.breakOutOfOptimisation();
+	}
+}
+void A32u4::DataSpace::setSPMCSR(uint8_t val, uint8_t oldVal) {
+	if (events.at[Events::Event_SPM] != Events::None) { // only SPMIE can be changed while an erase or write is in progress
+		data[Consts::SPMCSR] = (oldVal & ~(1 << Consts::SPMCSR_SPMIE)) | (val & (1 << Consts::SPMCSR_SPMIE));
+	}
+	else {
+		data[Consts::SPMCSR] = (val & ~(1 << Consts::SPMCSR_RWWSB)) | (oldVal & (1 << Consts::SPMCSR_RWWSB)); // RWWSB is read only
+		if (val & (1 << Consts::SPMCSR_SPMEN)) {
+			lastSet.SPMCSR_SPMEN = mcu->cpu.getTotalCycles();
+		}
+	}
+
+	if ((val & (1 << Consts::SPMCSR_SPMIE)) && !(oldVal & (1 << Consts::SPMCSR_SPMIE))) {
+		mcu->cpu.breakOutOfOptimisation();
+	}
 }
 void A32u4::DataSpace::setPLLCSR(uint8_t val, uint8_t oldVal) {
 	if (val & (1 << Consts::PLLCSR_PLLE)) {
@@ -699,8 +1283,28 @@ void A32u4::DataSpace::setPLLCSR(uint8_t val, uint8_t oldVal) {
 	}
 }
 void A32u4::DataSpace::setSPDR() {
+	const uint8_t mosi = data[Consts::SPDR];
 	if(SPI_Byte_Callback)
-		SPI_Byte_Callback(data[Consts::SPDR]);
+		SPI_Byte_Callback(mosi);
+
+	// chip selects are active low
+	const bool displaySelected = display && !(data[Consts::PORTD] & display->csMask);
+	bool flashSelected = false;
+	if (spiFlash) {
+		constexpr addrmcu_t portAddrs[] = { Consts::PORTB, Consts::PORTC, Consts::PORTD, Consts::PORTE, Consts::PORTF }; // indexed by PinChange_PORTx
+		flashSelected = !(data[portAddrs[spiFlash->csPort]] & spiFlash->csMask);
+	}
+
+	if (spiSpanCallB) {
+		if (spiBufLen >= MCU_SPI_BUF_SIZE)
+			flushSPI();
+		const uint8_t selected = (displaySelected ? SPITransfer::Select_Display : 0) | (flashSelected ? SPITransfer::Select_SPIFlash : 0);
+		spiBuf[spiBufLen++] = { mcu->cpu.getTotalCycles(), mosi, data[Consts::PORTD], selected };
+	}
+
+	if (displaySelected) {
+		display->write(mosi, data[Consts::PORTD] & display->dcMask);
+	}
 
 	if (SCK_Callback != NULL) {
 		for (uint8_t i = 0; i < 8; i++) {
@@ -711,8 +1315,11 @@ void A32u4::DataSpace::setSPDR() {
 			//Set SCK LOW
 		}
 	}
+	else if (flashSelected) {
+		data[Consts::SPDR] = spiFlash->transfer(mosi, mcu->cpu.getTotalCycles());
+	}
 	else {
-		data[Consts::SPDR] = 0;
+		data[Consts::SPDR] = spiMisoCallB ? spiMisoCallB(mosi, data[Consts::PORTD], spiMisoCallBUserData) : 0;
 	}
 	data[Consts::SPSR] |= (1 << Consts::SPSR_SPIF);
 
@@ -750,6 +1357,204 @@ void A32u4::DataSpace::setTCCR4B(uint8_t val, uint8_t oldVal) {
 	}
 }
 
+void A32u4::DataSpace::setWDTCSR(uint8_t val, uint8_t oldVal) {
+	constexpr uint8_t wdpMask = (1 << Consts::WDTCSR_WDP3) | 0b111;
+	const uint64_t now = mcu->cpu.getTotalCycles();
+	const bool changeEnabled = (oldVal & (1 << Consts::WDTCSR_WDCE)) && now - lastSet.WDTCSR_WDCE <= 4;
+
+	uint8_t res = oldVal & ~val & (1 << Consts::WDTCSR_WDIF); // WDIF is cleared by writing a one to it
+	res |= val & (1 << Consts::WDTCSR_WDIE);
+	if (changeEnabled) { // clearing WDE and changing the prescaler needs the timed sequence
+		res |= val & (wdpMask | (1 << Consts::WDTCSR_WDE));
+	}
+	else {
+		res |= oldVal & wdpMask;
+		res |= (oldVal | val) & (1 << Consts::WDTCSR_WDE);
+	}
+	if ((val & (1 << Consts::WDTCSR_WDCE)) && (val & (1 << Consts::WDTCSR_WDE))) { // start timed sequence
+		res |= 1 << Consts::WDTCSR_WDCE;
+		lastSet.WDTCSR_WDCE = now;
+	}
+	if (data[Consts::MCUSR] & (1 << Consts::MCUSR_WDRF)) { // WDE is overridden by WDRF
+		res |= 1 << Consts::WDTCSR_WDE;
+	}
+	data[Consts::WDTCSR] = res;
+
+	constexpr uint8_t enMask = (1 << Consts::WDTCSR_WDE) | (1 << Consts::WDTCSR_WDIE);
+	if (!(oldVal & enMask) && (res & enMask)) { // watchdog got started
+		lastSet.WDTReset = now;
+	}
+	updateWDT();
+	if (res & (1 << Consts::WDTCSR_WDIF))
+		mcu->cpu.breakOutOfOptimisation();
+}
+
+void A32u4::DataSpace::setUDR1(uint8_t val, uint8_t oldVal) {
+	data[Consts::UDR1] = oldVal; // reading UDR1 returns the received byte, so the transmitted one isnt stored there
+	if (!(data[Consts::UCSR1B] & (1 << Consts::UCSR1B_TXEN1)))
+		return;
+	if (!(data[Consts::UCSR1A] & (1 << Consts::UCSR1A_UDRE1))) // buffer is full, the write is ignored
+		return;
+
+	if (!usart1.txBusy) {
+		startUsart1Tx(val);
+	}
+	else {
+		usart1.txBuf = val;
+		usart1.txBufFull = true;
+		data[Consts::UCSR1A] &= ~(1 << Consts::UCSR1A_UDRE1);
+	}
+}
+void A32u4::DataSpace::setUCSR1B(uint8_t val, uint8_t oldVal) {
+	data[Consts::UCSR1B] = (val & ~(1 << Consts::UCSR1B_RXB81)) | (oldVal & (1 << Consts::UCSR1B_RXB81)); // RXB81 is read only
+	if ((val & (1 << Consts::UCSR1B_RXEN1)) && !(oldVal & (1 << Consts::UCSR1B_RXEN1))) {
+		if (usart1RxQueue.size() > 0)
+			scheduleUsart1Rx();
+	}
+	else if (!(val & (1 << Consts::UCSR1B_RXEN1)) && (oldVal & (1 << Consts::UCSR1B_RXEN1))) {
+		events.cancel(Events::Event_USART1_RX);
+		data[Consts::UCSR1A] &= ~(1 << Consts::UCSR1A_RXC1); // disabling the receiver flushes the receive buffer
+	}
+	if (val & ~oldVal & ((1 << Consts::UCSR1B_RXCIE1) | (1 << Consts::UCSR1B_UDRIE1) | (1 << Consts::UCSR1B_TXCIE1)))
+		mcu->cpu.breakOutOfOptimisation(); // a pending flag might be able to trigger now
+}
+
+size_t A32u4::DataSpace::usart1Write(const uint8_t* buf, size_t len) {
+	// only the queue is touched here, the emulating thread picks the bytes up in pollHostInputs
+	return usart1RxQueue.push(buf, len);
+}
+size_t A32u4::DataSpace::usart1Read(uint8_t* out, size_t maxLen) {
+	return usart1TxQueue.pop(out, maxLen);
+}
+void A32u4::DataSpace::setUsart1QueueSize(size_t size) {
+	usart1RxQueue.resize(size);
+	usart1TxQueue.resize(size);
+}
+uint64_t A32u4::DataSpace::getUsart1TxDropped() const {
+	return usart1TxDropped;
+}
+
+void A32u4::DataSpace::queueInput(const InputEvent& event) {
+	if (event.port > ATmega32u4::PinChange_PORTF) {
+		LU_LOGF(LogUtils::LogLevel_Warning, "Dropped input event with invalid port %" PRIu8, event.port);
+		return;
+	}
+	if (inputQueue.empty() || inputQueue.back().cycle <= event.cycle) {
+		inputQueue.push_back(event);
+	}
+	else { // keep the order of entries with the same cycle
+		auto it = std::upper_bound(inputQueue.begin(), inputQueue.end(), event.cycle, [](uint64_t cycle, const InputEvent& e) {
+			return cycle < e.cycle;
+		});
+		inputQueue.insert(it, event);
+	}
+	scheduleInput();
+}
+void A32u4::DataSpace::queueInputs(const InputEvent* events_, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		queueInput(events_[i]);
+	}
+}
+size_t A32u4::DataSpace::getInputQueueLen() const {
+	return inputQueue.size();
+}
+void A32u4::DataSpace::clearInputQueue() {
+	inputQueue.clear();
+	scheduleInput();
+}
+A32u4::DataSpace::IOHook* A32u4::DataSpace::getIOHook(addrmcu_t addr) {
+	if (addr < Consts::io_start || addr >= Consts::io_start + Consts::io_size + Consts::ext_io_size)
+		return nullptr;
+	if (!ioHooks)
+		ioHooks.reset(new IOHook[ioHooksSize]);
+	return &ioHooks[addr - Consts::io_start];
+}
+bool A32u4::DataSpace::setIOReadHook(addrmcu_t addr, IOReadHook hook, void* userData) {
+	IOHook* h = getIOHook(addr);
+	if (!h)
+		return false;
+	h->read = hook;
+	h->readUserData = userData;
+	return true;
+}
+bool A32u4::DataSpace::setIOWriteHook(addrmcu_t addr, IOWriteHook hook, void* userData) {
+	IOHook* h = getIOHook(addr);
+	if (!h)
+		return false;
+	h->write = hook;
+	h->writeUserData = userData;
+	return true;
+}
+
+size_t A32u4::DataSpace::addDeviceEvent(DeviceEventCallB callB, void* userData) {
+	for (size_t i = 0; i < deviceEvents.size(); i++) { // reuse removed slots
+		if (!deviceEvents[i].callB) {
+			deviceEvents[i] = { callB, userData, Events::None };
+			return i;
+		}
+	}
+	deviceEvents.push_back({ callB, userData, Events::None });
+	return deviceEvents.size() - 1;
+}
+void A32u4::DataSpace::removeDeviceEvent(size_t id) {
+	DU_ASSERT(id < deviceEvents.size());
+	deviceEvents[id] = { nullptr, nullptr, Events::None };
+	scheduleDeviceEvents();
+}
+void A32u4::DataSpace::scheduleDeviceEvent(size_t id, uint64_t cycle) {
+	DU_ASSERT(id < deviceEvents.size());
+	deviceEvents[id].at = cycle;
+	scheduleDeviceEvents();
+}
+void A32u4::DataSpace::cancelDeviceEvent(size_t id) {
+	scheduleDeviceEvent(id, Events::None);
+}
+void A32u4::DataSpace::scheduleDeviceEvents() {
+	uint64_t earliest = Events::None;
+	for (const DeviceEvent& e : deviceEvents) {
+		if (e.at < earliest)
+			earliest = e.at;
+	}
+	if (earliest == Events::None) {
+		events.cancel(Events::Event_Device);
+	}
+	else if (events.at[Events::Event_Device] != earliest) {
+		events.schedule(Events::Event_Device, earliest);
+	}
+}
+void A32u4::DataSpace::runDeviceEvents() {
+	const uint64_t now = mcu->cpu.getTotalCycles();
+	for (size_t i = 0; i < deviceEvents.size(); i++) { // callbacks may add events, so dont keep references
+		const uint64_t at = deviceEvents[i].at;
+		if (at <= now && deviceEvents[i].callB) {
+			deviceEvents[i].at = Events::None; // the callback may reschedule it
+			deviceEvents[i].callB(at, deviceEvents[i].userData);
+		}
+	}
+	scheduleDeviceEvents();
+}
+
+void A32u4::DataSpace::scheduleInput() {
+	if (inputQueue.empty()) {
+		events.cancel(Events::Event_Input);
+	}
+	else if (events.at[Events::Event_Input] != inputQueue.front().cycle) {
+		events.schedule(Events::Event_Input, inputQueue.front().cycle);
+	}
+}
+void A32u4::DataSpace::applyInputs() {
+	constexpr addrmcu_t pinAddrs[] = { Consts::PINB, Consts::PINC, Consts::PIND, Consts::PINE, Consts::PINF }; // indexed by PinChange_PORTx
+
+	const uint64_t now = mcu->cpu.getTotalCycles();
+	while (!inputQueue.empty() && inputQueue.front().cycle <= now) {
+		const InputEvent& e = inputQueue.front();
+		const addrmcu_t addr = pinAddrs[e.port];
+		setPinInput(addr, (data[addr] & ~e.mask) | (e.val & e.mask));
+		inputQueue.pop_front();
+	}
+	scheduleInput();
+}
+
 void A32u4::DataSpace::pushByteToStack(uint8_t val) {
 	uint16_t SP = getWordRegRam(Consts::SPL);
 	A32U4_ASSERT_INRANGE2(SP, Consts::ISRAM_start, Consts::data_size, return, "Stack pointer while push Byte out of bounds: " MCU_ADDR_FORMAT);
@@ -819,14 +1624,115 @@ addrmcu_t A32u4::DataSpace::popAddrFromStack() {
 void A32u4::DataSpace::setSPIByteCallB(std::function<void(uint8_t)> func) {
 	SPI_Byte_Callback = func;
 }
+void A32u4::DataSpace::setSPISpanCallB(SPISpanCallB callB, void* userData) {
+	flushSPI(); // pending transfers still belong to the old callback
+	spiSpanCallB = callB;
+	spiSpanCallBUserData = userData;
+}
+void A32u4::DataSpace::setSPIMisoCallB(SPIMisoCallB callB, void* userData) {
+	spiMisoCallB = callB;
+	spiMisoCallBUserData = userData;
+}
+void A32u4::DataSpace::attachDisplay(SSD1306* display_) {
+	display = display_;
+}
+void A32u4::DataSpace::attachAudioSink(AudioSink* audio_) {
+	audio = audio_;
+	if (audio)
+		audio->attach(mcu->cpu.getTotalCycles(), data[Consts::PORTC]);
+}
+void A32u4::DataSpace::attachSPIFlash(SPIFlash* flash) {
+	spiFlash = flash;
+}
+void A32u4::DataSpace::pollHostInputs() {
+	if (usart1RxQueue.size() > 0)
+		scheduleUsart1Rx();
+}
+void A32u4::DataSpace::flushOutputs() {
+	flushSPI();
+	if (eepromDirty)
+		flushEEPROM();
+	if (audio)
+		audio->render(mcu->cpu.getTotalCycles());
+}
+void A32u4::DataSpace::flushSPI() {
+	if (spiBufLen == 0)
+		return;
+	if (spiSpanCallB)
+		spiSpanCallB(spiBuf, spiBufLen, spiSpanCallBUserData);
+	spiBufLen = 0;
+}
 uint8_t* A32u4::DataSpace::getEEPROM() {
 	return eeprom;
 }
+bool A32u4::DataSpace::mapEEPROM(const char* path) {
+	unmapEEPROM();
+
+	if (!eepromFile.open(path, MappedFile::Mode_ReadWrite, Consts::eeprom_size)) {
+		LU_LOGF(LogUtils::LogLevel_Error, "Couldn't map eeprom file: \"%s\"", path);
+		return false;
+	}
+
+	// take over whatever the file already contains, the rest is filled with the current content
+	const size_t loaded = std::min(eepromFile.originalFileSize(), (size_t)Consts::eeprom_size);
+	std::memcpy(eeprom, eepromFile.data(), loaded);
+	for (size_t i = loaded; i < Consts::eeprom_size; i += eepromFlushPageSize) {
+		markEEPROMDirty((sizemcu_t)i);
+	}
+	flushEEPROM();
+	return true;
+}
+void A32u4::DataSpace::unmapEEPROM() {
+	if (!isEEPROMMapped())
+		return;
+	flushEEPROM();
+	eepromFile.close();
+}
+bool A32u4::DataSpace::isEEPROMMapped() const {
+	return eepromFile.isOpen();
+}
+void A32u4::DataSpace::flushEEPROM() {
+	if (!isEEPROMMapped()) {
+		eepromDirty = 0;
+		return;
+	}
+
+	for (uint8_t i = 0; i < eepromNumFlushPages; i++) {
+		if (eepromDirty & (1 << i)) {
+			const size_t off = (size_t)i * eepromFlushPageSize;
+			std::memcpy(eepromFile.data() + off, eeprom + off, eepromFlushPageSize);
+			eepromFile.sync(off, eepromFlushPageSize);
+		}
+	}
+	eepromDirty = 0;
+}
+void A32u4::DataSpace::markEEPROMChanged() {
+	eepromDirty = (uint16_t)((1u << eepromNumFlushPages) - 1);
+}
+A32u4::Span<const uint8_t> A32u4::DataSpace::getEEPROMSpan() const {
+	return { eeprom, Consts::eeprom_size };
+}
+size_t A32u4::DataSpace::readEEPROM(sizemcu_t addr, uint8_t* out, size_t len) const {
+	if (addr >= Consts::eeprom_size)
+		return 0;
+	len = std::min(len, (size_t)(Consts::eeprom_size - addr));
+	std::memcpy(out, eeprom + addr, len);
+	return len;
+}
+size_t A32u4::DataSpace::writeEEPROM(sizemcu_t addr, const uint8_t* in, size_t len) {
+	if (addr >= Consts::eeprom_size)
+		return 0;
+	len = std::min(len, (size_t)(Consts::eeprom_size - addr));
+	std::memcpy(eeprom + addr, in, len);
+	for (size_t i = addr - (addr % eepromFlushPageSize); i < addr + len; i += eepromFlushPageSize) {
+		markEEPROMDirty((sizemcu_t)i);
+	}
+	return len;
+}
 // get a pointer to the updated Dataspce Data arr (only gets updated on first call if cpu.totalcycles doesnt change)
 const uint8_t* A32u4::DataSpace::getData() {
-	static uint64_t lastCycs = 0;
-	if (lastCycs != mcu->cpu.getTotalCycles()) {
-		lastCycs = mcu->cpu.getTotalCycles();
+	if (getDataLastCycs != mcu->cpu.getTotalCycles()) {
+		getDataLastCycs = mcu->cpu.getTotalCycles();
 		update_Get_all();
 	}
 	return data;
@@ -836,7 +1742,57 @@ uint8_t A32u4::DataSpace::getDataByte(addrmcu_t Addr) {
 }
 
 void A32u4::DataSpace::setDataByte(addrmcu_t Addr, uint8_t byte) {
-	setByteAt(Addr, byte);
+	switch (Addr) {
+		case Consts::PINB:
+		case Consts::PINC:
+		case Consts::PIND:
+		case Consts::PINE:
+		case Consts::PINF:
+			setPinInput(Addr, byte);
+			break;
+		default:
+			setByteAt(Addr, byte);
+			break;
+	}
+}
+
+size_t A32u4::DataSpace::readRange(addrmcu_t addr, uint8_t* out, size_t len, uint8_t access) {
+	if (addr >= Consts::data_size)
+		return 0;
+	len = std::min(len, (size_t)(Consts::data_size - addr));
+
+	if (access == Access_Emulated) {
+		for (size_t i = 0; i < len; i++) {
+			out[i] = getByteAt((uint16_t)(addr + i));
+		}
+	}
+	else {
+		std::memcpy(out, getData() + addr, len);
+	}
+	return len;
+}
+size_t A32u4::DataSpace::writeRange(addrmcu_t addr, const uint8_t* in, size_t len, uint8_t access) {
+	if (addr >= Consts::data_size)
+		return 0;
+	len = std::min(len, (size_t)(Consts::data_size - addr));
+
+	if (access == Access_Emulated) {
+		for (size_t i = 0; i < len; i++) {
+			setByteAt((uint16_t)(addr + i), in[i]);
+		}
+	}
+	else {
+		std::memcpy(data + addr, in, len);
+		if (addr <= Consts::SREG && addr + len > Consts::SREG)
+			updateCache();
+	}
+	return len;
+}
+void A32u4::DataSpace::readAddrs(const addrmcu_t* addrs, uint8_t* out, size_t len) {
+	const uint8_t* d = getData();
+	for (size_t i = 0; i < len; i++) {
+		out[i] = addrs[i] < Consts::data_size ? d[addrs[i]] : 0;
+	}
 }
 
 void A32u4::DataSpace::setBitTo(addrmcu_t Addr, uint8_t bit, bool val) {
@@ -858,9 +1814,65 @@ addrmcu_t A32u4::DataSpace::getSP() const {
 }
 
 void A32u4::DataSpace::pinChange(uint8_t num, reg_t oldVal, reg_t val) {
+	if (display && num == ATmega32u4::PinChange_PORTD) {
+		display->portDChange(oldVal, val);
+	}
+	if (audio && num == ATmega32u4::PinChange_PORTC) {
+		audio->pinEdge(mcu->cpu.getTotalCycles(), val);
+	}
+	if (spiFlash && num == spiFlash->csPort) {
+		spiFlash->portChange(oldVal, val, mcu->cpu.getTotalCycles());
+	}
 	if(mcu->pinChangeCallB) {
 		mcu->pinChangeCallB(num, oldVal, val);
 	}
+	if (oldVal != val && !mcu->pinChangeQueue.empty()) {
+		mcu->queuePinChange(num, oldVal, val);
+	}
+}
+
+void A32u4::DataSpace::setPinInput(uint16_t addr, reg_t val) {
+	const uint8_t oldVal = data[addr];
+	data[addr] = val;
+	pinInputChange(addr, oldVal, val); // raises the pin change and external interrupt flags
+}
+void A32u4::DataSpace::pinInputChange(uint16_t addr, reg_t oldVal, reg_t val) {
+	const uint8_t changed = oldVal ^ val;
+	if (!changed)
+		return;
+
+	if (addr == Consts::PINB) { // PCINT0-7
+		if (changed & data[Consts::PCMSK0]) {
+			data[Consts::PCIFR] |= 1 << Consts::PCIFR_PCIF0;
+			mcu->cpu.breakOutOfOptimisation();
+		}
+		return;
+	}
+
+	// INT0-3 are on PD0-3, INT6 is on PE6
+	const uint8_t intrPins = addr == Consts::PIND ? 0b1111 : (1 << 6);
+	for (uint8_t i = 0; i < 8; i++) {
+		if (!(changed & intrPins & (1 << i)))
+			continue;
+
+		const uint8_t isc = i < 4 ? (data[Consts::EICRA] >> (i * 2)) & 0b11 : (data[Consts::EICRB] >> ((i - 4) * 2)) & 0b11;
+		const bool rising = val & (1 << i);
+		if ((isc == 0b01) || (isc == 0b10 && !rising) || (isc == 0b11 && rising)) { // any edge, falling edge, rising edge (0b00 is low level, which has no flag)
+			data[Consts::EIFR] |= 1 << i;
+			mcu->cpu.breakOutOfOptimisation();
+		}
+	}
+}
+uint8_t A32u4::DataSpace::getExtIntrLevelMask() const {
+	// returns all the external interrupts (in EIMSK layout) that are set to low level sensing and currently are low
+	uint8_t res = 0;
+	for (uint8_t i = 0; i < 4; i++) {
+		if (((data[Consts::EICRA] >> (i * 2)) & 0b11) == 0 && !(data[Consts::PIND] & (1 << i)))
+			res |= 1 << i;
+	}
+	if (((data[Consts::EICRB] >> 4) & 0b11) == 0 && !(data[Consts::PINE] & (1 << 6)))
+		res |= 1 << Consts::EIMSK_INT6;
+	return res;
 }
 
 #define FAST_FLAGSET 1
@@ -1199,16 +2211,98 @@ void A32u4::DataSpace::getState(std::ostream& output){
 	getEepromState(output);
 
 	lastSet.getState(output);
+	events.getState(output);
+	usart1.getState(output);
 #if MCU_WRITE_HASH
 	StreamUtils::write(output, hash());
 #endif
 }
 void A32u4::DataSpace::setState(std::istream& input){
+	getDataLastCycs = (uint64_t)-1;
 	setRamState(input);
 	setEepromState(input);
 
 	lastSet.setState(input);
+	events.setState(input);
+	usart1.setState(input);
 	A32U4_CHECK_HASH("DataSpace");
+
+	// the input queue and device events are not part of the state
+	scheduleInput();
+	scheduleDeviceEvents();
+}
+void A32u4::DataSpace::setStateV0(std::istream& input){
+	getDataLastCycs = (uint64_t)-1;
+	setRamState(input);
+	setEepromState(input);
+
+	lastSet.resetAll();
+	StreamUtils::read(input, &lastSet.EECR_EEMPE);
+	StreamUtils::read(input, &lastSet.PLLCSR_PLLE);
+	StreamUtils::read(input, &lastSet.ADCSRA_ADSC);
+	StreamUtils::read(input, &lastSet.Timer0Update);
+	StreamUtils::read(input, &lastSet.Timer3Update);
+	StreamUtils::read(input, &lastSet.Timer4Update);
+	A32U4_SKIP_HASH(); // covers a different set of fields
+
+	// nothing was in flight, the watchdog just starts counting from here
+	events.resetAll();
+	usart1.resetAll();
+	lastSet.WDTReset = mcu->cpu.getTotalCycles();
+	updateWDT();
+
+	scheduleInput();
+	scheduleDeviceEvents();
+}
+
+size_t A32u4::DataSpace::getStateBufSize() {
+	return Consts::data_size + Consts::eeprom_size + getPeriphStateBufSize();
+}
+void A32u4::DataSpace::getState(StateWriter& output) {
+	getRamState(output);
+	getEepromState(output);
+	getPeriphState(output);
+}
+void A32u4::DataSpace::setState(StateReader& input) {
+	setRamState(input);
+	setEepromState(input);
+	setPeriphState(input);
+}
+
+void A32u4::DataSpace::getRamState(StateWriter& output) {
+	update_Get_all();
+	output.write(data, Consts::data_size);
+}
+void A32u4::DataSpace::setRamState(StateReader& input) {
+	getDataLastCycs = (uint64_t)-1;
+	input.read(data, Consts::data_size);
+	updateCache();
+}
+void A32u4::DataSpace::getEepromState(StateWriter& output) const {
+	output.write(eeprom, Consts::eeprom_size);
+}
+void A32u4::DataSpace::setEepromState(StateReader& input) {
+	input.read(eeprom, Consts::eeprom_size);
+	markEEPROMChanged();
+}
+size_t A32u4::DataSpace::getPeriphStateBufSize() {
+	return sizeof(LastSet) + sizeof(Events::at) + sizeof(Usart);
+}
+void A32u4::DataSpace::getPeriphState(StateWriter& output) const {
+	// both only consist of fixed size fields
+	output.write(lastSet);
+	output.write(events.at, sizeof(events.at));
+	output.write(usart1);
+}
+void A32u4::DataSpace::setPeriphState(StateReader& input) {
+	input.read(&lastSet);
+	input.read(events.at, sizeof(events.at));
+	events.updateNext();
+	input.read(&usart1);
+
+	// the input queue and device events are not part of the state
+	scheduleInput();
+	scheduleDeviceEvents();
 }
 
 void A32u4::DataSpace::getRamState(std::ostream& output){
@@ -1223,6 +2317,7 @@ void A32u4::DataSpace::getEepromState(std::ostream& output){
 }
 void A32u4::DataSpace::setEepromState(std::istream& input){
 	input.read((char*)eeprom, Consts::eeprom_size);
+	markEEPROMChanged();
 }
 
 bool A32u4::DataSpace::operator==(const DataSpace& other) const{
@@ -1232,7 +2327,9 @@ bool A32u4::DataSpace::operator==(const DataSpace& other) const{
 		std::equal(sreg,sreg+8,other.sreg,[](uint8_t a,uint8_t b){
 			return (!!a) == (!!b);
 		}) &&
-		_CMP_(lastSet);
+		_CMP_(lastSet) &&
+		_CMP_(events) &&
+		_CMP_(usart1);
 #undef _CMP_
 }
 
@@ -1250,10 +2347,29 @@ size_t A32u4::DataSpace::sizeBytes() const {
 
 	sum += sizeof(SCK_Callback);
 	sum += sizeof(SPI_Byte_Callback);
+	sum += sizeof(spiSpanCallB);
+	sum += sizeof(spiSpanCallBUserData);
+	sum += sizeof(spiMisoCallB);
+	sum += sizeof(spiMisoCallBUserData);
+	sum += sizeof(spiBuf);
+	sum += sizeof(spiBufLen);
+	sum += sizeof(display);
+	sum += sizeof(audio);
+	sum += sizeof(spiFlash);
 
 	sum += sizeof(sreg);
 
 	sum += lastSet.sizeBytes();
+	sum += events.sizeBytes();
+	sum += usart1.sizeBytes();
+	sum += sizeof(usart1RxQueue) + usart1RxQueue.capacity();
+	sum += sizeof(usart1TxQueue) + usart1TxQueue.capacity();
+	sum += sizeof(usart1TxDropped);
+	sum += sizeof(eepromFile);
+	sum += sizeof(eepromDirty);
+	sum += sizeof(inputQueue) + inputQueue.size() * sizeof(InputEvent);
+	sum += sizeof(ioHooks) + (ioHooks ? ioHooksSize * sizeof(IOHook) : 0);
+	sum += sizeof(deviceEvents) + deviceEvents.capacity() * sizeof(DeviceEvent);
 
 	return sum;
 }
@@ -1268,6 +2384,8 @@ uint32_t A32u4::DataSpace::hash() const noexcept{
 		DU_HASHCB(h, buf, sizeof(sreg));
 	}
 	DU_HASH_COMB(h, lastSet.hash());
+	DU_HASH_COMB(h, events.hash());
+	DU_HASH_COMB(h, usart1.hash());
 	return h;
 }
 
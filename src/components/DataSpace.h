@@ -5,26 +5,63 @@
 #include <iostream> // istream & ostream
 #include <cstring> // for NULL
 #include <functional> // for std::function
+#include <deque>
+#include <vector>
+#include <memory>
 
 #include "../A32u4Types.h"
 #include "../config.h"
 
 #include "CPU.h" // for CPU::ClockFreq
+#include "../utils/SPSCRing.h"
+#include "../utils/MappedFile.h"
 
 namespace A32u4 {
 	class ATmega32u4;
+	struct StateWriter;
+	struct StateReader;
+	class SSD1306;
+	class AudioSink;
+	class SPIFlash;
 
 	class DataSpace {
 	public:
 		struct Consts {
 #include "DataspaceConstants.h"
 		};
+
+		struct SPITransfer {
+			enum {
+				Select_Display = 1<<0,
+				Select_SPIFlash = 1<<1
+			};
+			uint64_t cycle;
+			uint8_t mosi;
+			uint8_t portd; // state of PORTD at the time of the transfer (display data/command line, chip selects wired to PORTD)
+			uint8_t selected; // Select_x bits of the attached devices whose chip select was active, wherever it is wired
+		};
+		typedef void (*SPISpanCallB)(const SPITransfer* transfers, size_t len, void* userData);
+		typedef uint8_t (*SPIMisoCallB)(uint8_t mosi, uint8_t portd, void* userData); // returns the byte shifted in on MISO
+
+		struct InputEvent {
+			uint64_t cycle; // applied once the cpu reaches this cycle
+			uint8_t port; // ATmega32u4::PinChange_PORTx, the value is written to the ports PIN register
+			uint8_t mask; // bits to change
+			uint8_t val;
+		};
+
+		// hooks for external devices on io addresses
+		typedef uint8_t (*IOReadHook)(addrmcu_t addr, uint8_t val, void* userData); // val is the current register content, returns the value the cpu reads
+		typedef void (*IOWriteHook)(addrmcu_t addr, uint8_t val, uint8_t oldVal, void* userData); // called after the builtin handling
+		typedef void (*DeviceEventCallB)(uint64_t cycle, void* userData); // cycle is the one the event was scheduled for
 	private:
 		friend class ATmega32u4;
 		friend class Updates;
 		friend class CPU;
 		friend class Debugger;
 		friend class InstHandler;
+		friend class USB;
+		friend class InterleavedScheduler;
 
 		ATmega32u4* mcu;
 
@@ -39,6 +76,18 @@ namespace A32u4 {
 		std::function<void(void)> SCK_Callback = nullptr;
 		std::function<void(uint8_t)> SPI_Byte_Callback = NULL;
 
+		SPISpanCallB spiSpanCallB = nullptr;
+		void* spiSpanCallBUserData = nullptr;
+		SPIMisoCallB spiMisoCallB = nullptr;
+		void* spiMisoCallBUserData = nullptr;
+
+		SPITransfer spiBuf[MCU_SPI_BUF_SIZE];
+		size_t spiBufLen = 0;
+
+		SSD1306* display = nullptr;
+		AudioSink* audio = nullptr;
+		SPIFlash* spiFlash = nullptr;
+
 
 		uint8_t sreg[8] = {0,0,0,0,0,0,0,0};
 
@@ -49,6 +98,9 @@ namespace A32u4 {
 			uint64_t Timer0Update = 0;
 			uint64_t Timer3Update = 0;
 			uint64_t Timer4Update = 0;
+			uint64_t WDTCSR_WDCE = 0;
+			uint64_t WDTReset = 0;
+			uint64_t SPMCSR_SPMEN = 0;
 
 			void getState(std::ostream& output);
 			void setState(std::istream& input);
@@ -59,6 +111,86 @@ namespace A32u4 {
 			uint32_t hash() const noexcept;
 		} lastSet;
 
+		// timeline of scheduled events, each source has exactly one slot which holds the cycle it is due at
+		struct Events {
+			enum {
+				Event_WDT = 0,
+				Event_USART1_TX,
+				Event_USART1_RX,
+				Event_USB_Frame,
+				Event_EEPROM_Write,
+				Event_SPM,
+				Event_Input,
+				Event_Device, // earliest of the device events
+				Event_COUNT
+			};
+			static constexpr uint64_t None = (uint64_t)-1;
+
+			uint64_t at[Event_COUNT];
+			uint64_t next = None; // cycle of the earliest scheduled event
+
+			Events();
+
+			void schedule(uint8_t id, uint64_t cycs);
+			void cancel(uint8_t id);
+			void updateNext();
+
+			void getState(std::ostream& output);
+			void setState(std::istream& input);
+
+			void resetAll();
+			bool operator==(const Events& other) const;
+			size_t sizeBytes() const;
+			uint32_t hash() const noexcept;
+		} events;
+
+		struct Usart {
+			uint8_t txShift = 0; // byte currently being shifted out
+			uint8_t txBuf = 0; // byte waiting for the shift register
+			bool txBusy = false;
+			bool txBufFull = false;
+
+			void getState(std::ostream& output);
+			void setState(std::istream& input);
+
+			void resetAll();
+			bool operator==(const Usart& other) const;
+			size_t sizeBytes() const;
+			uint32_t hash() const noexcept;
+		} usart1;
+
+		// host side byte streams of USART1
+		SPSCRing<uint8_t> usart1RxQueue; // host => mcu
+		SPSCRing<uint8_t> usart1TxQueue; // mcu => host
+		uint64_t usart1TxDropped = 0;
+
+		std::deque<InputEvent> inputQueue; // sorted by cycle
+
+		struct IOHook {
+			IOReadHook read = nullptr;
+			void* readUserData = nullptr;
+			IOWriteHook write = nullptr;
+			void* writeUserData = nullptr;
+		};
+		static constexpr size_t ioHooksSize = Consts::io_size + Consts::ext_io_size + 1; // indexed by addr - io_start
+		std::unique_ptr<IOHook[]> ioHooks; // only allocated once something is hooked
+
+		struct DeviceEvent {
+			DeviceEventCallB callB;
+			void* userData;
+			uint64_t at;
+		};
+		std::vector<DeviceEvent> deviceEvents;
+
+		// optional file backing of the eeprom, changed pages are copied to the mapping on flush
+		static constexpr sizemcu_t eepromFlushPageSize = 64;
+		static constexpr uint8_t eepromNumFlushPages = Consts::eeprom_size / eepromFlushPageSize;
+		MappedFile eepromFile;
+		uint16_t eepromDirty = 0; // bit n is set if flush page n changed since the last flush
+		static_assert(eepromNumFlushPages <= sizeof(eepromDirty) * 8, "eepromDirty has too few bits");
+
+		uint64_t getDataLastCycs = (uint64_t)-1; // cycle at which getData last updated the io registers, -1 forces an update
+
 		static constexpr uint32_t PLLCSR_PLOCK_wait = 0; // was 1ms ((CPU::ClockFreq / 1000) * 1), we set it to 0 to match simavr for now 
 		static constexpr uint64_t ADC_wait = 0;
 
@@ -108,11 +240,18 @@ namespace A32u4 {
 		void setSPDR();
 		void setTCCR0B(uint8_t val, uint8_t oldVal);
 		void setTCCR4B(uint8_t val, uint8_t oldVal);
+		void setWDTCSR(uint8_t val, uint8_t oldVal);
+		void setUDR1(uint8_t val, uint8_t oldVal);
+		void setUCSR1B(uint8_t val, uint8_t oldVal);
+		void setSPMCSR(uint8_t val, uint8_t oldVal);
 
 		void updateSREGCache();
 
 		void updateCache();
 
+		void pollHostInputs(); // pick up input the host queued from another thread, called at the start of every execute
+		void flushOutputs(); // hand buffered output to the host, called at the end of every execute
+
 
 		// internal
 		uint8_t getGPReg_(regind_t ind) const;
@@ -123,6 +262,9 @@ namespace A32u4 {
 		uint16_t getADCVal();
 
 		void pinChange(uint8_t num, reg_t oldVal, reg_t val);
+		void setPinInput(uint16_t addr, reg_t val); // input coming from outside (host or input queue)
+		void pinInputChange(uint16_t addr, reg_t oldVal, reg_t val);
+		uint8_t getExtIntrLevelMask() const;
 
 
 		// Timer stuff
@@ -140,6 +282,44 @@ namespace A32u4 {
 		void markTimer3Update();
 		void markTimer4Update();
 		uint64_t cycsToNextTimerInt();
+		uint64_t cycsToNextWakeEvent();
+		void stallTimers(uint64_t amt);
+
+		void processEvents();
+		void handleEvent(uint8_t id);
+
+		// Watchdog
+		uint64_t getWDTPeriod() const;
+		void updateWDT();
+		void resetWDT();
+		void onWDTTimeout();
+
+		// USART1
+		uint64_t getUsart1FrameCycles() const;
+		void startUsart1Tx(uint8_t byte);
+		void onUsart1TxDone();
+		void onUsart1Rx();
+		void scheduleUsart1Rx();
+
+		// Input
+		void scheduleInput();
+		void applyInputs();
+
+		// Devices
+		IOHook* getIOHook(addrmcu_t addr);
+		void scheduleDeviceEvents();
+		void runDeviceEvents();
+
+		// EEPROM
+		static uint64_t getEEPROMWriteCycles(uint8_t mode);
+		void onEEPROMWriteDone();
+		void markEEPROMDirty(sizemcu_t addr);
+
+		// Self programming
+		static constexpr uint8_t SPMCSR_cmdMask = 0x3F; // SIGRD, RWWSRE, BLBSET, PGWRT, PGERS and SPMEN
+		static constexpr uint64_t SPM_wait = (CPU::ClockFreq / 1000) * 4; // page erase and page write take 3.7-4.5ms
+		void executeSPM();
+		void onSPMDone();
 
 
 		void setFlags_NZ(uint8_t res);
@@ -154,6 +334,36 @@ namespace A32u4 {
 		void setFlags_SVNZC_SUB_16(uint16_t a, uint16_t b, uint16_t res);
 	public:
 		void setSPIByteCallB(std::function<void(uint8_t)> func);
+		void setSPISpanCallB(SPISpanCallB callB, void* userData);
+		void setSPIMisoCallB(SPIMisoCallB callB, void* userData);
+		void flushSPI();
+
+		void attachDisplay(SSD1306* display); // nullptr to detach
+		void attachAudioSink(AudioSink* audio); // nullptr to detach
+		void attachSPIFlash(SPIFlash* flash); // nullptr to detach
+
+		// the mcu receives the written bytes at the configured baud rate, returns the amount that fit into the queue
+		// may be called from another thread (one writer), the bytes are picked up at the start of the next execute
+		size_t usart1Write(const uint8_t* buf, size_t len);
+		// bytes the mcu has transmitted, returns the amount written to out, may be called from another thread (one reader)
+		size_t usart1Read(uint8_t* out, size_t maxLen);
+		void setUsart1QueueSize(size_t size);
+		uint64_t getUsart1TxDropped() const; // transmitted bytes that didnt fit into the queue
+
+		// input pin changes applied at exact cycles (including pin change/external interrupts), entries in the past are applied as soon as possible
+		void queueInput(const InputEvent& event);
+		void queueInputs(const InputEvent* events, size_t len);
+		size_t getInputQueueLen() const;
+		void clearInputQueue();
+
+		// external devices: read/write hooks per io address (nullptr removes the hook), returns false if addr isnt an io address
+		bool setIOReadHook(addrmcu_t addr, IOReadHook hook, void* userData);
+		bool setIOWriteHook(addrmcu_t addr, IOWriteHook hook, void* userData);
+		// device events on the emulation timeline, the returned id is used to (re)schedule the event (also from inside its callback)
+		size_t addDeviceEvent(DeviceEventCallB callB, void* userData);
+		void removeDeviceEvent(size_t id);
+		void scheduleDeviceEvent(size_t id, uint64_t cycle);
+		void cancelDeviceEvent(size_t id);
 
 		uint8_t& getGPRegRef(regind_t ind);
 		uint8_t getGPReg(regind_t ind) const;
@@ -168,12 +378,33 @@ namespace A32u4 {
 
 		uint16_t getWordReg(uint8_t id) const;
 		void setWordReg(uint8_t id, uint16_t val);
-		uint8_t* getEEPROM();
+		uint8_t* getEEPROM(); // changes made through this pointer are not tracked, call markEEPROMChanged() afterwards
+		Span<const uint8_t> getEEPROMSpan() const;
+		// return the amount of bytes copied (less than len if the range goes past the end of the eeprom)
+		size_t readEEPROM(sizemcu_t addr, uint8_t* out, size_t len) const;
+		size_t writeEEPROM(sizemcu_t addr, const uint8_t* in, size_t len); // tracked like writes done by the cpu
+		// back the eeprom by a file: an existing file is loaded, a new one is created from the current content
+		bool mapEEPROM(const char* path);
+		void unmapEEPROM(); // flushes before unmapping
+		bool isEEPROMMapped() const;
+		void flushEEPROM(); // write changed pages back to the file
+		void markEEPROMChanged();
 		const uint8_t* getData();
 		uint8_t getDataByte(addrmcu_t Addr);
-		void setDataByte(addrmcu_t Addr, uint8_t byte);
+		void setDataByte(addrmcu_t Addr, uint8_t byte); // writes to PINx set the input value (unlike cpu writes, which toggle PORTx)
 		void setBitTo(addrmcu_t Addr, uint8_t bit, bool val);
 		void setBitsTo(addrmcu_t Addr, uint8_t mask, uint8_t bits);
+
+		enum {
+			Access_Raw = 0, // plain copy: reads bring the io registers up to date once per call (like getData), writes have no io side effects
+			Access_Emulated // every byte goes through getDataByte/setDataByte (io side effects and hooks, like the cpu would see them)
+		};
+		// bulk access to the data space, return the amount of bytes copied (less than len if the range goes past the end)
+		size_t readRange(addrmcu_t addr, uint8_t* out, size_t len, uint8_t access = Access_Raw);
+		size_t writeRange(addrmcu_t addr, const uint8_t* in, size_t len, uint8_t access = Access_Raw);
+		// scattered raw reads (e.g. a list of watched addresses) with one io update for all of them
+		// addresses outside the data space read as 0
+		void readAddrs(const addrmcu_t* addrs, uint8_t* out, size_t len);
 		void loadDataFromMemory(const uint8_t* data, size_t len);
 
 		addrmcu_t getSP() const;
@@ -182,9 +413,22 @@ namespace A32u4 {
 		void setRamState(std::istream& input);
 		void getEepromState(std::ostream& output);
 		void setEepromState(std::istream& input);
+		// the parts of the buffer state: ram (Consts::data_size bytes), eeprom (Consts::eeprom_size bytes) and the peripherals
+		void getRamState(StateWriter& output);
+		void setRamState(StateReader& input);
+		void getEepromState(StateWriter& output) const;
+		void setEepromState(StateReader& input);
+		static size_t getPeriphStateBufSize();
+		void getPeriphState(StateWriter& output) const;
+		void setPeriphState(StateReader& input);
 
 		void getState(std::ostream& output);
 		void setState(std::istream& input);
+		void setStateV0(std::istream& input); // layout of version 0 ATmega32u4 streams: no events or usart and fewer lastSet fields
+		// fixed layout without hashes, for ATmega32u4::saveState
+		static size_t getStateBufSize();
+		void getState(StateWriter& output);
+		void setState(StateReader& input);
 
 		bool operator==(const DataSpace& other) const;
 		size_t sizeBytes() const;
@@ -22,14 +22,25 @@ static constexpr addrmcu_t RAMPZ = 0x5b;
 static constexpr addrmcu_t MCUSR = 0x54;
 static constexpr uint8_t MCUSR_USBRF = 5, MCUSR_JTRF = 4, MCUSR_WDRF = 3, MCUSR_BORF = 2, MCUSR_EXTRF = 1, MCUSR_PORF = 0;
 
+static constexpr addrmcu_t WDTCSR = 0x60;
+static constexpr uint8_t WDTCSR_WDIF = 7, WDTCSR_WDIE = 6, WDTCSR_WDP3 = 5, WDTCSR_WDCE = 4, WDTCSR_WDE = 3, WDTCSR_WDP2 = 2, WDTCSR_WDP1 = 1, WDTCSR_WDP0 = 0;
+
 static constexpr addrmcu_t PORTB = 0x25, PORTC = 0x28, PORTD = 0x2B, PORTE = 0x2E, PORTF = 0x31;
 static constexpr addrmcu_t PINB = 0x23, PINC = 0x26, PIND = 0x29, PINE = 0x2C, PINF = 0x2F;
-static constexpr addrmcu_t DDRC = 0x27;
+static constexpr addrmcu_t DDRB = 0x24, DDRC = 0x27, DDRD = 0x2A, DDRE = 0x2D, DDRF = 0x30;
 static constexpr uint8_t DDRC_DDC7 = 7, DDRC_DDC6 = 6;
 
+static constexpr addrmcu_t EICRA = 0x69, EICRB = 0x6A, EIMSK = 0x3D, EIFR = 0x3C;
+static constexpr uint8_t EIMSK_INT6 = 6, EIMSK_INT3 = 3, EIMSK_INT2 = 2, EIMSK_INT1 = 1, EIMSK_INT0 = 0;
+static constexpr addrmcu_t PCICR = 0x68, PCIFR = 0x3B, PCMSK0 = 0x6B;
+static constexpr uint8_t PCICR_PCIE0 = 0, PCIFR_PCIF0 = 0;
+
 static constexpr addrmcu_t EEARH = 0x42, EEARL = 0x41, EEDR = 0x40, EECR = 0x3F;
 static constexpr uint8_t EECR_EEPM1 = 5, EECR_EEPM0 = 4, EECR_EERIE = 3, EECR_EEMPE = 2, EECR_EEPE = 1, EECR_EERE = 0;
 
+static constexpr addrmcu_t SPMCSR = 0x57;
+static constexpr uint8_t SPMCSR_SPMIE = 7, SPMCSR_RWWSB = 6, SPMCSR_SIGRD = 5, SPMCSR_RWWSRE = 4, SPMCSR_BLBSET = 3, SPMCSR_PGWRT = 2, SPMCSR_PGERS = 1, SPMCSR_SPMEN = 0;
+
 static constexpr addrmcu_t PLLCSR = 0x49;
 static constexpr uint8_t PLLCSR_PINDIV = 4, PLLCSR_PLLE = 1, PLLCSR_PLOCK = 0;
 
@@ -56,6 +67,7 @@ static constexpr addrmcu_t OCR4A = 0xCF;
 static constexpr addrmcu_t TWSR = 0xB9;
 
 static constexpr addrmcu_t SMCR = 0x53;
+static constexpr uint8_t SMCR_SM2 = 3, SMCR_SM1 = 2, SMCR_SM0 = 1, SMCR_SE = 0;
 
 static constexpr addrmcu_t ADCSRA = 0x7A;
 static constexpr uint8_t ADCSRA_ADEN = 7, ADCSRA_ADSC = 6, ADCSRA_ADATE = 5, ADCSRA_ADIF = 4, ADCSRA_ADIE = 3, ADCSRA_ADPS2 = 2, ADCSRA_ADPS1 = 1, ADCSRA_ADPS0 = 0;
@@ -69,16 +81,49 @@ static constexpr addrmcu_t ADCH = 0x79;
 static constexpr addrmcu_t ADCL = 0x78;
 
 static constexpr addrmcu_t UCSR1A = 0xC8;
-static constexpr uint8_t UCSR1A_UDRE1 = 5, UCSR1A_U2X1 = 1;
+static constexpr uint8_t UCSR1A_RXC1 = 7, UCSR1A_TXC1 = 6, UCSR1A_UDRE1 = 5, UCSR1A_FE1 = 4, UCSR1A_DOR1 = 3, UCSR1A_PE1 = 2, UCSR1A_U2X1 = 1, UCSR1A_MPCM1 = 0;
 static constexpr addrmcu_t UCSR1B = 0xC9;
-static constexpr uint8_t UCSR1B_TXEN1 = 3, UCSR1B_UCSZ12 = 2;
+static constexpr uint8_t UCSR1B_RXCIE1 = 7, UCSR1B_TXCIE1 = 6, UCSR1B_UDRIE1 = 5, UCSR1B_RXEN1 = 4, UCSR1B_TXEN1 = 3, UCSR1B_UCSZ12 = 2, UCSR1B_RXB81 = 1, UCSR1B_TXB81 = 0;
 static constexpr addrmcu_t UCSR1C = 0xCA;
-static constexpr uint8_t UCSR1C_UCSZ11 = 2, UCSR1C_UCSZ10 = 1;
+static constexpr uint8_t UCSR1C_UPM11 = 5, UCSR1C_UPM10 = 4, UCSR1C_USBS1 = 3, UCSR1C_UCSZ11 = 2, UCSR1C_UCSZ10 = 1, UCSR1C_UCPOL1 = 0;
+static constexpr addrmcu_t UBRR1L = 0xCC, UBRR1H = 0xCD;
+static constexpr addrmcu_t UDR1 = 0xCE;
 static constexpr addrmcu_t UCSR1D = 0xCB;
 
+static constexpr addrmcu_t UHWCON = 0xD7;
+static constexpr uint8_t UHWCON_UVREGE = 0;
 static constexpr addrmcu_t USBCON = 0xD8;
-static constexpr uint8_t USBCON_FRZCLK = 5;
+static constexpr uint8_t USBCON_USBE = 7, USBCON_FRZCLK = 5, USBCON_OTGPADE = 4, USBCON_VBUSTE = 0;
+static constexpr addrmcu_t USBSTA = 0xD9;
+static constexpr uint8_t USBSTA_SPEED = 3, USBSTA_ID = 1, USBSTA_VBUS = 0;
+static constexpr addrmcu_t USBINT = 0xDA;
+static constexpr uint8_t USBINT_VBUSTI = 0;
 
 static constexpr addrmcu_t UDCON = 0xE0;
-static constexpr uint8_t UDCON_DETACH = 0;
+static constexpr uint8_t UDCON_RSTCPU = 3, UDCON_LSM = 2, UDCON_RMWKUP = 1, UDCON_DETACH = 0;
+static constexpr addrmcu_t UDINT = 0xE1;
+static constexpr uint8_t UDINT_UPRSMI = 6, UDINT_EORSMI = 5, UDINT_WAKEUPI = 4, UDINT_EORSTI = 3, UDINT_SOFI = 2, UDINT_SUSPI = 0;
+static constexpr addrmcu_t UDIEN = 0xE2;
+static constexpr addrmcu_t UDADDR = 0xE3;
+static constexpr uint8_t UDADDR_ADDEN = 7;
+static constexpr addrmcu_t UDFNUML = 0xE4, UDFNUMH = 0xE5;
+static constexpr addrmcu_t UDMFN = 0xE6;
+
+static constexpr addrmcu_t UEINTX = 0xE8;
+static constexpr uint8_t UEINTX_FIFOCON = 7, UEINTX_NAKINI = 6, UEINTX_RWAL = 5, UEINTX_NAKOUTI = 4, UEINTX_RXSTPI = 3, UEINTX_RXOUTI = 2, UEINTX_STALLEDI = 1, UEINTX_TXINI = 0;
+static constexpr addrmcu_t UENUM = 0xE9;
+static constexpr addrmcu_t UERST = 0xEA;
+static constexpr addrmcu_t UECONX = 0xEB;
+static constexpr uint8_t UECONX_STALLRQ = 5, UECONX_STALLRQC = 4, UECONX_RSTDT = 3, UECONX_EPEN = 0;
+static constexpr addrmcu_t UECFG0X = 0xEC;
+static constexpr uint8_t UECFG0X_EPTYPE1 = 7, UECFG0X_EPTYPE0 = 6, UECFG0X_EPDIR = 0;
+static constexpr addrmcu_t UECFG1X = 0xED;
+static constexpr uint8_t UECFG1X_EPSIZE2 = 6, UECFG1X_EPSIZE1 = 5, UECFG1X_EPSIZE0 = 4, UECFG1X_EPBK1 = 3, UECFG1X_EPBK0 = 2, UECFG1X_ALLOC = 1;
+static constexpr addrmcu_t UESTA0X = 0xEE;
+static constexpr uint8_t UESTA0X_CFGOK = 7;
+static constexpr addrmcu_t UESTA1X = 0xEF;
+static constexpr addrmcu_t UEIENX = 0xF0;
+static constexpr addrmcu_t UEDATX = 0xF1;
+static constexpr addrmcu_t UEBCLX = 0xF2, UEBCHX = 0xF3;
+static constexpr addrmcu_t UEINT = 0xF4;
 
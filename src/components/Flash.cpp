@@ -1,5 +1,6 @@
 #include "Flash.h"
 
+#include <algorithm>
 #include <cstring>
 #include <string>
 #include <fstream>
@@ -8,49 +9,92 @@
 #include "StreamUtils.h"
 #include "DataUtils.h"
 
+#include "../utils/StateBuffer.h"
+
 #include "../ATmega32u4.h"
 #include "InstHandler.h"
 
 #define LU_MODULE "Flash"
 
 A32u4::Flash::Flash(ATmega32u4* mcu): mcu(mcu)
+{
 #if MCU_USE_HEAP
-	,data(new uint8_t[sizeMax])
-#if MCU_USE_INSTCACHE
-	, instCache(new uint8_t[sizeMax / 2])
+	allocBlock();
 #endif
-#endif
-{
-	
+	clearPageBuffer();
 }
 
 A32u4::Flash::~Flash() {
+
+}
+
+A32u4::Flash::Flash(const Flash& src)
+{
+	operator=(src);
+}
+A32u4::Flash& A32u4::Flash::operator=(const Flash& src){
+	shareProgram(src);
+	std::memcpy(pageBuffer, src.pageBuffer, pageSize);
+	return *this;
+}
+
 #if MCU_USE_HEAP
-	delete[] data;
+void A32u4::Flash::allocBlock() {
 #if MCU_USE_INSTCACHE
-	delete[] instCache;
+	constexpr size_t blockSize = sizeMax + sizeMax / 2;
+#else
+	constexpr size_t blockSize = sizeMax;
 #endif
+	block = std::shared_ptr<uint8_t>(new uint8_t[blockSize], std::default_delete<uint8_t[]>());
+	data = block.get();
+#if MCU_USE_INSTCACHE
+	instCache = data + sizeMax;
 #endif
 }
-
-A32u4::Flash::Flash(const Flash& src):
+#endif
+void A32u4::Flash::makeDataUnique() {
 #if MCU_USE_HEAP
-	data(new uint8_t[sizeMax])
+	if (block.use_count() > 1) {
+		const uint8_t* old = data;
 #if MCU_USE_INSTCACHE
-	, instCache(new uint8_t[sizeMax / 2])
+		const uint8_t* oldCache = instCache;
 #endif
+		std::shared_ptr<uint8_t> keep = block; // keep the old one alive until it is copied
+		allocBlock();
+		std::memcpy(data, old, sizeMax);
+#if MCU_USE_INSTCACHE
+		std::memcpy(instCache, oldCache, sizeMax / 2);
+#endif
+	}
 #endif
-{
-	operator=(src);
 }
-A32u4::Flash& A32u4::Flash::operator=(const Flash& src){
+void A32u4::Flash::makeDataUniqueNoCopy() {
+#if MCU_USE_HEAP
+	if (block.use_count() > 1)
+		allocBlock();
+#endif
+}
+
+void A32u4::Flash::shareProgram(const Flash& src) {
+	if (&src == this)
+		return;
+#if MCU_USE_HEAP
+	block = src.block;
+	data = src.data;
+#if MCU_USE_INSTCACHE
+	instCache = src.instCache;
+#endif
+#else
 	std::memcpy(data, src.data, sizeMax);
 #if MCU_USE_INSTCACHE
 	std::memcpy(instCache, src.instCache, sizeMax/2);
+#endif
 #endif
 	size_ = src.size_;
 	hasProgram = src.hasProgram;
-	return *this;
+}
+bool A32u4::Flash::sharesProgramWith(const Flash& other) const {
+	return data == other.data;
 }
 
 uint8_t A32u4::Flash::getByte(addrmcu_t addr) const {
@@ -86,9 +130,13 @@ uint8_t A32u4::Flash::getInstInd(pc_t pc) const{
 const uint8_t* A32u4::Flash::getData() {
 	return data;
 }
+A32u4::Span<const uint8_t> A32u4::Flash::getDataSpan() const {
+	return { data, sizeMax };
+}
 
 void A32u4::Flash::setByte(addrmcu_t addr, uint8_t val){
 	A32U4_ASSERT_INRANGE2(addr, 0, sizeMax, return, "Flash setByte Address too Big: " MCU_ADDR_FORMAT);
+	makeDataUnique();
 	data[addr] = val;
 #if MCU_USE_INSTCACHE
 	populateInstIndCacheEntry(addr/2);
@@ -96,6 +144,7 @@ void A32u4::Flash::setByte(addrmcu_t addr, uint8_t val){
 }
 void A32u4::Flash::setInst(pc_t pc, uint16_t val){
 	A32U4_ASSERT_INRANGE2(pc, 0, sizeMax/2, return, "Flash setWord pc too Big: " MCU_ADDR_FORMAT);
+	makeDataUnique();
 	data[pc*2] = val&0xFF;
 	data[pc*2+1] = (val>>8)&0xFF;
 
@@ -104,6 +153,69 @@ void A32u4::Flash::setInst(pc_t pc, uint16_t val){
 #endif
 }
 
+size_t A32u4::Flash::readRange(addrmcu_t addr, uint8_t* out, size_t len) const {
+	if (addr >= sizeMax)
+		return 0;
+	len = std::min(len, (size_t)(sizeMax - addr));
+	std::memcpy(out, data + addr, len);
+	return len;
+}
+size_t A32u4::Flash::writeRange(addrmcu_t addr, const uint8_t* in, size_t len) {
+	if (addr >= sizeMax)
+		return 0;
+	len = std::min(len, (size_t)(sizeMax - addr));
+	if (len == 0)
+		return 0;
+
+	makeDataUnique();
+	std::memcpy(data + addr, in, len);
+	for (uint16_t page = addr / pageSize; page <= (addr + len - 1) / pageSize; page++) {
+		invalidatePage(page);
+	}
+	return len;
+}
+
+void A32u4::Flash::fillPageBuffer(addrmcu_t addr, uint16_t word) {
+	const sizemcu_t off = addr & (pageSize - 2); // Z0 is ignored
+	pageBuffer[off] = word & 0xFF;
+	pageBuffer[off + 1] = (word >> 8) & 0xFF;
+}
+void A32u4::Flash::clearPageBuffer() {
+	std::memset(pageBuffer, 0xFF, pageSize);
+}
+void A32u4::Flash::erasePage(addrmcu_t addr) {
+	const uint16_t page = (addr % sizeMax) / pageSize;
+	makeDataUnique();
+	std::memset(data + page * pageSize, 0xFF, pageSize);
+	invalidatePage(page);
+}
+void A32u4::Flash::writePage(addrmcu_t addr) {
+	const uint16_t page = (addr % sizeMax) / pageSize;
+	makeDataUnique();
+	// programming can only clear bits, so an unerased page gets the AND of both
+	for (sizemcu_t i = 0; i < pageSize; i++) {
+		data[page * pageSize + i] &= pageBuffer[i];
+	}
+	clearPageBuffer();
+
+	const sizemcu_t end = (sizemcu_t)((page + 1) * pageSize);
+	if (!hasProgram || size_ < end) {
+		size_ = end;
+	}
+	hasProgram = true;
+
+	invalidatePage(page);
+}
+void A32u4::Flash::invalidatePage(uint16_t page) {
+#if MCU_USE_INSTCACHE
+	for (pc_t pc = page * (pageSize / 2); pc < (page + 1) * (pageSize / 2); pc++) {
+		populateInstIndCacheEntry(pc);
+	}
+#else
+	CU_UNUSED(page);
+#endif
+}
+
 sizemcu_t A32u4::Flash::size() const {
 	return size_;
 }
@@ -113,26 +225,30 @@ sizemcu_t A32u4::Flash::sizeWords() const{
 
 
 void A32u4::Flash::clear() {
-	for (uint16_t i = 0; i < sizeMax; i++) {
-		data[i] = 0;
-	}
+	makeDataUniqueNoCopy();
+	std::memset(data, 0, sizeMax);
+#if MCU_USE_INSTCACHE
+	populateInstIndCache();
+#endif
+	clearPageBuffer();
 	hasProgram = false;
 }
 
 bool A32u4::Flash::loadFromMemory(const uint8_t* data_, size_t dataLen) {
 	if (dataLen >= sizeMax) {
-		LU_LOGF_(LogUtils::LogLevel_Warning,"%" CU_PRIuSIZE " bytes is more than fits into the Flash, max is %" MCU_PRIuSIZEMCU " bytes", dataLen, sizeMax);
+		LU_LOGF(LogUtils::LogLevel_Warning,"%" CU_PRIuSIZE " bytes is more than fits into the Flash, max is %" MCU_PRIuSIZEMCU " bytes", dataLen, sizeMax);
 		// return; // should we return here?
 	}
 
-	clear();
-
+	makeDataUniqueNoCopy();
 	size_ = (sizemcu_t)std::min(dataLen,(size_t)sizeMax);
 	if(size_ > 0)
 		std::memcpy(data, data_, size_);
+	std::memset(data + size_, 0, sizeMax - size_);
+	clearPageBuffer();
 	hasProgram = true;
 
-#if FLASH_USE_INSTIND_CACHE
+#if MCU_USE_INSTCACHE
 	populateInstIndCache();
 #endif
 	return true;
@@ -146,7 +262,7 @@ bool A32u4::Flash::loadFromHexFile(const char* path) {
 	{
 		const char* ext = StringUtils::getFileExtension(path);
 		if (std::strcmp(ext, "hex") != 0) {
-			LU_LOGF_(LogUtils::LogLevel_Warning, "Unknown extension for loading flash contents via hex file: \"%s\"", ext);
+			LU_LOGF(LogUtils::LogLevel_Warning, "Unknown extension for loading flash contents via hex file: \"%s\"", ext);
 		}
 	}
 
@@ -155,7 +271,7 @@ bool A32u4::Flash::loadFromHexFile(const char* path) {
 }
 #if MCU_USE_INSTCACHE
 void A32u4::Flash::populateInstIndCache(){
-	for (uint16_t i = 0; i < sizeWords(); i++) {
+	for (uint16_t i = 0; i < sizeMax / 2; i++) { // all of it, a fresh block has no valid entries
 		populateInstIndCacheEntry(i);
 	}
 }
@@ -176,9 +292,10 @@ void A32u4::Flash::getRomState(std::ostream& output) {
 void A32u4::Flash::setRomState(std::istream& input){
 	StreamUtils::read(input, &size_);
 	DU_ASSERTEX(size_ <= sizeMax, StringUtils::format("Flash size read from state is too big: %" CU_PRIuSIZE, (size_t)size_));
+	makeDataUniqueNoCopy();
 	input.read((char*)data, sizeMax);
 
-#if FLASH_USE_INSTIND_CACHE
+#if MCU_USE_INSTCACHE
 	populateInstIndCache();
 #endif
 }
@@ -187,6 +304,7 @@ void A32u4::Flash::getState(std::ostream& output){
 	getRomState(output);
 
 	StreamUtils::write(output, hasProgram);
+	output.write((const char*)pageBuffer, pageSize);
 #if MCU_WRITE_HASH
 	StreamUtils::write(output, hash());
 #endif
@@ -195,11 +313,61 @@ void A32u4::Flash::setState(std::istream& input){
 	setRomState(input);
 
 	StreamUtils::read(input, &hasProgram);
+	input.read((char*)pageBuffer, pageSize);
 	A32U4_CHECK_HASH("Flash");
 }
+void A32u4::Flash::setStateV0(std::istream& input){
+	setRomState(input);
+
+	StreamUtils::read(input, &hasProgram);
+	std::memset(pageBuffer, 0xFF, pageSize);
+	A32U4_SKIP_HASH(); // covers a different set of fields
+}
+
+size_t A32u4::Flash::getStateBufSize() {
+	return sizeMax + getInfoStateBufSize();
+}
+void A32u4::Flash::getState(StateWriter& output) const {
+	getImageState(output);
+	getInfoState(output);
+}
+void A32u4::Flash::setState(StateReader& input) {
+	setImageState(input);
+	setInfoState(input);
+}
+
+void A32u4::Flash::getImageState(StateWriter& output) const {
+	output.write(data, sizeMax);
+}
+void A32u4::Flash::setImageState(StateReader& input) {
+	// loading the same program again (e.g. when rewinding) should not unshare it
+	if (std::memcmp(data, input.ptr, sizeMax) != 0) {
+		makeDataUniqueNoCopy();
+		std::memcpy(data, input.ptr, sizeMax);
+#if MCU_USE_INSTCACHE
+		populateInstIndCache();
+#endif
+	}
+	input.ptr += sizeMax;
+}
+size_t A32u4::Flash::getInfoStateBufSize() {
+	return sizeof(size_) + sizeof(hasProgram) + pageSize;
+}
+void A32u4::Flash::getInfoState(StateWriter& output) const {
+	output.write(size_);
+	output.write(hasProgram);
+	output.write(pageBuffer, pageSize);
+}
+void A32u4::Flash::setInfoState(StateReader& input) {
+	input.read(&size_);
+	DU_ASSERTEX(size_ <= sizeMax, StringUtils::format("Flash size read from state is too big: %" CU_PRIuSIZE, (size_t)size_));
+	input.read(&hasProgram);
+	input.read(pageBuffer, pageSize);
+}
 
 bool A32u4::Flash::operator==(const Flash& other) const{
 	return size_==other.size_ && std::memcmp(data,other.data,sizeMax) == 0 
+		&& std::memcmp(pageBuffer,other.pageBuffer,pageSize) == 0
 #if FLASH_USE_INSTIND_CACHE
 		&& std::memcmp(instCache,other.instCache,sizeMax/2) == 0
 #endif
@@ -222,6 +390,7 @@ size_t A32u4::Flash::sizeBytes() const {
 #endif
 
 	sum += sizeof(hasProgram);
+	sum += sizeof(pageBuffer);
 
 	return sum;
 }
@@ -230,6 +399,7 @@ uint32_t A32u4::Flash::hash() const noexcept{
 	DU_HASHC(h,size_);
 	DU_HASHCB(h, data, sizeMax);
 	DU_HASHC(h,hasProgram);
+	DU_HASHCB(h, pageBuffer, pageSize);
 	return h;
 }
 
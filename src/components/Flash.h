@@ -3,18 +3,24 @@
 
 #include <cstring>
 #include <iostream>
+#include <memory>
 
 #include "../config.h"
 #include "../A32u4Types.h"
 
 namespace A32u4 {
 	class ATmega32u4;
+	struct StateWriter;
+	struct StateReader;
 
 	class Flash {
 	public:
 		static constexpr sizemcu_t sizeMax = 32768;
+		static constexpr sizemcu_t pageSize = 128; // bytes per page for self programming
+		static constexpr sizemcu_t numPages = sizeMax / pageSize;
 	private:
 		friend class ATmega32u4;  // for con/de-structor
+		friend class DataSpace; // for self programming
 
 		ATmega32u4* mcu;
 
@@ -24,15 +30,28 @@ namespace A32u4 {
 		uint8_t instCache[sizeMax/2];
 #endif
 #else
+		// data (and the instCache) live in one block that is shared between copies until one of them writes to it
+		std::shared_ptr<uint8_t> block;
 		uint8_t* data;
 #if MCU_USE_INSTCACHE
 		uint8_t* instCache;
 #endif
+		void allocBlock();
 #endif
+		void makeDataUnique(); // call before modifying data
+		void makeDataUniqueNoCopy(); // same, but the contents are undefined afterwards, for callers that overwrite all of data (and the instCache)
 
 		sizemcu_t size_ = sizeMax;
 		bool hasProgram = false;
 
+		uint8_t pageBuffer[pageSize]; // temporary page buffer filled by SPM
+
+		void fillPageBuffer(addrmcu_t addr, uint16_t word);
+		void clearPageBuffer();
+		void erasePage(addrmcu_t addr);
+		void writePage(addrmcu_t addr);
+		void invalidatePage(uint16_t page); // update everything derived from the content of the page
+
 		Flash(ATmega32u4* mcu);
 		~Flash();
 
@@ -51,10 +70,15 @@ namespace A32u4 {
 		uint8_t getInstInd(pc_t pc) const;
 
 		const uint8_t* getData();
+		Span<const uint8_t> getDataSpan() const; // the whole flash (sizeMax), the program is the first size() bytes
 
 		void setByte(addrmcu_t addr, uint8_t val);
 		void setInst(pc_t pc, uint16_t val);
 
+		// return the amount of bytes copied (less than len if the range goes past the end of the flash)
+		size_t readRange(addrmcu_t addr, uint8_t* out, size_t len) const;
+		size_t writeRange(addrmcu_t addr, const uint8_t* in, size_t len); // unshares the program once for the whole range
+
 		bool loadFromMemory(const uint8_t* data, size_t dataLen);
 		bool loadFromHexFile(const char* path);
 		bool loadFromHexString(const char* str, const char* str_end = 0);
@@ -65,11 +89,27 @@ namespace A32u4 {
 
 		bool isProgramLoaded() const; // returns true if a program was loaded
 
+		// use the program of src without copying it (if MCU_USE_HEAP), it gets copied once one of them modifies it
+		void shareProgram(const Flash& src);
+		bool sharesProgramWith(const Flash& other) const;
+
 		void getRomState(std::ostream& output);
 		void setRomState(std::istream& input);
 
 		void getState(std::ostream& output);
 		void setState(std::istream& input);
+		void setStateV0(std::istream& input); // layout of version 0 ATmega32u4 streams: no page buffer
+		// fixed layout without hashes, for ATmega32u4::saveState
+		static size_t getStateBufSize();
+		void getState(StateWriter& output) const;
+		void setState(StateReader& input);
+		// the parts of the buffer state: the image (sizeMax bytes) and the rest (program size, page buffer)
+		// setImageState keeps sharing the program if the saved one is the same
+		void getImageState(StateWriter& output) const;
+		void setImageState(StateReader& input);
+		static size_t getInfoStateBufSize();
+		void getInfoState(StateWriter& output) const;
+		void setInfoState(StateReader& input);
 
 		bool operator==(const Flash& other) const;
 		size_t sizeBytes() const;
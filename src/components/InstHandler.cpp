@@ -1094,6 +1094,7 @@ A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_RETI(ATmega32u4* mcu,
 	mcu->cpu.PC = addr;
 
 	mcu->dataspace.sreg[DataSpace::Consts::SREG_I] = 1;
+	mcu->cpu.breakOutOfOptimisation(); // same as SEI, interrupts that became pending during the ISR might be executed now
 
 	//mcu->debugger.popPCFromCallStack();
 
@@ -1297,6 +1298,8 @@ A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_BSET(ATmega32u4* mcu,
 	const uint8_t s = gets3_c(word);
 
 	mcu->dataspace.sreg[s] = 1;
+	if (s == DataSpace::Consts::SREG_I)
+		mcu->cpu.breakOutOfOptimisation(); // same as SEI, pending interrupts might be executed now
 
 	return inst_effect_t(1,1);
 }
@@ -1831,11 +1834,11 @@ A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_ELPM_dpostInc(ATmega3
 	return inst_effect_t(3,1);
 }
 A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_SPM(ATmega32u4* mcu, uint16_t word) noexcept {
-	//TODO
-	CU_UNUSED(mcu);
 	CU_UNUSED(word);
 
-	return inst_effect_t(0,1);
+	mcu->dataspace.executeSPM();
+
+	return inst_effect_t(1,1);
 }
 A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_IN(ATmega32u4* mcu, uint16_t word) noexcept {
 	const uint8_t Rd_id = getRd5_c(word);
@@ -1881,15 +1884,19 @@ A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_NOP(ATmega32u4* mcu,
 A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_SLEEP(ATmega32u4* mcu, uint16_t word) noexcept {
 	CU_UNUSED(word);
 	
-	//TODO
 	uint8_t SMCR_val = mcu->dataspace.getByteAt(DataSpace::Consts::SMCR);
-	if (SMCR_val & 0b1) { //if SE (sleep enable) is set
-		switch ((SMCR_val >> 1) & 0b111) {
-		case 0: //idle
+	if (SMCR_val & (1 << DataSpace::Consts::SMCR_SE)) { //if SE (sleep enable) is set
+		switch ((SMCR_val >> DataSpace::Consts::SMCR_SM0) & 0b111) {
+		case CPU::SleepMode_Idle:
+		case CPU::SleepMode_ADCNoiseReduction:
+		case CPU::SleepMode_PowerDown:
+		case CPU::SleepMode_PowerSave:
+		case CPU::SleepMode_Standby:
+		case CPU::SleepMode_ExtendedStandby:
 			mcu->cpu.CPU_sleep = true;
 			mcu->cpu.breakOutOfOptimisation();
 			break;
-		default:
+		default: // reserved
 			break;
 		}
 	}
@@ -1898,9 +1905,8 @@ A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_SLEEP(ATmega32u4* mcu
 	return inst_effect_t(1,1);
 }
 A32u4::InstHandler::inst_effect_t A32u4::InstHandler::INST_WDR(ATmega32u4* mcu, uint16_t word) noexcept {
-	//TODO
-	CU_UNUSED(mcu);
 	CU_UNUSED(word);
+	mcu->dataspace.resetWDT();
 
 	return inst_effect_t(1,1);
 }
@@ -0,0 +1,467 @@
+#include "USB.h"
+
+#include <cstring>
+
+#include "../utils/StateBuffer.h"
+
+#include "StreamUtils.h"
+#include "DataUtils.h"
+
+#include "../ATmega32u4.h"
+
+#define LU_MODULE "USB"
+
+typedef A32u4::DataSpace::Consts Consts;
+
+// requests of the emulated host to get the device configured (see EnumStep_*)
+static constexpr uint8_t setupPackets[][8] = {
+	{0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00}, // SET_ADDRESS 1
+	{0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00}, // SET_CONFIGURATION 1
+	{0x21, 0x22, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // CDC SET_CONTROL_LINE_STATE DTR|RTS on interface 0
+};
+
+A32u4::USB::USB(ATmega32u4* mcu) : mcu(mcu), cdcOutQueue(4096), cdcInQueue(4096) {
+	std::memset(eps, 0, sizeof(eps));
+}
+
+A32u4::USB::USB(const USB& src) : mcu(src.mcu), cdcOutQueue(src.cdcOutQueue.capacity()), cdcInQueue(src.cdcInQueue.capacity()) {
+	operator=(src);
+}
+A32u4::USB& A32u4::USB::operator=(const USB& src) {
+	std::memcpy(eps, src.eps, sizeof(eps));
+	currEp = src.currEp;
+	enumStep = src.enumStep;
+	frameNum = src.frameNum;
+	return *this;
+}
+
+void A32u4::USB::reset() {
+	std::memset(eps, 0, sizeof(eps));
+	currEp = 0;
+	enumStep = EnumStep_Reset;
+	frameNum = 0;
+
+	mcu->dataspace.data[Consts::USBSTA] = 1 << Consts::USBSTA_VBUS; // the cable is always plugged in
+}
+
+uint8_t A32u4::USB::bankInd(addrmcu_t addr) {
+	for (uint8_t i = 0; i < numBankedRegs; i++) {
+		if (bankedRegs[i] == addr)
+			return i;
+	}
+	DU_ASSERT(false);
+	return 0;
+}
+uint8_t& A32u4::USB::reg(uint8_t ep, addrmcu_t addr) {
+	if (ep == currEp)
+		return mcu->dataspace.data[addr];
+	return eps[ep].regs[bankInd(addr)];
+}
+uint8_t A32u4::USB::getReg(uint8_t ep, addrmcu_t addr) const {
+	if (ep == currEp)
+		return mcu->dataspace.data[addr];
+	return eps[ep].regs[bankInd(addr)];
+}
+void A32u4::USB::selectEndpoint(uint8_t ep) {
+	if (ep >= numEndpoints) // invalid, just keep the current one
+		return;
+
+	for (uint8_t i = 0; i < numBankedRegs; i++) {
+		eps[currEp].regs[i] = mcu->dataspace.data[bankedRegs[i]];
+	}
+	currEp = ep;
+	for (uint8_t i = 0; i < numBankedRegs; i++) {
+		mcu->dataspace.data[bankedRegs[i]] = eps[currEp].regs[i];
+	}
+}
+
+uint16_t A32u4::USB::epSize(uint8_t ep) const {
+	const uint16_t size = 8 << ((getReg(ep, Consts::UECFG1X) >> Consts::UECFG1X_EPSIZE0) & 0b111);
+	return size < fifoSize ? size : fifoSize;
+}
+bool A32u4::USB::epIsIn(uint8_t ep) const {
+	return getReg(ep, Consts::UECFG0X) & (1 << Consts::UECFG0X_EPDIR);
+}
+uint8_t A32u4::USB::epType(uint8_t ep) const {
+	return getReg(ep, Consts::UECFG0X) >> Consts::UECFG0X_EPTYPE0;
+}
+uint8_t A32u4::USB::findCdcEp(bool in) const {
+	for (uint8_t ep = 1; ep < numEndpoints; ep++) {
+		if ((getReg(ep, Consts::UESTA0X) & (1 << Consts::UESTA0X_CFGOK)) && epType(ep) == 0b10 && epIsIn(ep) == in) // bulk
+			return ep;
+	}
+	return 0xFF;
+}
+
+bool A32u4::USB::isRunning() const {
+	const uint8_t* data = mcu->dataspace.data;
+	return (data[Consts::USBCON] & (1 << Consts::USBCON_USBE)) &&
+		!(data[Consts::USBCON] & (1 << Consts::USBCON_FRZCLK)) &&
+		!(data[Consts::UDCON] & (1 << Consts::UDCON_DETACH));
+}
+void A32u4::USB::updateRunning() {
+	DataSpace::Events& events = mcu->dataspace.events;
+	const bool scheduled = events.at[DataSpace::Events::Event_USB_Frame] != DataSpace::Events::None;
+	if (isRunning() && !scheduled) { // got attached => the host starts with a bus reset
+		enumStep = EnumStep_Reset;
+		events.schedule(DataSpace::Events::Event_USB_Frame, mcu->cpu.getTotalCycles() + frameCycls);
+	}
+	else if (!isRunning() && scheduled) {
+		enumStep = EnumStep_Reset;
+		events.cancel(DataSpace::Events::Event_USB_Frame);
+	}
+}
+void A32u4::USB::onFrame() {
+	uint8_t* data = mcu->dataspace.data;
+
+	frameNum = (frameNum + 1) & 0x7FF;
+	data[Consts::UDFNUML] = (uint8_t)frameNum;
+	data[Consts::UDFNUMH] = (uint8_t)(frameNum >> 8);
+	data[Consts::UDINT] |= 1 << Consts::UDINT_SOFI;
+
+	switch (enumStep) {
+		case EnumStep_Reset:
+			data[Consts::UDINT] |= 1 << Consts::UDINT_EORSTI;
+			data[Consts::UDADDR] = 0;
+			enumStep++;
+			break;
+		case EnumStep_SetAddress:
+		case EnumStep_SetConfiguration:
+		case EnumStep_SetControlLineState:
+			// wait until the control endpoint is set up and done with the last request
+			if ((getReg(0, Consts::UESTA0X) & (1 << Consts::UESTA0X_CFGOK)) && !(getReg(0, Consts::UEINTX) & (1 << Consts::UEINTX_RXSTPI))) {
+				sendSetup(setupPackets[enumStep - EnumStep_SetAddress]);
+				enumStep++;
+			}
+			break;
+		default:
+			deliverOut();
+			break;
+	}
+
+	mcu->cpu.breakOutOfOptimisation();
+	mcu->dataspace.events.schedule(DataSpace::Events::Event_USB_Frame, mcu->cpu.getTotalCycles() + frameCycls);
+}
+void A32u4::USB::sendSetup(const uint8_t* packet) {
+	std::memcpy(eps[0].fifo, packet, 8);
+	eps[0].len = 8;
+	eps[0].pos = 0;
+	reg(0, Consts::UEBCLX) = 8;
+	reg(0, Consts::UEINTX) |= 1 << Consts::UEINTX_RXSTPI;
+}
+void A32u4::USB::sendIn(uint8_t ep) {
+	Endpoint& e = eps[ep];
+	if (e.len > 0 && ep == findCdcEp(true)) {
+		if (cdcCallB) {
+			cdcCallB(e.fifo, e.len, cdcCallBUserData);
+		}
+		else {
+			cdcDropped += e.len - cdcOutQueue.push(e.fifo, e.len);
+		}
+	}
+	// the host takes every packet right away, so the bank is free again
+	e.len = 0;
+	reg(ep, Consts::UEBCLX) = 0;
+	reg(ep, Consts::UEINTX) |= (1 << Consts::UEINTX_TXINI) | (1 << Consts::UEINTX_RWAL) | (ep != 0 ? (1 << Consts::UEINTX_FIFOCON) : 0);
+}
+void A32u4::USB::deliverOut() {
+	const uint8_t ep = findCdcEp(false);
+	if (ep == 0xFF)
+		return;
+
+	Endpoint& e = eps[ep];
+	uint8_t& ueintx = reg(ep, Consts::UEINTX);
+	if ((ueintx & (1 << Consts::UEINTX_RXOUTI)) || e.len > 0) // bank is still in use
+		return;
+
+	const size_t amt = cdcInQueue.pop(e.fifo, epSize(ep));
+	if (amt == 0)
+		return;
+
+	e.len = (uint16_t)amt;
+	e.pos = 0;
+	reg(ep, Consts::UEBCLX) = (uint8_t)amt;
+	ueintx |= (1 << Consts::UEINTX_RXOUTI) | (1 << Consts::UEINTX_FIFOCON) | (1 << Consts::UEINTX_RWAL);
+	mcu->cpu.breakOutOfOptimisation();
+}
+
+void A32u4::USB::update_Set(addrmcu_t addr, uint8_t val, uint8_t oldVal) {
+	uint8_t* data = mcu->dataspace.data;
+	switch (addr) {
+		case Consts::UENUM:
+			data[Consts::UENUM] = val & 0b111;
+			selectEndpoint(val & 0b111);
+			break;
+
+		case Consts::UEINTX:
+			setUEINTX(val, oldVal);
+			break;
+
+		case Consts::UECFG1X:
+			setUECFG1X(val);
+			break;
+
+		case Consts::UEDATX:
+			writeUEDATX(val);
+			break;
+
+		case Consts::UERST:
+			for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+				if (val & (1 << ep)) {
+					eps[ep].len = 0;
+					eps[ep].pos = 0;
+					reg(ep, Consts::UEBCLX) = 0;
+				}
+			}
+			break;
+
+		case Consts::UECONX: // RSTDT and STALLRQC are strobes
+			data[Consts::UECONX] = val & ~((1 << Consts::UECONX_RSTDT) | (1 << Consts::UECONX_STALLRQC));
+			break;
+
+		case Consts::UDINT:
+		case Consts::USBINT:
+			data[addr] = oldVal & val; // flags can only be cleared
+			break;
+
+		case Consts::USBCON:
+		case Consts::UDCON:
+			updateRunning();
+			break;
+
+		case Consts::UDIEN:
+		case Consts::UEIENX:
+			mcu->cpu.breakOutOfOptimisation(); // a pending flag might be able to trigger now
+			break;
+
+		case Consts::USBSTA:
+		case Consts::UESTA0X:
+		case Consts::UEBCLX:
+		case Consts::UEBCHX:
+		case Consts::UEINT:
+		case Consts::UDFNUML:
+		case Consts::UDFNUMH:
+			data[addr] = oldVal; // read only
+			break;
+	}
+}
+void A32u4::USB::setUEINTX(uint8_t val, uint8_t oldVal) {
+	uint8_t* data = mcu->dataspace.data;
+
+	const uint8_t res = oldVal & (val | (1 << Consts::UEINTX_RWAL)); // bits can only be cleared by software, RWAL is read only
+	data[Consts::UEINTX] = res;
+	const uint8_t cleared = oldVal & ~res;
+
+	Endpoint& e = eps[currEp];
+	if (epType(currEp) == 0) { // control
+		if (cleared & ((1 << Consts::UEINTX_RXSTPI) | (1 << Consts::UEINTX_RXOUTI))) { // received data was acknowledged
+			e.len = 0;
+			e.pos = 0;
+			data[Consts::UEBCLX] = 0;
+		}
+		if (cleared & (1 << Consts::UEINTX_TXINI))
+			sendIn(currEp);
+	}
+	else if (epIsIn(currEp)) {
+		if (cleared & (1 << Consts::UEINTX_FIFOCON))
+			sendIn(currEp);
+	}
+	else {
+		if (cleared & (1 << Consts::UEINTX_FIFOCON)) { // bank was released
+			e.len = 0;
+			e.pos = 0;
+			data[Consts::UEBCLX] = 0;
+			data[Consts::UEINTX] &= ~(1 << Consts::UEINTX_RWAL);
+			deliverOut();
+		}
+	}
+}
+void A32u4::USB::setUECFG1X(uint8_t val) {
+	uint8_t* data = mcu->dataspace.data;
+	Endpoint& e = eps[currEp];
+	e.len = 0;
+	e.pos = 0;
+	data[Consts::UEBCLX] = 0;
+	if (val & (1 << Consts::UECFG1X_ALLOC)) {
+		data[Consts::UESTA0X] |= 1 << Consts::UESTA0X_CFGOK;
+		if (epType(currEp) == 0) {
+			data[Consts::UEINTX] = 1 << Consts::UEINTX_TXINI;
+		}
+		else if (epIsIn(currEp)) {
+			data[Consts::UEINTX] = (1 << Consts::UEINTX_TXINI) | (1 << Consts::UEINTX_RWAL) | (1 << Consts::UEINTX_FIFOCON);
+		}
+		else {
+			data[Consts::UEINTX] = 0;
+		}
+	}
+	else {
+		data[Consts::UESTA0X] &= ~(1 << Consts::UESTA0X_CFGOK);
+	}
+}
+void A32u4::USB::writeUEDATX(uint8_t val) {
+	uint8_t* data = mcu->dataspace.data;
+	Endpoint& e = eps[currEp];
+	const uint16_t size = epSize(currEp);
+	if (e.len < size) {
+		e.fifo[e.len++] = val;
+		data[Consts::UEBCLX] = (uint8_t)e.len;
+	}
+	if (e.len >= size)
+		data[Consts::UEINTX] &= ~(1 << Consts::UEINTX_RWAL);
+}
+uint8_t A32u4::USB::readUEDATX() {
+	uint8_t* data = mcu->dataspace.data;
+	Endpoint& e = eps[currEp];
+	uint8_t val = 0;
+	if (e.pos < e.len) {
+		val = e.fifo[e.pos++];
+		data[Consts::UEBCLX] = (uint8_t)(e.len - e.pos);
+		if (e.pos == e.len)
+			data[Consts::UEINTX] &= ~(1 << Consts::UEINTX_RWAL);
+	}
+	data[Consts::UEDATX] = val;
+	return val;
+}
+uint8_t A32u4::USB::getUEINT() const {
+	uint8_t res = 0;
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		if (getReg(ep, Consts::UEINTX) & getReg(ep, Consts::UEIENX) & 0b01011111) // the enable bits are at the positions of their flags
+			res |= 1 << ep;
+	}
+	return res;
+}
+
+bool A32u4::USB::genIntrPending() const {
+	const uint8_t* data = mcu->dataspace.data;
+	return (data[Consts::UDINT] & data[Consts::UDIEN] & 0b01111101) ||
+		((data[Consts::USBINT] & (1 << Consts::USBINT_VBUSTI)) && (data[Consts::USBCON] & (1 << Consts::USBCON_VBUSTE)));
+}
+bool A32u4::USB::comIntrPending() const {
+	return getUEINT() != 0;
+}
+
+void A32u4::USB::setCDCSpanCallB(CDCSpanCallB callB, void* userData) {
+	cdcCallB = callB;
+	cdcCallBUserData = userData;
+}
+size_t A32u4::USB::cdcRead(uint8_t* out, size_t maxLen) {
+	return cdcOutQueue.pop(out, maxLen);
+}
+size_t A32u4::USB::cdcWrite(const uint8_t* buf, size_t len) {
+	return cdcInQueue.push(buf, len);
+}
+void A32u4::USB::setCDCQueueSize(size_t size) {
+	cdcOutQueue.resize(size);
+	cdcInQueue.resize(size);
+}
+uint64_t A32u4::USB::getCDCDropped() const {
+	return cdcDropped;
+}
+
+bool A32u4::USB::isAttached() const {
+	return isRunning();
+}
+bool A32u4::USB::isConfigured() const {
+	return enumStep == EnumStep_Configured;
+}
+
+void A32u4::USB::getState(std::ostream& output){
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		for (uint8_t i = 0; i < numBankedRegs; i++) {
+			StreamUtils::write(output, getReg(ep, bankedRegs[i]));
+		}
+		output.write((const char*)eps[ep].fifo, fifoSize);
+		StreamUtils::write(output, eps[ep].len);
+		StreamUtils::write(output, eps[ep].pos);
+	}
+	StreamUtils::write(output, currEp);
+	StreamUtils::write(output, enumStep);
+	StreamUtils::write(output, frameNum);
+#if MCU_WRITE_HASH
+	StreamUtils::write(output, hash());
+#endif
+}
+void A32u4::USB::setState(std::istream& input){
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		for (uint8_t i = 0; i < numBankedRegs; i++) {
+			StreamUtils::read(input, &eps[ep].regs[i]);
+		}
+		input.read((char*)eps[ep].fifo, fifoSize);
+		StreamUtils::read(input, &eps[ep].len);
+		StreamUtils::read(input, &eps[ep].pos);
+	}
+	StreamUtils::read(input, &currEp);
+	StreamUtils::read(input, &enumStep);
+	StreamUtils::read(input, &frameNum);
+	A32U4_CHECK_HASH("USB");
+}
+
+size_t A32u4::USB::getStateBufSize() {
+	return numEndpoints * (numBankedRegs + fifoSize + sizeof(Endpoint::len) + sizeof(Endpoint::pos)) + sizeof(currEp) + sizeof(enumStep) + sizeof(frameNum);
+}
+void A32u4::USB::getState(StateWriter& output) const {
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		for (uint8_t i = 0; i < numBankedRegs; i++) {
+			output.write(getReg(ep, bankedRegs[i]));
+		}
+		output.write(eps[ep].fifo, fifoSize);
+		output.write(eps[ep].len);
+		output.write(eps[ep].pos);
+	}
+	output.write(currEp);
+	output.write(enumStep);
+	output.write(frameNum);
+}
+void A32u4::USB::setState(StateReader& input) {
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		input.read(eps[ep].regs, numBankedRegs);
+		input.read(eps[ep].fifo, fifoSize);
+		input.read(&eps[ep].len);
+		input.read(&eps[ep].pos);
+	}
+	input.read(&currEp);
+	input.read(&enumStep);
+	input.read(&frameNum);
+}
+
+bool A32u4::USB::operator==(const USB& other) const{
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		for (uint8_t i = 0; i < numBankedRegs; i++) {
+			if (getReg(ep, bankedRegs[i]) != other.getReg(ep, bankedRegs[i]))
+				return false;
+		}
+		if (std::memcmp(eps[ep].fifo, other.eps[ep].fifo, fifoSize) != 0 || eps[ep].len != other.eps[ep].len || eps[ep].pos != other.eps[ep].pos)
+			return false;
+	}
+	return currEp == other.currEp && enumStep == other.enumStep && frameNum == other.frameNum;
+}
+size_t A32u4::USB::sizeBytes() const {
+	size_t sum = 0;
+	sum += sizeof(mcu);
+	sum += sizeof(eps);
+	sum += sizeof(currEp);
+	sum += sizeof(enumStep);
+	sum += sizeof(frameNum);
+	sum += sizeof(cdcCallB);
+	sum += sizeof(cdcCallBUserData);
+	sum += sizeof(cdcOutQueue) + cdcOutQueue.capacity();
+	sum += sizeof(cdcInQueue) + cdcInQueue.capacity();
+	sum += sizeof(cdcDropped);
+	return sum;
+}
+uint32_t A32u4::USB::hash() const noexcept{
+	uint32_t h = 0;
+	for (uint8_t ep = 0; ep < numEndpoints; ep++) {
+		for (uint8_t i = 0; i < numBankedRegs; i++) {
+			const uint8_t val = getReg(ep, bankedRegs[i]);
+			DU_HASHC(h, val);
+		}
+		DU_HASHCB(h, eps[ep].fifo, fifoSize);
+		DU_HASHC(h, eps[ep].len);
+		DU_HASHC(h, eps[ep].pos);
+	}
+	DU_HASHC(h, currEp);
+	DU_HASHC(h, enumStep);
+	DU_HASHC(h, frameNum);
+	return h;
+}
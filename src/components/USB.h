@@ -0,0 +1,130 @@
+#ifndef __A32U4_USB_H__
+#define __A32U4_USB_H__
+
+#include <stdint.h>
+#include <iostream>
+
+#include "../config.h"
+#include "../A32u4Types.h"
+#include "../utils/SPSCRing.h"
+
+#include "CPU.h" // for CPU::ClockFreq
+
+namespace A32u4 {
+	class ATmega32u4;
+	struct StateWriter;
+	struct StateReader;
+
+	// minimal USB device controller
+	// the emulated host only sends the requests needed to get a CDC-ACM device configured (no descriptors are read)
+	// and then exchanges data with the first bulk IN and bulk OUT endpoint
+	class USB {
+	public:
+		static constexpr uint8_t numEndpoints = 7;
+		static constexpr uint16_t fifoSize = 256;
+		static constexpr uint64_t frameCycls = CPU::ClockFreq / 1000; // full speed frames are 1ms long
+
+		enum {
+			EnumStep_Reset = 0,
+			EnumStep_SetAddress,
+			EnumStep_SetConfiguration,
+			EnumStep_SetControlLineState,
+			EnumStep_Configured
+		};
+
+		typedef void (*CDCSpanCallB)(const uint8_t* data, size_t len, void* userData);
+	private:
+		friend class ATmega32u4;
+		friend class DataSpace;
+
+		ATmega32u4* mcu;
+
+		// registers that exist once per endpoint, the ones of the selected endpoint (UENUM) live in the data space
+		static constexpr addrmcu_t bankedRegs[] = {0xE8, 0xEB, 0xEC, 0xED, 0xEE, 0xEF, 0xF0, 0xF2, 0xF3}; // UEINTX, UECONX, UECFG0X, UECFG1X, UESTA0X, UESTA1X, UEIENX, UEBCLX, UEBCHX
+		static constexpr uint8_t numBankedRegs = sizeof(bankedRegs) / sizeof(bankedRegs[0]);
+
+		struct Endpoint {
+			uint8_t regs[numBankedRegs];
+			uint8_t fifo[fifoSize];
+			uint16_t len; // bytes in the fifo
+			uint16_t pos; // read position for OUT data
+		} eps[numEndpoints];
+		uint8_t currEp = 0;
+
+		uint8_t enumStep = EnumStep_Reset;
+		uint16_t frameNum = 0;
+
+		CDCSpanCallB cdcCallB = nullptr;
+		void* cdcCallBUserData = nullptr;
+		SPSCRing<uint8_t> cdcOutQueue; // device => host, only used if there is no callback
+		SPSCRing<uint8_t> cdcInQueue;  // host => device
+		uint64_t cdcDropped = 0;
+
+		USB(ATmega32u4* mcu);
+
+		USB(const USB& src);
+		USB& operator=(const USB& src);
+
+		void reset();
+
+		static uint8_t bankInd(addrmcu_t addr);
+		uint8_t& reg(uint8_t ep, addrmcu_t addr);
+		uint8_t getReg(uint8_t ep, addrmcu_t addr) const;
+		void selectEndpoint(uint8_t ep);
+
+		uint16_t epSize(uint8_t ep) const;
+		bool epIsIn(uint8_t ep) const;
+		uint8_t epType(uint8_t ep) const;
+		uint8_t findCdcEp(bool in) const;
+
+		bool isRunning() const;
+		void updateRunning();
+		void onFrame();
+		void sendSetup(const uint8_t* packet);
+		void sendIn(uint8_t ep);
+		void deliverOut();
+
+		void update_Set(addrmcu_t addr, uint8_t val, uint8_t oldVal);
+		void setUEINTX(uint8_t val, uint8_t oldVal);
+		void setUECFG1X(uint8_t val);
+		void writeUEDATX(uint8_t val);
+		uint8_t readUEDATX();
+		uint8_t getUEINT() const;
+
+		bool genIntrPending() const;
+		bool comIntrPending() const;
+	public:
+		void setCDCSpanCallB(CDCSpanCallB callB, void* userData); // data points directly into the endpoint fifo
+		size_t cdcRead(uint8_t* out, size_t maxLen); // only receives data if there is no span callback
+		size_t cdcWrite(const uint8_t* buf, size_t len); // delivered to the device on the next frames, returns the amount that fit into the queue
+		void setCDCQueueSize(size_t size);
+		uint64_t getCDCDropped() const;
+
+		bool isAttached() const;
+		bool isConfigured() const;
+
+		void getState(std::ostream& output);
+		void setState(std::istream& input);
+		// fixed layout without hashes, for ATmega32u4::saveState
+		static size_t getStateBufSize();
+		void getState(StateWriter& output) const;
+		void setState(StateReader& input);
+
+		bool operator==(const USB& other) const;
+		size_t sizeBytes() const;
+		uint32_t hash() const noexcept;
+	};
+}
+namespace DataUtils {
+	inline size_t approxSizeOf(const A32u4::USB& v) {
+		return v.sizeBytes();
+	}
+}
+template<>
+struct std::hash<A32u4::USB>{
+	inline std::size_t operator()(const A32u4::USB& v) const noexcept{
+		return (size_t)v.hash();
+	}
+};
+
+#endif
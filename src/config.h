@@ -5,6 +5,8 @@
 
 #define MCU_USE_HEAP 1
 
+#define MCU_SPI_BUF_SIZE 256 // amount of SPI transfers that are collected before being handed to the span callback
+
 #define MCU_USE_INST_EXEC_ALG 2
 
 #define MCU_INCLUDE_EXTRAS 1
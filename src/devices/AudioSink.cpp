@@ -0,0 +1,95 @@
+#include "AudioSink.h"
+
+#include "../components/CPU.h"
+
+// renders further apart than this are a jump in time (attached mid run, a state was loaded), not a long stretch of silence
+static constexpr uint64_t maxRenderGap = A32u4::CPU::ClockFreq / 10;
+
+A32u4::AudioSink::AudioSink(uint32_t sampleRate, size_t ringCapacity) : sampleRate(sampleRate), ring(ringCapacity) {
+	edges.reserve(1024);
+	renderBuf.reserve(sampleRate / 30 + 1);
+}
+
+void A32u4::AudioSink::setSampleRate(uint32_t sampleRate_) {
+	sampleRate = sampleRate_;
+	ring.resize(ring.capacity());
+	edges.clear();
+	renderBuf.clear();
+	synced = false;
+}
+void A32u4::AudioSink::setAmplitude(int16_t amplitude_) {
+	amplitude = amplitude_;
+}
+uint32_t A32u4::AudioSink::getSampleRate() const {
+	return sampleRate;
+}
+
+int8_t A32u4::AudioSink::speakerLevel(uint8_t portc) {
+	return (int8_t)((portc >> PIN_SPEAKER1) & 1) - (int8_t)((portc >> PIN_SPEAKER2) & 1);
+}
+void A32u4::AudioSink::attach(uint64_t cycle, uint8_t portc) {
+	// edges were not recorded while detached
+	edges.clear();
+	edgeLevel = speakerLevel(portc);
+	level = edgeLevel;
+	resync(cycle);
+}
+void A32u4::AudioSink::pinEdge(uint64_t cycle, uint8_t portc) {
+	const int8_t newLevel = speakerLevel(portc);
+	if (newLevel != edgeLevel) {
+		edges.push_back({ cycle, newLevel });
+		edgeLevel = newLevel;
+	}
+}
+
+void A32u4::AudioSink::render(uint64_t cycle) {
+	const uint64_t start = edges.empty() ? cycle : edges[0].cycle;
+	if (!synced || start * sampleRate < lastT || start - lastT / sampleRate > maxRenderGap)
+		resync(start);
+
+	for (size_t i = 0; i < edges.size(); i++) {
+		integrate(edges[i].cycle);
+		level = edges[i].level;
+	}
+	edges.clear();
+	integrate(cycle);
+
+	if (renderBuf.size() > 0) {
+		droppedSamples += renderBuf.size() - ring.push(&renderBuf[0], renderBuf.size());
+		renderBuf.clear();
+	}
+}
+void A32u4::AudioSink::resync(uint64_t cycle) {
+	lastT = cycle * sampleRate;
+	nextBoundary = lastT + CPU::ClockFreq;
+	acc = 0;
+	synced = true;
+}
+void A32u4::AudioSink::integrate(uint64_t cycle) {
+	// every sample is the average level over its time span (box filter), which band limits the square wave before decimating
+	const uint64_t t = cycle * sampleRate;
+	if (t < lastT) { // time went backwards (reset), just start over
+		resync(cycle);
+		return;
+	}
+
+	while (t >= nextBoundary) {
+		acc += (int64_t)level * (int64_t)(nextBoundary - lastT);
+		renderBuf.push_back((int16_t)(acc * amplitude / (int64_t)CPU::ClockFreq));
+		acc = 0;
+		lastT = nextBoundary;
+		nextBoundary += CPU::ClockFreq;
+	}
+	acc += (int64_t)level * (int64_t)(t - lastT);
+	lastT = t;
+}
+
+size_t A32u4::AudioSink::readSamples(int16_t* out, size_t maxLen) {
+	return ring.pop(out, maxLen);
+}
+size_t A32u4::AudioSink::samplesAvailable() const {
+	return ring.size();
+}
+uint64_t A32u4::AudioSink::getDroppedSamples() const {
+	return droppedSamples;
+}
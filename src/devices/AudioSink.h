@@ -0,0 +1,62 @@
+#ifndef __A32U4_AUDIOSINK_H__
+#define __A32U4_AUDIOSINK_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "../config.h"
+#include "../utils/SPSCRing.h"
+
+namespace A32u4 {
+	// turns speaker pin edges into PCM samples, which are handed to the audio thread through a lock free ring
+	class AudioSink {
+	public:
+		// speaker is connected between these pins on PORTC (Arduboy wiring)
+		static constexpr uint8_t PIN_SPEAKER1 = 6, PIN_SPEAKER2 = 7;
+
+		struct Edge {
+			uint64_t cycle;
+			int8_t level;
+		};
+	private:
+		friend class DataSpace;
+
+		uint32_t sampleRate;
+		int16_t amplitude = 8000;
+
+		std::vector<Edge> edges; // edges since the last render
+		int8_t edgeLevel = 0; // level after the last recorded edge
+
+		// rendering state, time is measured in cycles*sampleRate so sample boundaries are whole numbers
+		int8_t level = 0;
+		bool synced = false; // lastT is meaningless until the first render after construction or setSampleRate
+		uint64_t lastT = 0;
+		uint64_t nextBoundary = 0;
+		int64_t acc = 0;
+		std::vector<int16_t> renderBuf;
+
+		SPSCRing<int16_t> ring;
+		uint64_t droppedSamples = 0;
+
+		static int8_t speakerLevel(uint8_t portc);
+		void attach(uint64_t cycle, uint8_t portc);
+		void pinEdge(uint64_t cycle, uint8_t portc);
+		void render(uint64_t cycle);
+		void resync(uint64_t cycle); // continues rendering from cycle, without samples for the time in between
+		void integrate(uint64_t cycle);
+	public:
+		AudioSink(uint32_t sampleRate = 44100, size_t ringCapacity = 8192);
+
+		void setSampleRate(uint32_t sampleRate); // not thread safe, discards buffered samples
+		void setAmplitude(int16_t amplitude);
+		uint32_t getSampleRate() const;
+
+		// consumer side, may be called from the audio thread
+		size_t readSamples(int16_t* out, size_t maxLen);
+		size_t samplesAvailable() const;
+
+		uint64_t getDroppedSamples() const; // samples that didnt fit into the ring
+	};
+}
+
+#endif
@@ -0,0 +1,349 @@
+#include "SPIFlash.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include "StreamUtils.h"
+#include "DataUtils.h"
+
+#include "../ATmega32u4.h"
+
+#define LU_MODULE "SPIFlash"
+
+constexpr uint8_t A32u4::SPIFlash::jedecId[3];
+
+A32u4::SPIFlash::SPIFlash() {
+	std::memset(programBuf, 0xFF, pageSize);
+}
+
+bool A32u4::SPIFlash::loadImage(const char* path, bool alignEnd) {
+	clear();
+
+	if (!file.open(path, MappedFile::Mode_CopyOnWrite))
+		return false;
+	if (file.size() > capacity) { // only map what fits
+		if (!file.open(path, MappedFile::Mode_CopyOnWrite, capacity))
+			return false;
+	}
+
+	image = file.data();
+	imageSize = (uint32_t)file.size();
+	imageOffset = alignEnd ? capacity - imageSize : 0;
+	return true;
+}
+void A32u4::SPIFlash::loadImageFromMemory(const uint8_t* data, size_t len, bool alignEnd) {
+	clear();
+
+	len = std::min(len, (size_t)capacity);
+	owned.assign(data, data + len);
+
+	image = owned.data();
+	imageSize = (uint32_t)len;
+	imageOffset = alignEnd ? capacity - imageSize : 0;
+}
+void A32u4::SPIFlash::clear() {
+	file.close();
+	owned.clear();
+	owned.shrink_to_fit();
+	image = nullptr;
+	imageOffset = 0;
+	imageSize = 0;
+	readPtr = readEnd = nullptr;
+	if (state == State_Read)
+		state = State_Done;
+}
+
+void A32u4::SPIFlash::reset() {
+	selected = false;
+	state = State_Cmd;
+	cmd = 0;
+	argsLeft = 0;
+	progPos = 0;
+	addr = 0;
+	writeEnabled = false;
+	busyUntil = 0;
+	readPtr = readEnd = nullptr;
+	std::memset(programBuf, 0xFF, pageSize);
+}
+
+void A32u4::SPIFlash::setCSPin(uint8_t port, uint8_t bit) {
+	csPort = port;
+	csMask = 1 << bit;
+}
+
+void A32u4::SPIFlash::portChange(uint8_t oldVal, uint8_t val, uint64_t cycle) {
+	if ((oldVal & csMask) && !(val & csMask)) {
+		select();
+	}
+	else if (!(oldVal & csMask) && (val & csMask)) {
+		deselect(cycle);
+	}
+}
+void A32u4::SPIFlash::select() {
+	selected = true;
+	state = State_Cmd;
+	readPtr = readEnd = nullptr;
+}
+void A32u4::SPIFlash::deselect(uint64_t cycle) {
+	// program and erase commands are executed once chip select goes high (if their address was complete)
+	if (selected && writeEnabled) {
+		switch (cmd) {
+			case Cmd_PageProgram:
+				if (state == State_Program) {
+					program(addr);
+					busyUntil = cycle + pageProgramCycles;
+					writeEnabled = false;
+				}
+				break;
+			case Cmd_SectorErase:
+			case Cmd_BlockErase:
+				if (state == State_Done) {
+					const uint32_t size = cmd == Cmd_SectorErase ? sectorSize : blockSize;
+					erase(addr & ~(size - 1), size);
+					busyUntil = cycle + (cmd == Cmd_SectorErase ? sectorEraseCycles : blockEraseCycles);
+					writeEnabled = false;
+				}
+				break;
+		}
+	}
+
+	selected = false;
+	state = State_Cmd;
+	cmd = 0;
+	readPtr = readEnd = nullptr;
+}
+
+uint8_t A32u4::SPIFlash::transfer(uint8_t mosi, uint64_t cycle) {
+	if (!selected) // chip select was already low when we were attached
+		select();
+
+	switch (state) {
+		case State_Read:
+			return readNext();
+
+		case State_Cmd:
+			cmd = mosi;
+			argsLeft = 0;
+			if (isBusy(cycle) && cmd != Cmd_ReadStatus) { // only the status can be read while busy
+				cmd = 0;
+				state = State_Done;
+				return 0xFF;
+			}
+			switch (cmd) {
+				case Cmd_Read: case Cmd_FastRead: case Cmd_PageProgram: case Cmd_SectorErase: case Cmd_BlockErase:
+					state = State_Addr;
+					argsLeft = 3;
+					addr = 0;
+					break;
+				case Cmd_JedecId:
+					state = State_JedecId;
+					argsLeft = sizeof(jedecId);
+					break;
+				case Cmd_ReadStatus:
+					state = State_Status;
+					break;
+				case Cmd_WriteEnable:
+					writeEnabled = true;
+					state = State_Done;
+					break;
+				case Cmd_WriteDisable:
+					writeEnabled = false;
+					state = State_Done;
+					break;
+				default: // power down/release and unsupported commands
+					state = State_Done;
+					break;
+			}
+			return 0xFF;
+
+		case State_Addr:
+			addr = ((addr << 8) | mosi) & (capacity - 1);
+			if (--argsLeft == 0) {
+				switch (cmd) {
+					case Cmd_Read:
+						startRead();
+						break;
+					case Cmd_FastRead:
+						state = State_Dummy;
+						break;
+					case Cmd_PageProgram:
+						state = State_Program;
+						progPos = (uint8_t)addr;
+						std::memset(programBuf, 0xFF, pageSize);
+						break;
+					default: // erase commands just wait for chip select to go high
+						state = State_Done;
+						break;
+				}
+			}
+			return 0xFF;
+
+		case State_Dummy:
+			startRead();
+			return 0xFF;
+
+		case State_Program:
+			programBuf[progPos++] = mosi;
+			return 0xFF;
+
+		case State_JedecId:
+			if (argsLeft == 0)
+				return 0xFF;
+			return jedecId[sizeof(jedecId) - (argsLeft--)];
+
+		case State_Status:
+			return (isBusy(cycle) << Status_BUSY) | (writeEnabled << Status_WEL);
+
+		default:
+			return 0xFF;
+	}
+}
+
+uint32_t A32u4::SPIFlash::getAddr() const {
+	if (readPtr)
+		return (imageOffset + (uint32_t)(readPtr - image)) & (capacity - 1);
+	return addr;
+}
+bool A32u4::SPIFlash::inImage(uint32_t address) const {
+	return address - imageOffset < imageSize; // also catches addresses below the offset by wrapping
+}
+void A32u4::SPIFlash::startRead() {
+	state = State_Read;
+	if (inImage(addr)) {
+		readPtr = image + (addr - imageOffset);
+		readEnd = image + imageSize;
+	}
+	else {
+		readPtr = readEnd = nullptr;
+	}
+}
+uint8_t A32u4::SPIFlash::readNext() {
+	if (readPtr != readEnd)
+		return *readPtr++;
+
+	if (readPtr) { // ran off the end of the image
+		addr = (imageOffset + imageSize) & (capacity - 1);
+		readPtr = readEnd = nullptr;
+		if (inImage(addr)) { // the image covers the whole flash and we wrapped around
+			startRead();
+			return *readPtr++;
+		}
+	}
+
+	// everything outside of the image is erased
+	addr = (addr + 1) & (capacity - 1);
+	if (inImage(addr))
+		startRead();
+	return 0xFF;
+}
+
+uint8_t* A32u4::SPIFlash::getWritable(uint32_t address, uint32_t len) {
+	if (!inImage(address) || !inImage(address + len - 1)) {
+		// give up sharing the mapped image and switch to a private copy of the whole flash
+		std::vector<uint8_t> full(capacity, 0xFF);
+		if (imageSize > 0)
+			std::memcpy(full.data() + imageOffset, image, imageSize);
+		file.close();
+		owned.swap(full);
+		image = owned.data();
+		imageOffset = 0;
+		imageSize = capacity;
+	}
+	return image + (address - imageOffset);
+}
+void A32u4::SPIFlash::erase(uint32_t address, uint32_t len) {
+	std::memset(getWritable(address, len), 0xFF, len);
+}
+void A32u4::SPIFlash::program(uint32_t address) {
+	// programming can only clear bits, untouched bytes of the buffer are 0xFF
+	const uint32_t pageAddr = address & ~(pageSize - 1);
+	uint8_t* dst = getWritable(pageAddr, pageSize);
+	for (uint32_t i = 0; i < pageSize; i++) {
+		dst[i] &= programBuf[i];
+	}
+}
+
+uint8_t A32u4::SPIFlash::readByte(uint32_t address) const {
+	address &= capacity - 1;
+	return inImage(address) ? image[address - imageOffset] : 0xFF;
+}
+void A32u4::SPIFlash::read(uint32_t address, uint8_t* out, size_t len) const {
+	while (len > 0) {
+		address &= capacity - 1;
+		size_t amt;
+		if (inImage(address)) {
+			amt = std::min(len, (size_t)(imageSize - (address - imageOffset)));
+			std::memcpy(out, image + (address - imageOffset), amt);
+		}
+		else {
+			// erased until the start of the image or the end of the flash
+			const uint32_t until = address < imageOffset ? imageOffset : capacity;
+			amt = std::min(len, (size_t)(until - address));
+			std::memset(out, 0xFF, amt);
+		}
+		out += amt;
+		address += (uint32_t)amt;
+		len -= amt;
+	}
+}
+bool A32u4::SPIFlash::isBusy(uint64_t cycle) const {
+	return cycle < busyUntil;
+}
+
+void A32u4::SPIFlash::getState(std::ostream& output){
+	StreamUtils::write(output, selected);
+	StreamUtils::write(output, state);
+	StreamUtils::write(output, cmd);
+	StreamUtils::write(output, argsLeft);
+	StreamUtils::write(output, progPos);
+	StreamUtils::write(output, getAddr());
+	StreamUtils::write(output, writeEnabled);
+	StreamUtils::write(output, busyUntil);
+	output.write((const char*)programBuf, pageSize);
+#if MCU_WRITE_HASH
+	StreamUtils::write(output, hash());
+#endif
+}
+void A32u4::SPIFlash::setState(std::istream& input){
+	StreamUtils::read(input, &selected);
+	StreamUtils::read(input, &state);
+	StreamUtils::read(input, &cmd);
+	StreamUtils::read(input, &argsLeft);
+	StreamUtils::read(input, &progPos);
+	StreamUtils::read(input, &addr);
+	StreamUtils::read(input, &writeEnabled);
+	StreamUtils::read(input, &busyUntil);
+	input.read((char*)programBuf, pageSize);
+
+	readPtr = readEnd = nullptr;
+	if (state == State_Read) // the read pointers are not saved, recalculate them from the address
+		startRead();
+	A32U4_CHECK_HASH_("SPIFlash");
+}
+
+bool A32u4::SPIFlash::operator==(const SPIFlash& other) const{
+#define _CMP_(x) (x==other.x)
+	return _CMP_(selected) && _CMP_(state) && _CMP_(cmd) && _CMP_(argsLeft) && _CMP_(progPos) && getAddr() == other.getAddr() &&
+		_CMP_(writeEnabled) && _CMP_(busyUntil) &&
+		std::memcmp(programBuf, other.programBuf, pageSize) == 0;
+#undef _CMP_
+}
+size_t A32u4::SPIFlash::sizeBytes() const {
+	return sizeof(SPIFlash) + owned.capacity();
+}
+uint32_t A32u4::SPIFlash::hash() const noexcept{
+	uint32_t h = 0;
+	DU_HASHC(h, selected);
+	DU_HASHC(h, state);
+	DU_HASHC(h, cmd);
+	DU_HASHC(h, argsLeft);
+	DU_HASHC(h, progPos);
+	{
+		const uint32_t currAddr = getAddr();
+		DU_HASHC(h, currAddr);
+	}
+	DU_HASHC(h, writeEnabled);
+	DU_HASHC(h, busyUntil);
+	DU_HASHCB(h, programBuf, pageSize);
+	return h;
+}
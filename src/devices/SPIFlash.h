@@ -0,0 +1,137 @@
+#ifndef __A32U4_SPIFLASH_H__
+#define __A32U4_SPIFLASH_H__
+
+#include <stdint.h>
+#include <iostream>
+#include <vector>
+
+#include "../config.h"
+#include "../A32u4Types.h"
+#include "../utils/MappedFile.h"
+
+#include "../components/CPU.h" // for CPU::ClockFreq
+
+namespace A32u4 {
+	// W25Q128 style SPI NOR flash (16MiB) as used by Arduboy FX carts, fed directly by DataSpace when attached
+	// the image is mapped copy on write, so instances loading the same file share its pages until they program/erase them
+	class SPIFlash {
+	public:
+		static constexpr uint32_t capacity = 16 * 1024 * 1024;
+		static constexpr uint32_t pageSize = 256;
+		static constexpr uint32_t sectorSize = 4 * 1024;
+		static constexpr uint32_t blockSize = 64 * 1024;
+
+		static constexpr uint8_t jedecId[3] = { 0xEF, 0x40, 0x18 }; // Winbond, W25Q, 128MBit
+
+		// busy times (typical values of the W25Q128)
+		static constexpr uint64_t pageProgramCycles = (CPU::ClockFreq / 10000) * 7; // 0.7ms
+		static constexpr uint64_t sectorEraseCycles = (CPU::ClockFreq / 1000) * 45;
+		static constexpr uint64_t blockEraseCycles = (CPU::ClockFreq / 1000) * 150;
+
+		// default chip select is PD1 (Arduboy FX wiring), the port is given as ATmega32u4::PinChange_PORTx
+		static constexpr uint8_t PORT_CS = 2, PIN_CS = 1;
+
+		enum {
+			Cmd_PageProgram = 0x02,
+			Cmd_Read = 0x03,
+			Cmd_WriteDisable = 0x04,
+			Cmd_ReadStatus = 0x05,
+			Cmd_WriteEnable = 0x06,
+			Cmd_FastRead = 0x0B,
+			Cmd_SectorErase = 0x20,
+			Cmd_JedecId = 0x9F,
+			Cmd_BlockErase = 0xD8
+		};
+		enum {
+			State_Cmd = 0,
+			State_Addr,
+			State_Dummy,
+			State_Read,
+			State_Program,
+			State_JedecId,
+			State_Status,
+			State_Done // ignore everything until chip select goes high
+		};
+		enum {
+			Status_BUSY = 0,
+			Status_WEL = 1
+		};
+	private:
+		friend class DataSpace;
+
+		MappedFile file;
+		std::vector<uint8_t> owned; // used for images loaded from memory and once something outside of the mapped image is written
+		uint8_t* image = nullptr;
+		uint32_t imageOffset = 0; // flash address of the first byte of the image
+		uint32_t imageSize = 0;
+
+		uint8_t csPort = PORT_CS;
+		uint8_t csMask = 1 << PIN_CS;
+
+		bool selected = false;
+		uint8_t state = State_Cmd;
+		uint8_t cmd = 0;
+		uint8_t argsLeft = 0; // address/id bytes left
+		uint8_t progPos = 0; // offset into the page for page program, wraps around like the chip does
+		uint32_t addr = 0;
+		bool writeEnabled = false;
+		uint64_t busyUntil = 0;
+
+		// continuous reads are served straight from the image
+		const uint8_t* readPtr = nullptr;
+		const uint8_t* readEnd = nullptr;
+
+		uint8_t programBuf[pageSize];
+
+		uint8_t transfer(uint8_t mosi, uint64_t cycle);
+		void select();
+		void deselect(uint64_t cycle);
+		void portChange(uint8_t oldVal, uint8_t val, uint64_t cycle);
+
+		uint32_t getAddr() const; // current address, also while serving a read from the image
+		bool inImage(uint32_t address) const;
+		void startRead();
+		uint8_t readNext();
+		uint8_t* getWritable(uint32_t address, uint32_t len);
+		void erase(uint32_t address, uint32_t len);
+		void program(uint32_t address);
+	public:
+		SPIFlash();
+
+		// alignEnd places the image at the end of the flash (like the data of a single game in development), otherwise it starts at 0
+		// the content (including what the firmware programmed or erased) is not part of getState/setState,
+		// so loading an earlier state does not roll back writes to the flash, save it with read() and restore it with loadImageFromMemory if needed
+		bool loadImage(const char* path, bool alignEnd = false);
+		void loadImageFromMemory(const uint8_t* data, size_t len, bool alignEnd = false);
+		void clear(); // fully erased flash
+
+		void reset();
+
+		void setCSPin(uint8_t port, uint8_t bit);
+
+		uint8_t readByte(uint32_t address) const;
+		void read(uint32_t address, uint8_t* out, size_t len) const;
+		bool isBusy(uint64_t cycle) const;
+
+		// only contains the protocol state, not the flash content
+		void getState(std::ostream& output);
+		void setState(std::istream& input);
+
+		bool operator==(const SPIFlash& other) const;
+		size_t sizeBytes() const;
+		uint32_t hash() const noexcept;
+	};
+}
+namespace DataUtils {
+	inline size_t approxSizeOf(const A32u4::SPIFlash& v) {
+		return v.sizeBytes();
+	}
+}
+template<>
+struct std::hash<A32u4::SPIFlash>{
+	inline std::size_t operator()(const A32u4::SPIFlash& v) const noexcept{
+		return (size_t)v.hash();
+	}
+};
+
+#endif
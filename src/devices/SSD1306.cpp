@@ -0,0 +1,316 @@
+#include "SSD1306.h"
+
+#include <cstring>
+
+#include "StreamUtils.h"
+#include "DataUtils.h"
+
+#include "../ATmega32u4.h"
+
+#define LU_MODULE "SSD1306"
+
+A32u4::SSD1306::SSD1306() {
+	std::memset(framebuffer, 0, framebufferSize);
+}
+
+void A32u4::SSD1306::reset() {
+	// the GDDRAM content is not affected by a reset
+	cmdLen = 0;
+	cmdArgsLeft = 0;
+
+	addrMode = AddrMode_Page;
+	colStart = 0;
+	colEnd = width - 1;
+	pageStart = 0;
+	pageEnd = pages - 1;
+	pageColStart = 0;
+	col = 0;
+	page = 0;
+
+	contrast = 0x7F;
+	startLine = 0;
+	displayOffset = 0;
+	muxRatio = height - 1;
+	displayOn = false;
+	inverted = false;
+	entireOn = false;
+	segRemap = false;
+	comScanDec = false;
+	chargePump = false;
+}
+
+void A32u4::SSD1306::setPins(uint8_t cs, uint8_t dc, uint8_t rst) {
+	csMask = 1 << cs;
+	dcMask = 1 << dc;
+	rstMask = 1 << rst;
+}
+
+void A32u4::SSD1306::write(uint8_t byte, bool isData) {
+	if (isData) {
+		writeData(byte);
+	}
+	else {
+		writeCommand(byte);
+	}
+}
+void A32u4::SSD1306::writeData(uint8_t byte) {
+	framebuffer[page * width + col] = byte;
+	dirtyPages |= 1 << page;
+	advance();
+}
+void A32u4::SSD1306::advance() {
+	switch (addrMode) {
+		case AddrMode_Horizontal:
+			if (++col > colEnd) {
+				col = colStart;
+				if (++page > pageEnd) {
+					page = pageStart;
+					frameCount++;
+				}
+			}
+			break;
+		case AddrMode_Vertical:
+			if (++page > pageEnd) {
+				page = pageStart;
+				if (++col > colEnd) {
+					col = colStart;
+					frameCount++;
+				}
+			}
+			break;
+		default: // page addressing
+			if (++col >= width) {
+				col = pageColStart;
+				if (page == pages - 1)
+					frameCount++;
+			}
+			break;
+	}
+}
+
+void A32u4::SSD1306::writeCommand(uint8_t byte) {
+	if (cmdArgsLeft > 0) {
+		cmdBuf[cmdLen++] = byte;
+		if (--cmdArgsLeft == 0)
+			executeCommand();
+		return;
+	}
+
+	cmdBuf[0] = byte;
+	cmdLen = 1;
+	switch (byte) {
+		case 0x20: case 0x81: case 0x8D: case 0xA8: case 0xD3:
+		case 0xD5: case 0xD6: case 0xD9: case 0xDA: case 0xDB:
+			cmdArgsLeft = 1;
+			break;
+		case 0x21: case 0x22: case 0xA3:
+			cmdArgsLeft = 2;
+			break;
+		case 0x29: case 0x2A:
+			cmdArgsLeft = 5;
+			break;
+		case 0x26: case 0x27:
+			cmdArgsLeft = 6;
+			break;
+		default:
+			executeCommand();
+			break;
+	}
+}
+void A32u4::SSD1306::executeCommand() {
+	const uint8_t cmd = cmdBuf[0];
+
+	if (cmd <= 0x0F) { // lower nibble of column start (page addressing)
+		pageColStart = (pageColStart & 0xF0) | cmd;
+		col = pageColStart;
+		return;
+	}
+	if (cmd <= 0x1F) { // higher nibble of column start (page addressing)
+		pageColStart = ((cmd & 0x07) << 4) | (pageColStart & 0x0F);
+		col = pageColStart;
+		return;
+	}
+	if (cmd >= 0x40 && cmd <= 0x7F) {
+		startLine = cmd & 0x3F;
+		return;
+	}
+	if (cmd >= 0xB0 && cmd <= 0xB7) { // page start (page addressing)
+		page = cmd & 0x07;
+		return;
+	}
+
+	switch (cmd) {
+		case 0x20:
+			addrMode = cmdBuf[1] & 0b11;
+			if (addrMode > AddrMode_Page) // invalid
+				addrMode = AddrMode_Page;
+			break;
+		case 0x21:
+			colStart = cmdBuf[1] & 0x7F;
+			colEnd = cmdBuf[2] & 0x7F;
+			col = colStart;
+			break;
+		case 0x22:
+			pageStart = cmdBuf[1] & 0x07;
+			pageEnd = cmdBuf[2] & 0x07;
+			page = pageStart;
+			break;
+		case 0x81: contrast = cmdBuf[1]; break;
+		case 0x8D: chargePump = (cmdBuf[1] & 0x04) != 0; break;
+		case 0xA0: case 0xA1: segRemap = cmd & 1; break;
+		case 0xA4: case 0xA5: entireOn = cmd & 1; break;
+		case 0xA6: case 0xA7: inverted = cmd & 1; break;
+		case 0xA8: muxRatio = cmdBuf[1] & 0x3F; break;
+		case 0xAE: case 0xAF: displayOn = cmd & 1; break;
+		case 0xC0: case 0xC8: comScanDec = (cmd & 0x08) != 0; break;
+		case 0xD3: displayOffset = cmdBuf[1] & 0x3F; break;
+		default: // timing, scrolling and other commands that dont affect the framebuffer
+			break;
+	}
+}
+
+void A32u4::SSD1306::portDChange(uint8_t oldVal, uint8_t val) {
+	if ((oldVal & rstMask) && !(val & rstMask)) {
+		reset();
+	}
+}
+
+const uint8_t* A32u4::SSD1306::getFramebuffer() const {
+	return framebuffer;
+}
+uint8_t A32u4::SSD1306::getPixel(uint8_t x, uint8_t y) const {
+	return (framebuffer[(y / 8) * width + x] >> (y % 8)) & 1;
+}
+uint8_t A32u4::SSD1306::getDirtyPages() const {
+	return dirtyPages;
+}
+void A32u4::SSD1306::clearDirty() {
+	dirtyPages = 0;
+}
+uint64_t A32u4::SSD1306::getFrameCount() const {
+	return frameCount;
+}
+uint32_t A32u4::SSD1306::framebufferHash() const {
+	uint32_t h = 0;
+	DU_HASHCB(h, framebuffer, framebufferSize);
+	return h;
+}
+
+uint8_t A32u4::SSD1306::getContrast() const {
+	return contrast;
+}
+bool A32u4::SSD1306::isOn() const {
+	return displayOn;
+}
+bool A32u4::SSD1306::isInverted() const {
+	return inverted;
+}
+
+void A32u4::SSD1306::getState(std::ostream& output){
+	output.write((const char*)framebuffer, framebufferSize);
+
+	output.write((const char*)cmdBuf, sizeof(cmdBuf));
+	StreamUtils::write(output, cmdLen);
+	StreamUtils::write(output, cmdArgsLeft);
+
+	StreamUtils::write(output, addrMode);
+	StreamUtils::write(output, colStart);
+	StreamUtils::write(output, colEnd);
+	StreamUtils::write(output, pageStart);
+	StreamUtils::write(output, pageEnd);
+	StreamUtils::write(output, pageColStart);
+	StreamUtils::write(output, col);
+	StreamUtils::write(output, page);
+
+	StreamUtils::write(output, contrast);
+	StreamUtils::write(output, startLine);
+	StreamUtils::write(output, displayOffset);
+	StreamUtils::write(output, muxRatio);
+	StreamUtils::write(output, displayOn);
+	StreamUtils::write(output, inverted);
+	StreamUtils::write(output, entireOn);
+	StreamUtils::write(output, segRemap);
+	StreamUtils::write(output, comScanDec);
+	StreamUtils::write(output, chargePump);
+
+	StreamUtils::write(output, dirtyPages);
+	StreamUtils::write(output, frameCount);
+#if MCU_WRITE_HASH
+	StreamUtils::write(output, hash());
+#endif
+}
+void A32u4::SSD1306::setState(std::istream& input){
+	input.read((char*)framebuffer, framebufferSize);
+
+	input.read((char*)cmdBuf, sizeof(cmdBuf));
+	StreamUtils::read(input, &cmdLen);
+	StreamUtils::read(input, &cmdArgsLeft);
+
+	StreamUtils::read(input, &addrMode);
+	StreamUtils::read(input, &colStart);
+	StreamUtils::read(input, &colEnd);
+	StreamUtils::read(input, &pageStart);
+	StreamUtils::read(input, &pageEnd);
+	StreamUtils::read(input, &pageColStart);
+	StreamUtils::read(input, &col);
+	StreamUtils::read(input, &page);
+
+	StreamUtils::read(input, &contrast);
+	StreamUtils::read(input, &startLine);
+	StreamUtils::read(input, &displayOffset);
+	StreamUtils::read(input, &muxRatio);
+	StreamUtils::read(input, &displayOn);
+	StreamUtils::read(input, &inverted);
+	StreamUtils::read(input, &entireOn);
+	StreamUtils::read(input, &segRemap);
+	StreamUtils::read(input, &comScanDec);
+	StreamUtils::read(input, &chargePump);
+
+	StreamUtils::read(input, &dirtyPages);
+	StreamUtils::read(input, &frameCount);
+	A32U4_CHECK_HASH_("SSD1306");
+}
+
+bool A32u4::SSD1306::operator==(const SSD1306& other) const{
+#define _CMP_(x) (x==other.x)
+	return std::memcmp(framebuffer, other.framebuffer, framebufferSize) == 0 &&
+		std::memcmp(cmdBuf, other.cmdBuf, sizeof(cmdBuf)) == 0 &&
+		_CMP_(cmdLen) && _CMP_(cmdArgsLeft) &&
+		_CMP_(addrMode) && _CMP_(colStart) && _CMP_(colEnd) && _CMP_(pageStart) && _CMP_(pageEnd) &&
+		_CMP_(pageColStart) && _CMP_(col) && _CMP_(page) &&
+		_CMP_(contrast) && _CMP_(startLine) && _CMP_(displayOffset) && _CMP_(muxRatio) &&
+		_CMP_(displayOn) && _CMP_(inverted) && _CMP_(entireOn) && _CMP_(segRemap) && _CMP_(comScanDec) && _CMP_(chargePump) &&
+		_CMP_(dirtyPages) && _CMP_(frameCount);
+#undef _CMP_
+}
+size_t A32u4::SSD1306::sizeBytes() const {
+	return sizeof(SSD1306);
+}
+uint32_t A32u4::SSD1306::hash() const noexcept{
+	uint32_t h = 0;
+	DU_HASHCB(h, framebuffer, framebufferSize);
+	DU_HASHCB(h, cmdBuf, sizeof(cmdBuf));
+	DU_HASHC(h, cmdLen);
+	DU_HASHC(h, cmdArgsLeft);
+	DU_HASHC(h, addrMode);
+	DU_HASHC(h, colStart);
+	DU_HASHC(h, colEnd);
+	DU_HASHC(h, pageStart);
+	DU_HASHC(h, pageEnd);
+	DU_HASHC(h, pageColStart);
+	DU_HASHC(h, col);
+	DU_HASHC(h, page);
+	DU_HASHC(h, contrast);
+	DU_HASHC(h, startLine);
+	DU_HASHC(h, displayOffset);
+	DU_HASHC(h, muxRatio);
+	DU_HASHC(h, displayOn);
+	DU_HASHC(h, inverted);
+	DU_HASHC(h, entireOn);
+	DU_HASHC(h, segRemap);
+	DU_HASHC(h, comScanDec);
+	DU_HASHC(h, chargePump);
+	DU_HASHC(h, dirtyPages);
+	DU_HASHC(h, frameCount);
+	return h;
+}
@@ -0,0 +1,105 @@
+#ifndef __A32U4_SSD1306_H__
+#define __A32U4_SSD1306_H__
+
+#include <stdint.h>
+#include <iostream>
+
+#include "../config.h"
+#include "../A32u4Types.h"
+
+namespace A32u4 {
+	// SSD1306 OLED controller (128x64) driven over SPI, fed directly by DataSpace when attached
+	class SSD1306 {
+	public:
+		static constexpr uint8_t width = 128;
+		static constexpr uint8_t height = 64;
+		static constexpr uint8_t pages = height / 8;
+		static constexpr size_t framebufferSize = width * pages;
+
+		// default pins on PORTD (Arduboy wiring)
+		static constexpr uint8_t PIN_CS = 6, PIN_DC = 4, PIN_RST = 7;
+
+		enum {
+			AddrMode_Horizontal = 0,
+			AddrMode_Vertical = 1,
+			AddrMode_Page = 2
+		};
+	private:
+		friend class DataSpace;
+
+		// framebuffer in the layout of the controllers GDDRAM: one byte is a vertical strip of 8 pixels, pages are stored after each other
+		uint8_t framebuffer[framebufferSize];
+
+		uint8_t csMask = 1 << PIN_CS;
+		uint8_t dcMask = 1 << PIN_DC;
+		uint8_t rstMask = 1 << PIN_RST;
+
+		uint8_t cmdBuf[8];
+		uint8_t cmdLen = 0; // amount of bytes in cmdBuf
+		uint8_t cmdArgsLeft = 0;
+
+		uint8_t addrMode = AddrMode_Page;
+		uint8_t colStart = 0, colEnd = width - 1;
+		uint8_t pageStart = 0, pageEnd = pages - 1;
+		uint8_t pageColStart = 0; // column start for page addressing
+		uint8_t col = 0, page = 0;
+
+		uint8_t contrast = 0x7F;
+		uint8_t startLine = 0;
+		uint8_t displayOffset = 0;
+		uint8_t muxRatio = height - 1;
+		bool displayOn = false;
+		bool inverted = false;
+		bool entireOn = false;
+		bool segRemap = false;
+		bool comScanDec = false;
+		bool chargePump = false;
+
+		uint8_t dirtyPages = 0; // bit n is set if page n was written since the last clearDirty()
+		uint64_t frameCount = 0;
+
+		void write(uint8_t byte, bool isData);
+		void writeData(uint8_t byte);
+		void writeCommand(uint8_t byte);
+		void executeCommand();
+		void advance();
+		void portDChange(uint8_t oldVal, uint8_t val);
+	public:
+		SSD1306();
+
+		void reset();
+
+		void setPins(uint8_t cs, uint8_t dc, uint8_t rst); // bit numbers on PORTD
+
+		const uint8_t* getFramebuffer() const;
+		uint8_t getPixel(uint8_t x, uint8_t y) const;
+		uint8_t getDirtyPages() const;
+		void clearDirty();
+		uint64_t getFrameCount() const;
+		uint32_t framebufferHash() const;
+
+		uint8_t getContrast() const;
+		bool isOn() const;
+		bool isInverted() const;
+
+		void getState(std::ostream& output);
+		void setState(std::istream& input);
+
+		bool operator==(const SSD1306& other) const;
+		size_t sizeBytes() const;
+		uint32_t hash() const noexcept;
+	};
+}
+namespace DataUtils {
+	inline size_t approxSizeOf(const A32u4::SSD1306& v) {
+		return v.sizeBytes();
+	}
+}
+template<>
+struct std::hash<A32u4::SSD1306>{
+	inline std::size_t operator()(const A32u4::SSD1306& v) const noexcept{
+		return (size_t)v.hash();
+	}
+};
+
+#endif
@@ -114,6 +114,9 @@ void A32u4::Analytics::getState(std::ostream& output){
 
 	StreamUtils::write(output, maxSP);
 	StreamUtils::write(output, sleepSum);
+#if MCU_WRITE_HASH
+	StreamUtils::write(output, hash());
+#endif
 }
 void A32u4::Analytics::setState(std::istream& input){
 	input.read((char*)&pcCounter[0], PCHeatArrSize);
@@ -121,7 +124,14 @@ void A32u4::Analytics::setState(std::istream& input){
 
 	StreamUtils::read(input, &maxSP);
 	StreamUtils::read(input, &sleepSum);
-	A32U4_CHECK_HASH("Analytics");
+	A32U4_CHECK_HASH_("Analytics");
+}
+void A32u4::Analytics::setStateV0(std::istream& input){
+	input.read((char*)&pcCounter[0], PCHeatArrSize);
+	input.read((char*)&instCounter[0], InstHeatArrSize);
+
+	StreamUtils::read(input, &maxSP);
+	StreamUtils::read(input, &sleepSum);
 }
 
 bool A32u4::Analytics::operator==(const Analytics& other) const{
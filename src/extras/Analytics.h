@@ -70,6 +70,7 @@ namespace A32u4 {
 
 		void getState(std::ostream& output);
 		void setState(std::istream& input);
+		void setStateV0(std::istream& input); // version 0 ATmega32u4 streams had no hash here
 
 		bool operator==(const Analytics& other) const;
 		size_t sizeBytes() const;
@@ -48,9 +48,6 @@ A32u4::Debugger::~Debugger() {
 #endif
 }
 
-uint8_t A32u4::Debugger::debugOutputMode = OutputMode_Log;
-bool A32u4::Debugger::printDisassembly = false;
-
 void A32u4::Debugger::reset() {
 	halted = false;
 	doStep = false;
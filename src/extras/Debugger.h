@@ -101,9 +101,9 @@ namespace A32u4 {
 			OutputMode_Log = 0,
 			OutputMode_Passthrough
 		};
-		static uint8_t debugOutputMode;
+		uint8_t debugOutputMode = OutputMode_Log;
 
-		static bool printDisassembly;
+		bool printDisassembly = false;
 
 		std::string regToStr(regind_t ind) const;
 		std::string AllRegsToStr() const;
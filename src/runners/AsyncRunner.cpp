@@ -0,0 +1,301 @@
+#include "AsyncRunner.h"
+
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+A32u4::AsyncRunner::AsyncRunner(size_t commandQueueSize, size_t eventQueueSize, size_t frameQueueSize) :
+	commands(commandQueueSize), events(eventQueueSize), frames(frameQueueSize), snapshots(eventQueueSize)
+{
+#if MCU_INCLUDE_EXTRAS
+	mcu.debugger.debugOutputMode = Debugger::OutputMode_Passthrough; // halting is reported through events, not the console
+#endif
+}
+A32u4::AsyncRunner::~AsyncRunner() {
+	stop();
+
+	Snapshot snap;
+	while (snapshots.pop(&snap, 1) == 1) {
+		delete snap.data;
+	}
+}
+
+A32u4::ATmega32u4& A32u4::AsyncRunner::getMcu() {
+	return mcu;
+}
+void A32u4::AsyncRunner::setSliceCycles(uint64_t cycles) {
+	sliceCycles = cycles > 0 ? cycles : 1;
+}
+void A32u4::AsyncRunner::setFramePublishing(const SSD1306* display_, uint64_t intervalCycles) {
+	display = display_;
+	frameInterval = intervalCycles;
+	nextFrame = mcu.cpu.getTotalCycles() + intervalCycles;
+}
+void A32u4::AsyncRunner::setStatePublisher(StatePublisher* publisher_) {
+	publisher = publisher_;
+}
+void A32u4::AsyncRunner::setSharedStateView(SharedStateView* view) {
+	sharedView = view;
+}
+
+void A32u4::AsyncRunner::start() {
+	if (started)
+		return;
+	started = true;
+	thread = std::thread([this] {
+		loop();
+	});
+}
+void A32u4::AsyncRunner::stop() {
+	if (!started)
+		return;
+
+	Command cmd{};
+	cmd.type = Cmd_Quit;
+	while (post(cmd) == 0) // the quit command must not get lost
+		std::this_thread::yield();
+	thread.join();
+	started = false;
+}
+
+void A32u4::AsyncRunner::wake() {
+	{
+		std::lock_guard<std::mutex> lock(wakeMutex);
+		wakePending = true;
+	}
+	wakeCond.notify_one();
+}
+uint64_t A32u4::AsyncRunner::post(Command cmd) {
+	cmd.id = nextId.fetch_add(1, std::memory_order_relaxed);
+	if (!commands.push(cmd))
+		return 0;
+	wake();
+	return cmd.id;
+}
+
+uint64_t A32u4::AsyncRunner::run(uint64_t cycles) {
+	Command cmd{};
+	cmd.type = Cmd_Run;
+	cmd.arg = cycles;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::stopRunning() {
+	Command cmd{};
+	cmd.type = Cmd_Stop;
+	const uint64_t id = post(cmd);
+	if (id)
+		mcu.requestStop(); // end the current slice early
+	return id;
+}
+uint64_t A32u4::AsyncRunner::queueInput(const DataSpace::InputEvent& input) {
+	Command cmd{};
+	cmd.type = Cmd_Input;
+	cmd.input = input;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::setBreakpoint(pc_t pc) {
+	Command cmd{};
+	cmd.type = Cmd_SetBreakpoint;
+	cmd.arg = pc;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::clearBreakpoint(pc_t pc) {
+	Command cmd{};
+	cmd.type = Cmd_ClearBreakpoint;
+	cmd.arg = pc;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::halt() {
+	Command cmd{};
+	cmd.type = Cmd_Halt;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::continue_() {
+	Command cmd{};
+	cmd.type = Cmd_Continue;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::step() {
+	Command cmd{};
+	cmd.type = Cmd_Step;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::requestSnapshot() {
+	Command cmd{};
+	cmd.type = Cmd_Snapshot;
+	return post(cmd);
+}
+uint64_t A32u4::AsyncRunner::call(CallB callB, void* userData) {
+	Command cmd{};
+	cmd.type = Cmd_Call;
+	cmd.callB = callB;
+	cmd.userData = userData;
+	return post(cmd);
+}
+
+void A32u4::AsyncRunner::publishState() {
+	if (publisher)
+		publisher->publish(mcu);
+	if (sharedView)
+		sharedView->publish(mcu);
+}
+void A32u4::AsyncRunner::publishEvent(uint8_t type, uint64_t id, uint64_t arg) {
+	const Event e = { type, id, mcu.cpu.getTotalCycles(), arg };
+	if (!events.push(e))
+		droppedOutputs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void A32u4::AsyncRunner::loop() {
+	for (;;) {
+		Command cmd;
+		while (commands.pop(&cmd)) {
+			if (!handleCommand(cmd))
+				return;
+		}
+
+#if MCU_INCLUDE_EXTRAS
+		const bool halted = mcu.debugger.isHalted();
+#else
+		const bool halted = false;
+#endif
+		if (budget > 0 && !halted) {
+			runSlice();
+			continue;
+		}
+
+		// nothing to do, sleep until the next command
+		std::unique_lock<std::mutex> lock(wakeMutex);
+		wakeCond.wait(lock, [this] { return wakePending; });
+		wakePending = false;
+	}
+}
+
+bool A32u4::AsyncRunner::handleCommand(const Command& cmd) {
+	switch (cmd.type) {
+		case Cmd_Run:
+			budget += cmd.arg;
+			break;
+		case Cmd_Stop:
+			budget = 0;
+			break;
+		case Cmd_Input: {
+			DataSpace::InputEvent in = cmd.input;
+			in.cycle += mcu.cpu.getTotalCycles();
+			mcu.dataspace.queueInput(in);
+			break;
+		}
+#if MCU_INCLUDE_EXTRAS
+		case Cmd_SetBreakpoint:
+			mcu.debugger.setBreakpoint((pc_t)cmd.arg);
+			break;
+		case Cmd_ClearBreakpoint:
+			mcu.debugger.clearBreakpoint((pc_t)cmd.arg);
+			break;
+		case Cmd_Halt:
+			mcu.debugger.halt();
+			if (!wasHalted) {
+				wasHalted = true;
+				publishEvent(Event_Halted, cmd.id, mcu.cpu.getPC());
+			}
+			break;
+		case Cmd_Continue:
+			mcu.debugger.continue_();
+			wasHalted = false;
+			break;
+		case Cmd_Step:
+			if (mcu.debugger.isHalted()) {
+				mcu.debugger.step();
+				mcu.execute(1, true);
+				publishState();
+				publishEvent(Event_Halted, cmd.id, mcu.cpu.getPC());
+			}
+			break;
+#endif
+		case Cmd_Snapshot: {
+			std::ostringstream stream;
+			mcu.getState(stream);
+			const Snapshot snap = { cmd.id, new std::string(stream.str()) };
+			if (snapshots.push(snap)) {
+				publishEvent(Event_Snapshot, cmd.id, 0);
+			}
+			else {
+				delete snap.data;
+				droppedOutputs.fetch_add(1, std::memory_order_relaxed);
+			}
+			break;
+		}
+		case Cmd_Call:
+			cmd.callB(&mcu, cmd.userData);
+			publishEvent(Event_CallDone, cmd.id, 0);
+			break;
+		case Cmd_Quit:
+			return false;
+	}
+	return true;
+}
+
+void A32u4::AsyncRunner::runSlice() {
+#if MCU_INCLUDE_EXTRAS
+	const bool debug = !mcu.debugger.getBreakpointList().empty();
+#else
+	const bool debug = false;
+#endif
+
+	uint64_t amt = std::min(sliceCycles, budget);
+	if (display && frameInterval > 0) {
+		const uint64_t now = mcu.cpu.getTotalCycles();
+		amt = std::min(amt, nextFrame > now ? nextFrame - now : 1);
+	}
+
+	const uint64_t start = mcu.cpu.getTotalCycles();
+	const uint8_t reason = mcu.execute(amt, debug);
+	const uint64_t ran = mcu.cpu.getTotalCycles() - start;
+	budget -= std::min(budget, ran);
+
+	publishState();
+
+	if (display && frameInterval > 0 && mcu.cpu.getTotalCycles() >= nextFrame) {
+		Frame f;
+		f.cycle = mcu.cpu.getTotalCycles();
+		std::memcpy(f.data, display->getFramebuffer(), sizeof(f.data));
+		if (!frames.push(f))
+			droppedOutputs.fetch_add(1, std::memory_order_relaxed);
+		while (nextFrame <= f.cycle)
+			nextFrame += frameInterval;
+	}
+
+#if MCU_INCLUDE_EXTRAS
+	if (mcu.debugger.isHalted()) {
+		if (!wasHalted) {
+			wasHalted = true;
+			publishEvent(Event_Halted, 0, mcu.cpu.getPC());
+		}
+		return;
+	}
+#endif
+	if (reason == ATmega32u4::StopReason_NoProgram)
+		budget = 0;
+	if (budget == 0)
+		publishEvent(Event_RunDone, 0, 0);
+}
+
+bool A32u4::AsyncRunner::pollEvent(Event* out) {
+	return events.pop(out, 1) == 1;
+}
+bool A32u4::AsyncRunner::popFrame(Frame* out) {
+	return frames.pop(out, 1) == 1;
+}
+bool A32u4::AsyncRunner::popSnapshot(std::string* out, uint64_t* id) {
+	Snapshot snap;
+	if (snapshots.pop(&snap, 1) != 1)
+		return false;
+	out->swap(*snap.data);
+	if (id)
+		*id = snap.id;
+	delete snap.data;
+	return true;
+}
+
+uint64_t A32u4::AsyncRunner::getDroppedOutputs() const {
+	return droppedOutputs.load(std::memory_order_relaxed);
+}
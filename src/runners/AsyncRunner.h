@@ -0,0 +1,143 @@
+#ifndef __A32U4_ASYNCRUNNER_H__
+#define __A32U4_ASYNCRUNNER_H__
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "../config.h"
+#include "../ATmega32u4.h"
+#include "../devices/SSD1306.h"
+#include "../utils/MPSCQueue.h"
+#include "../utils/SPSCRing.h"
+#include "StatePublisher.h"
+#include "SharedStateView.h"
+
+namespace A32u4 {
+	// owns an instance and emulates it on a dedicated thread
+	// other threads only talk to it through commands (any thread) and read what it publishes (one consumer per ring)
+	// set everything up on getMcu() before start(), afterwards the instance may only be touched through CallB commands
+	// commands are handled in order at the next slice boundary, Cmd_Run only adds to the budget (wait for Event_RunDone to see its result)
+	class AsyncRunner {
+	public:
+		typedef void (*CallB)(ATmega32u4* mcu, void* userData); // runs on the emulation thread
+
+		enum {
+			Cmd_Run = 0,        // arg: cycles to add to the budget
+			Cmd_Stop,           // drops the remaining budget
+			Cmd_Input,          // input.cycle is relative to the cycle the command is handled at
+			Cmd_SetBreakpoint,  // arg: pc
+			Cmd_ClearBreakpoint,// arg: pc
+			Cmd_Halt,
+			Cmd_Continue,
+			Cmd_Step,
+			Cmd_Snapshot,       // publishes the state of the instance
+			Cmd_Call,
+			Cmd_Quit
+		};
+		enum {
+			Event_RunDone = 0,  // the budget was used up
+			Event_Halted,       // arg: pc
+			Event_Snapshot,     // the state can be taken with popSnapshot
+			Event_CallDone
+		};
+
+		struct Command {
+			uint8_t type;
+			uint64_t id;
+			uint64_t arg;
+			DataSpace::InputEvent input;
+			CallB callB;
+			void* userData;
+		};
+		struct Event {
+			uint8_t type;
+			uint64_t id; // of the command that caused it, 0 if there was none
+			uint64_t cycle;
+			uint64_t arg;
+		};
+		struct Frame {
+			uint64_t cycle;
+			uint8_t data[SSD1306::framebufferSize];
+		};
+
+		static constexpr uint64_t defaultSliceCycles = CPU::ClockFreq / 1000; // 1ms
+	private:
+		ATmega32u4 mcu;
+
+		std::thread thread;
+		bool started = false;
+
+		MPSCQueue<Command> commands;
+		std::atomic<uint64_t> nextId{1};
+
+		// idle waiting only, the producers never block on it while the emulation is running
+		std::mutex wakeMutex;
+		std::condition_variable wakeCond;
+		bool wakePending = false;
+
+		SPSCRing<Event> events;
+		SPSCRing<Frame> frames;
+		struct Snapshot {
+			uint64_t id;
+			std::string* data;
+		};
+		SPSCRing<Snapshot> snapshots;
+		std::atomic<uint64_t> droppedOutputs{0};
+
+		// emulation thread only
+		uint64_t budget = 0;
+		uint64_t sliceCycles = defaultSliceCycles;
+		const SSD1306* display = nullptr;
+		uint64_t frameInterval = 0;
+		uint64_t nextFrame = 0;
+		StatePublisher* publisher = nullptr;
+		SharedStateView* sharedView = nullptr;
+		bool wasHalted = false;
+
+		void loop();
+		bool handleCommand(const Command& cmd); // returns false on quit
+		void runSlice();
+		void publishEvent(uint8_t type, uint64_t id, uint64_t arg);
+		void publishState();
+		void wake();
+		uint64_t post(Command cmd);
+	public:
+		AsyncRunner(size_t commandQueueSize = 256, size_t eventQueueSize = 256, size_t frameQueueSize = 4);
+		~AsyncRunner();
+
+		// before start
+		ATmega32u4& getMcu();
+		void setSliceCycles(uint64_t cycles);
+		void setFramePublishing(const SSD1306* display, uint64_t intervalCycles); // the display has to be attached to the instance
+		void setStatePublisher(StatePublisher* publisher); // published after every slice and step, nullptr to disable
+		void setSharedStateView(SharedStateView* view); // same as setStatePublisher
+
+		void start();
+		void stop(); // blocks until the thread is done
+
+		// any thread, returns the id of the command or 0 if the queue was full
+		uint64_t run(uint64_t cycles);
+		uint64_t stopRunning();
+		uint64_t queueInput(const DataSpace::InputEvent& input);
+		uint64_t setBreakpoint(pc_t pc);
+		uint64_t clearBreakpoint(pc_t pc);
+		uint64_t halt();
+		uint64_t continue_();
+		uint64_t step();
+		uint64_t requestSnapshot();
+		uint64_t call(CallB callB, void* userData);
+
+		// single consumer each
+		bool pollEvent(Event* out);
+		bool popFrame(Frame* out);
+		bool popSnapshot(std::string* out, uint64_t* id = nullptr);
+
+		uint64_t getDroppedOutputs() const; // events/frames/snapshots that didnt fit into their ring
+	};
+}
+
+#endif
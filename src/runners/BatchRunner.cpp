@@ -0,0 +1,164 @@
+#include "BatchRunner.h"
+
+#include <thread>
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "../ATmega32u4.h"
+#include "StatePublisher.h"
+
+A32u4::BatchRunner::BatchRunner(size_t numThreads_, bool pinThreads) : numThreads(numThreads_), pinThreads(pinThreads) {
+	if (numThreads == 0) {
+		numThreads = std::thread::hardware_concurrency();
+		if (numThreads == 0)
+			numThreads = 1;
+	}
+}
+
+void A32u4::BatchRunner::setSliceCycles(uint64_t cycles) {
+	sliceCycles = cycles > 0 ? cycles : 1;
+}
+size_t A32u4::BatchRunner::getNumThreads() const {
+	return numThreads;
+}
+
+void A32u4::BatchRunner::run(const Job* jobs_, size_t num, Result* results_) {
+	if (num == 0)
+		return;
+
+	jobs = jobs_;
+	results = results_;
+
+	numWorkers = std::min(numThreads, num);
+	workers.reset(new Worker[numWorkers]);
+	for (size_t i = 0; i < num; i++) {
+		results[i] = Result();
+		workers[i % numWorkers].jobs.push_back(i);
+	}
+	jobsLeft.store(num, std::memory_order_relaxed);
+
+	std::vector<std::thread> threads;
+	threads.reserve(numWorkers - 1);
+	for (size_t i = 1; i < numWorkers; i++) {
+		threads.emplace_back([this, i] {
+			if (pinThreads)
+				pinCurrentThread(i);
+			work(i);
+		});
+	}
+	work(0); // the calling thread is not pinned, that would outlast the run
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	workers.reset();
+	numWorkers = 0;
+	jobs = nullptr;
+	results = nullptr;
+}
+std::vector<A32u4::BatchRunner::Result> A32u4::BatchRunner::run(const std::vector<Job>& jobs_) {
+	std::vector<Result> res(jobs_.size());
+	run(jobs_.data(), jobs_.size(), res.data());
+	return res;
+}
+
+void A32u4::BatchRunner::work(size_t ind) {
+	while (jobsLeft.load(std::memory_order_acquire) > 0) {
+		size_t job;
+		if (!popJob(ind, &job) && !stealJob(ind, &job)) {
+			std::this_thread::yield(); // the remaining jobs are being run by others
+			continue;
+		}
+
+		if (runSlice(job)) {
+			jobsLeft.fetch_sub(1, std::memory_order_acq_rel);
+		}
+		else {
+			std::lock_guard<std::mutex> lock(workers[ind].mutex);
+			workers[ind].jobs.push_back(job);
+		}
+	}
+}
+bool A32u4::BatchRunner::popJob(size_t ind, size_t* job) {
+	// newest job first, it was most likely just running on this thread
+	Worker& w = workers[ind];
+	std::lock_guard<std::mutex> lock(w.mutex);
+	if (w.jobs.empty())
+		return false;
+	*job = w.jobs.back();
+	w.jobs.pop_back();
+	return true;
+}
+bool A32u4::BatchRunner::stealJob(size_t ind, size_t* job) {
+	for (size_t i = 1; i < numWorkers; i++) {
+		Worker& w = workers[(ind + i) % numWorkers];
+		std::unique_lock<std::mutex> lock(w.mutex, std::try_to_lock);
+		if (!lock.owns_lock() || w.jobs.empty())
+			continue;
+		*job = w.jobs.front(); // oldest job, the least likely to be in the victims cache
+		w.jobs.pop_front();
+		return true;
+	}
+	return false;
+}
+
+bool A32u4::BatchRunner::runSlice(size_t ind) {
+	const Job& job = jobs[ind];
+	Result& res = results[ind];
+
+	if (job.stopPred && job.stopPred(job.mcu, job.userData)) {
+		res.stopReason = StopReason_Predicate;
+		return true;
+	}
+	if (res.cyclesRun >= job.cycleBudget) {
+		res.stopReason = StopReason_Budget;
+		return true;
+	}
+
+	const uint64_t amt = std::min(sliceCycles, job.cycleBudget - res.cyclesRun);
+	const uint64_t start = job.mcu->cpu.getTotalCycles();
+	const uint8_t reason = job.mcu->execute(amt, job.debug);
+	res.cyclesRun += job.mcu->cpu.getTotalCycles() - start;
+	if (job.publisher)
+		job.publisher->publish(*job.mcu);
+
+	if (reason == ATmega32u4::StopReason_Requested) {
+		res.stopReason = StopReason_Requested;
+		return true;
+	}
+	if (reason != ATmega32u4::StopReason_Done) {
+		res.stopReason = StopReason_Stalled;
+		return true;
+	}
+	if (res.cyclesRun >= job.cycleBudget) {
+		res.stopReason = (job.stopPred && job.stopPred(job.mcu, job.userData)) ? StopReason_Predicate : StopReason_Budget;
+		return true;
+	}
+	return false;
+}
+
+void A32u4::BatchRunner::pinCurrentThread(size_t core) {
+	const size_t cores = std::thread::hardware_concurrency();
+	if (cores == 0)
+		return;
+	core %= cores;
+#if defined(_WIN32)
+	if (core < sizeof(DWORD_PTR) * 8)
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)core; // not supported, the os decides
+#endif
+}
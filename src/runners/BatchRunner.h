@@ -0,0 +1,86 @@
+#ifndef __A32U4_BATCHRUNNER_H__
+#define __A32U4_BATCHRUNNER_H__
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+#include "../config.h"
+
+#include "../components/CPU.h" // for CPU::ClockFreq
+
+namespace A32u4 {
+	class ATmega32u4;
+	class StatePublisher;
+
+	// runs many independent instances on a pool of threads
+	// every thread has its own deque of jobs: it keeps working on its most recent job (so that instance stays in its cache)
+	// and idle threads steal the oldest jobs of the others
+	class BatchRunner {
+	public:
+		// called between slices, returning true stops the job
+		typedef bool (*StopPredicate)(ATmega32u4* mcu, void* userData);
+
+		enum {
+			StopReason_None = 0, // job did not run
+			StopReason_Budget,    // the cycle budget was used up
+			StopReason_Predicate,
+			StopReason_Stalled,   // the instance stopped advancing (no program loaded or halted by the debugger)
+			StopReason_Requested  // ATmega32u4::requestStop was called
+		};
+
+		struct Job {
+			ATmega32u4* mcu;
+			uint64_t cycleBudget;
+			StopPredicate stopPred = nullptr;
+			void* userData = nullptr;
+			bool debug = false;
+			StatePublisher* publisher = nullptr; // published after every slice
+		};
+		struct Result {
+			uint64_t cyclesRun = 0;
+			uint8_t stopReason = StopReason_None;
+		};
+
+		static constexpr uint64_t defaultSliceCycles = CPU::ClockFreq / 1000; // 1ms
+	private:
+		struct Worker {
+			std::mutex mutex; // only contended while someone is stealing, jobs run for a whole slice in between
+			std::deque<size_t> jobs;
+		};
+
+		size_t numThreads;
+		bool pinThreads;
+		uint64_t sliceCycles = defaultSliceCycles;
+
+		// only valid during run()
+		const Job* jobs = nullptr;
+		Result* results = nullptr;
+		std::unique_ptr<Worker[]> workers;
+		size_t numWorkers = 0;
+		std::atomic<size_t> jobsLeft{0};
+
+		void work(size_t ind);
+		bool popJob(size_t ind, size_t* job);
+		bool stealJob(size_t ind, size_t* job);
+		bool runSlice(size_t job); // returns true if the job is done
+
+		static void pinCurrentThread(size_t core);
+	public:
+		// numThreads == 0 uses all cores, the calling thread is one of the workers
+		BatchRunner(size_t numThreads = 0, bool pinThreads = false);
+
+		void setSliceCycles(uint64_t cycles);
+		size_t getNumThreads() const;
+
+		// blocks until every job is done, results[i] belongs to jobs[i]
+		// every instance may only be part of one job
+		void run(const Job* jobs, size_t num, Result* results);
+		std::vector<Result> run(const std::vector<Job>& jobs);
+	};
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "InterleavedScheduler.h"
+
+#include <algorithm>
+
+#include "DataUtils.h"
+
+#include "../ATmega32u4.h"
+
+// the cpu loop gets instantiated in here so it can be inlined into the round
+#define LU_MODULE "Inst Handler"
+#include "../components/InstHandlerTemplates.h"
+#undef LU_MODULE
+#define LU_MODULE "CPU"
+#include "../components/CPUTemplates.h"
+#undef LU_MODULE
+
+void A32u4::InterleavedScheduler::setQuantumCycles(uint64_t cycles) {
+	quantumCycles = cycles > 0 ? cycles : 1;
+}
+
+size_t A32u4::InterleavedScheduler::add(ATmega32u4* mcu, uint64_t budget) {
+	Progress p;
+	p.budget = budget;
+	if (!mcu->running || !mcu->flash.isProgramLoaded()) {
+		p.done = true;
+		p.stalled = true;
+	}
+	else {
+		numActive++;
+	}
+
+	mcus.push_back(mcu);
+	progress.push_back(p);
+	return mcus.size() - 1;
+}
+void A32u4::InterleavedScheduler::remove(size_t ind) {
+	if (!progress[ind].done)
+		numActive--;
+	mcus[ind] = nullptr;
+	progress[ind].done = true;
+}
+void A32u4::InterleavedScheduler::setBudget(size_t ind, uint64_t budget) {
+	Progress& p = progress[ind];
+	p.budget = budget;
+	if (!mcus[ind] || p.stalled)
+		return;
+
+	const bool done = p.cyclesRun >= budget;
+	if (done != p.done) {
+		p.done = done;
+		if (done)
+			numActive--;
+		else
+			numActive++;
+	}
+}
+void A32u4::InterleavedScheduler::clear() {
+	mcus.clear();
+	progress.clear();
+	numActive = 0;
+}
+
+size_t A32u4::InterleavedScheduler::shareProgram() {
+	std::vector<ATmega32u4*> programs;
+	for (auto mcu : mcus) {
+		if (!mcu)
+			continue;
+
+		bool found = false;
+		for (auto prog : programs) {
+			if (mcu->flash.sharesProgramWith(prog->flash)) {
+				found = true;
+				break;
+			}
+			if (mcu->flash.size() == prog->flash.size() && std::memcmp(mcu->flash.getData(), prog->flash.getData(), Flash::sizeMax) == 0) {
+				mcu->flash.shareProgram(prog->flash);
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			programs.push_back(mcu);
+	}
+	return programs.size();
+}
+
+size_t A32u4::InterleavedScheduler::runRound() {
+	const size_t num = mcus.size();
+	for (size_t i = 0; i < num; i++) {
+		Progress& p = progress[i];
+		if (p.done)
+			continue;
+
+		ATmega32u4& mcu = *mcus[i];
+		const uint64_t start = mcu.cpu.getTotalCycles();
+		mcu.dataspace.pollHostInputs();
+		p.stopReason = mcu.cpu.execute4T<false>(std::min(quantumCycles, p.budget - p.cyclesRun));
+		mcu.dataspace.flushOutputs();
+
+		p.cyclesRun += mcu.cpu.getTotalCycles() - start;
+		if (p.stopReason == ATmega32u4::StopReason_Halted)
+			p.stalled = true;
+		if (p.stalled || p.stopReason == ATmega32u4::StopReason_Requested || p.cyclesRun >= p.budget) {
+			p.done = true;
+			numActive--;
+		}
+	}
+	return numActive;
+}
+size_t A32u4::InterleavedScheduler::run(size_t maxRounds) {
+	for (size_t r = 0; r < maxRounds && numActive > 0; r++) {
+		runRound();
+	}
+	return numActive;
+}
+
+size_t A32u4::InterleavedScheduler::size() const {
+	return mcus.size();
+}
+size_t A32u4::InterleavedScheduler::getNumActive() const {
+	return numActive;
+}
+const A32u4::InterleavedScheduler::Progress* A32u4::InterleavedScheduler::getProgress() const {
+	return progress.data();
+}
@@ -0,0 +1,60 @@
+#ifndef __A32U4_INTERLEAVEDSCHEDULER_H__
+#define __A32U4_INTERLEAVEDSCHEDULER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "../config.h"
+
+#include "../components/CPU.h" // for CPU::ClockFreq
+
+namespace A32u4 {
+	class ATmega32u4;
+
+	// runs a group of instances round robin on the calling thread
+	// the checks ATmega32u4::execute does on every call are done once when an instance is added,
+	// so each quantum goes straight into the cpu loop
+	class InterleavedScheduler {
+	public:
+		static constexpr uint64_t defaultQuantumCycles = CPU::ClockFreq / 1000; // 1ms
+
+		struct Progress {
+			uint64_t cyclesRun = 0;
+			uint64_t budget = 0;
+			bool done = false; // budget used up, removed, stalled or stopped by ATmega32u4::requestStop
+			bool stalled = false; // halted by the debugger or was not runnable when added
+			uint8_t stopReason = 0; // ATmega32u4::StopReason_x of the last quantum
+		};
+	private:
+		std::vector<ATmega32u4*> mcus; // nullptr if removed
+		std::vector<Progress> progress;
+		size_t numActive = 0;
+
+		uint64_t quantumCycles = defaultQuantumCycles;
+	public:
+		void setQuantumCycles(uint64_t cycles);
+
+		// returns the index of the instance, the budget is in cycles
+		// instances without a program or that are not powered on are immediately done
+		size_t add(ATmega32u4* mcu, uint64_t budget = (uint64_t)-1);
+		void remove(size_t ind);
+		void setBudget(size_t ind, uint64_t budget); // resumes a done instance if the budget is bigger than what it ran
+		void clear();
+
+		// makes all instances with the same program share one copy of it (until one of them modifies it)
+		// returns the amount of distinct programs
+		size_t shareProgram();
+
+		// one quantum for every active instance, returns the amount still active
+		size_t runRound();
+		// runs rounds until every instance is done or maxRounds is reached, returns the amount still active
+		size_t run(size_t maxRounds = (size_t)-1);
+
+		size_t size() const;
+		size_t getNumActive() const;
+		// indexed like the instances, valid until the next add
+		const Progress* getProgress() const;
+	};
+}
+
+#endif
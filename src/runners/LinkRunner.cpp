@@ -0,0 +1,197 @@
+#include "LinkRunner.h"
+
+#include <thread>
+#include <algorithm>
+
+#include "../ATmega32u4.h"
+
+A32u4::LinkRunner::LinkRunner(uint64_t latency) : latency(latency > 0 ? latency : 1) {
+
+}
+
+void A32u4::LinkRunner::setRingSize(size_t size) {
+	ringSize = size;
+	for (auto& c : channels) {
+		c->ring.resize(size);
+	}
+}
+uint64_t A32u4::LinkRunner::getLatency() const {
+	return latency;
+}
+
+size_t A32u4::LinkRunner::addNode(ATmega32u4* mcu) {
+	if (mcu->getPinChangeQueueSize() == 0)
+		mcu->setPinChangeQueueSize(ringSize);
+
+	Node n;
+	n.mcu = mcu;
+	nodes.push_back(std::move(n));
+	return nodes.size() - 1;
+}
+size_t A32u4::LinkRunner::getChannel(size_t from, size_t to) {
+	for (size_t c : nodes[from].out) {
+		if (channels[c]->to == to)
+			return c;
+	}
+	channels.emplace_back(new Channel());
+	Channel& c = *channels.back();
+	c.from = from;
+	c.to = to;
+	c.ring.resize(ringSize);
+
+	const size_t ind = channels.size() - 1;
+	nodes[from].out.push_back(ind);
+	nodes[to].in.push_back(ind);
+	return ind;
+}
+void A32u4::LinkRunner::linkPin(size_t from, uint8_t fromPort, uint8_t fromBit, size_t to, uint8_t toPort, uint8_t toBit) {
+	getChannel(from, to);
+	nodes[from].pinLinks.push_back({ to, fromPort, fromBit, toPort, toBit });
+}
+void A32u4::LinkRunner::linkUsart(size_t from, size_t to) {
+	getChannel(from, to);
+	nodes[from].usartTo.push_back(to);
+}
+
+void A32u4::LinkRunner::barrier(bool& localSense) {
+	localSense = !localSense;
+	if (barrierCnt.fetch_add(1, std::memory_order_acq_rel) + 1 == nodes.size()) {
+		barrierCnt.store(0, std::memory_order_relaxed);
+		barrierSense.store(localSense, std::memory_order_release);
+	}
+	else {
+		while (barrierSense.load(std::memory_order_acquire) != localSense)
+			std::this_thread::yield();
+	}
+}
+
+void A32u4::LinkRunner::run(uint64_t cycles) {
+	if (nodes.empty())
+		return;
+
+	for (auto& n : nodes) {
+		n.base = n.mcu->cpu.getTotalCycles();
+		// whatever happened before the run is not sent over the links
+		std::vector<ATmega32u4::PinChange> skip(n.mcu->getPinChangeQueueLen());
+		n.mcu->drainPinChanges(skip.data(), skip.size());
+		uint8_t byte;
+		while (n.mcu->dataspace.usart1Read(&byte, 1) == 1);
+	}
+	barrierCnt.store(0, std::memory_order_relaxed);
+	barrierSense.store(false, std::memory_order_relaxed);
+
+	std::vector<std::thread> threads;
+	threads.reserve(nodes.size() - 1);
+	for (size_t i = 1; i < nodes.size(); i++) {
+		threads.emplace_back([this, i, cycles] {
+			runNode(i, cycles);
+		});
+	}
+	runNode(0, cycles);
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+void A32u4::LinkRunner::runNode(size_t ind, uint64_t cycles) {
+	Node& n = nodes[ind];
+	bool sense = false;
+
+	for (uint64_t start = 0; start < cycles; start += latency) {
+		const uint64_t end = std::min(start + latency, cycles);
+
+		deliverUsart(ind, n.base + start);
+
+		// run to the absolute end of the quantum, so overshooting by a few cycles doesnt add up
+		const uint64_t now = n.mcu->cpu.getTotalCycles() - n.base;
+		if (now < end)
+			n.mcu->execute(end - now, false);
+
+		publish(ind, end);
+		barrier(sense);
+		// everything the others sent in this quantum is in the rings now
+		receive(ind);
+	}
+	deliverUsart(ind, n.base + cycles);
+}
+
+void A32u4::LinkRunner::publish(size_t ind, uint64_t quantumEnd) {
+	Node& n = nodes[ind];
+	ATmega32u4& mcu = *n.mcu;
+
+	const uint64_t overflowsBefore = mcu.getPinChangeQueueOverflows();
+	ATmega32u4::PinChange changes[64];
+	size_t amt;
+	while ((amt = mcu.drainPinChanges(changes, 64)) > 0) {
+		for (size_t i = 0; i < amt; i++) {
+			const ATmega32u4::PinChange& c = changes[i];
+			const uint8_t changed = c.oldVal ^ c.val;
+			for (const auto& l : n.pinLinks) {
+				if (l.fromPort != c.pinReg || !(changed & (1 << l.fromBit)))
+					continue;
+
+				const Event e = {
+					c.cycle - n.base + latency,
+					l.toPort,
+					(uint8_t)(1 << l.toBit),
+					(uint8_t)(((c.val >> l.fromBit) & 1) << l.toBit)
+				};
+				for (size_t ch : n.out) {
+					if (channels[ch]->to == l.to) {
+						if (!channels[ch]->ring.push(e))
+							n.dropped++;
+						break;
+					}
+				}
+			}
+		}
+	}
+	n.dropped += mcu.getPinChangeQueueOverflows() - overflowsBefore;
+
+	uint8_t byte;
+	while (mcu.dataspace.usart1Read(&byte, 1) == 1) {
+		if (n.usartTo.empty())
+			continue;
+		const Event e = { quantumEnd + latency, 0xFF, 0, byte };
+		for (size_t to : n.usartTo) {
+			for (size_t ch : n.out) {
+				if (channels[ch]->to == to) {
+					if (!channels[ch]->ring.push(e))
+						n.dropped++;
+					break;
+				}
+			}
+		}
+	}
+}
+void A32u4::LinkRunner::receive(size_t ind) {
+	Node& n = nodes[ind];
+	Event events[64];
+	for (size_t ch : n.in) {
+		size_t amt;
+		while ((amt = channels[ch]->ring.pop(events, 64)) > 0) {
+			for (size_t i = 0; i < amt; i++) {
+				const Event& e = events[i];
+				if (e.port == 0xFF) {
+					n.usartPending.push_back({ n.base + e.cycle, e.port, e.mask, e.val });
+				}
+				else {
+					n.mcu->dataspace.queueInput({ n.base + e.cycle, e.port, e.mask, e.val });
+				}
+			}
+		}
+	}
+}
+void A32u4::LinkRunner::deliverUsart(size_t ind, uint64_t until) {
+	Node& n = nodes[ind];
+	while (!n.usartPending.empty() && n.usartPending.front().cycle <= until) {
+		const uint8_t byte = n.usartPending.front().val;
+		if (n.mcu->dataspace.usart1Write(&byte, 1) == 0)
+			n.dropped++;
+		n.usartPending.pop_front();
+	}
+}
+
+uint64_t A32u4::LinkRunner::getDropped(size_t node) const {
+	return nodes[node].dropped;
+}
@@ -0,0 +1,85 @@
+#ifndef __A32U4_LINKRUNNER_H__
+#define __A32U4_LINKRUNNER_H__
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+
+#include "../config.h"
+#include "../utils/SPSCRing.h"
+
+namespace A32u4 {
+	class ATmega32u4;
+
+	// runs linked instances (e.g. two consoles with a link cable) on one thread each
+	// everything sent over a link arrives latency cycles later, so the instances can run latency cycles (one quantum)
+	// without hearing from each other and only have to synchronize at the end of every quantum
+	// pin links are exact to the cycle, usart bytes are timestamped with the end of the quantum they were sent in
+	class LinkRunner {
+	public:
+		static constexpr size_t defaultRingSize = 4096;
+	private:
+		struct Event {
+			uint64_t cycle; // relative to the start of the run
+			uint8_t port; // 0xFF for an usart byte
+			uint8_t mask;
+			uint8_t val;
+		};
+		struct PinLink {
+			size_t to;
+			uint8_t fromPort, fromBit;
+			uint8_t toPort, toBit;
+		};
+		struct Channel {
+			size_t from, to;
+			SPSCRing<Event> ring;
+		};
+		struct Node {
+			ATmega32u4* mcu;
+			uint64_t base = 0; // cycle count when the run started
+			std::vector<PinLink> pinLinks;
+			std::vector<size_t> usartTo; // nodes receiving our transmitted bytes
+			std::vector<size_t> out; // channel indices
+			std::vector<size_t> in;
+			std::deque<Event> usartPending; // received bytes waiting for their cycle (absolute), kept between runs
+			uint64_t dropped = 0;
+		};
+
+		uint64_t latency;
+		size_t ringSize = defaultRingSize;
+		std::vector<Node> nodes;
+		std::vector<std::unique_ptr<Channel>> channels;
+
+		// sense reversing barrier for the end of each quantum
+		std::atomic<size_t> barrierCnt{0};
+		std::atomic<bool> barrierSense{false};
+
+		size_t getChannel(size_t from, size_t to);
+		void barrier(bool& localSense);
+		void runNode(size_t ind, uint64_t cycles);
+		void publish(size_t ind, uint64_t quantumEnd);
+		void receive(size_t ind);
+		void deliverUsart(size_t ind, uint64_t until);
+	public:
+		// latency in cycles, it also is the length of a quantum (> 0)
+		LinkRunner(uint64_t latency);
+
+		void setRingSize(size_t size); // events per direction and quantum
+		uint64_t getLatency() const;
+
+		// the instance gets a pin change queue if it doesnt have one, returns the node index
+		size_t addNode(ATmega32u4* mcu);
+		// ports are given as ATmega32u4::PinChange_PORTx, the output (PORT) bit of one drives the input (PIN) bit of the other
+		void linkPin(size_t from, uint8_t fromPort, uint8_t fromBit, size_t to, uint8_t toPort, uint8_t toBit);
+		void linkUsart(size_t from, size_t to); // USART1 TX of from into USART1 RX of to
+
+		// runs every node for the given amount of cycles, blocks until all are done
+		void run(uint64_t cycles);
+
+		uint64_t getDropped(size_t node) const; // events that didnt fit into a ring or the pin change queue
+	};
+}
+
+#endif
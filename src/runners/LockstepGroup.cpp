@@ -0,0 +1,189 @@
+#include "LockstepGroup.h"
+
+#include <algorithm>
+#include <tuple>
+
+#include "DataUtils.h"
+
+#include "../ATmega32u4.h"
+
+bool A32u4::LockstepGroup::Input::operator==(const Input& other) const {
+	return offset == other.offset && port == other.port && mask == other.mask && val == other.val;
+}
+
+A32u4::LockstepGroup::LockstepGroup(const ATmega32u4& proto, size_t numLanes) : lanes(numLanes) {
+	const size_t inst = allocInst(proto);
+	for (auto& lane : lanes) {
+		lane.inst = inst;
+	}
+	instUsers[inst] = numLanes;
+}
+A32u4::LockstepGroup::~LockstepGroup() {
+
+}
+
+void A32u4::LockstepGroup::setQuantumCycles(uint64_t cycles) {
+	quantumCycles = cycles > 0 ? cycles : 1;
+}
+void A32u4::LockstepGroup::setMergeInterval(size_t quanta) {
+	mergeInterval = quanta;
+}
+
+size_t A32u4::LockstepGroup::allocInst(const ATmega32u4& src) {
+	for (size_t i = 0; i < insts.size(); i++) {
+		if (!insts[i]) {
+			insts[i].reset(new ATmega32u4(src));
+			instUsers[i] = 0;
+			return i;
+		}
+	}
+	insts.emplace_back(new ATmega32u4(src));
+	instUsers.push_back(0);
+	return insts.size() - 1;
+}
+void A32u4::LockstepGroup::releaseInst(size_t inst) {
+	insts[inst].reset();
+	instUsers[inst] = 0;
+}
+void A32u4::LockstepGroup::setLaneInst(size_t lane, size_t inst) {
+	const size_t old = lanes[lane].inst;
+	lanes[lane].inst = inst;
+	instUsers[inst]++;
+	if (--instUsers[old] == 0)
+		releaseInst(old);
+}
+
+void A32u4::LockstepGroup::queueInput(size_t lane, const Input& input) {
+	auto& pending = lanes[lane].pending;
+	// keep them sorted by all fields, so lanes with the same inputs compare equal independent of the order they were given in
+	auto it = std::upper_bound(pending.begin(), pending.end(), input, [](const Input& a, const Input& b) {
+		return std::tie(a.offset, a.port, a.mask, a.val) < std::tie(b.offset, b.port, b.mask, b.val);
+	});
+	pending.insert(it, input);
+}
+
+void A32u4::LockstepGroup::splitByInputs() {
+	std::vector<std::vector<size_t>> lanesOf(insts.size());
+	for (size_t l = 0; l < lanes.size(); l++) {
+		lanesOf[lanes[l].inst].push_back(l);
+	}
+
+	// the lanes of a shared instance are grouped by their inputs, the first group keeps the instance and every other group gets a copy
+	for (size_t inst = 0; inst < lanesOf.size(); inst++) {
+		const auto& ls = lanesOf[inst];
+		if (ls.size() <= 1)
+			continue;
+
+		std::vector<std::pair<size_t, size_t>> groups = { {ls[0], inst} }; // first lane, instance
+		for (size_t i = 1; i < ls.size(); i++) {
+			const size_t l = ls[i];
+			size_t target = (size_t)-1;
+			for (const auto& g : groups) {
+				if (lanes[g.first].pending == lanes[l].pending) {
+					target = g.second;
+					break;
+				}
+			}
+			if (target == (size_t)-1) {
+				target = allocInst(*insts[inst]);
+				groups.push_back({ l, target });
+			}
+			if (target != inst)
+				setLaneInst(l, target);
+		}
+	}
+}
+void A32u4::LockstepGroup::applyInputs() {
+	// all lanes of an instance have the same inputs now, so they only get applied once
+	std::vector<bool> applied(insts.size(), false);
+	for (auto& lane : lanes) {
+		if (!lane.pending.empty() && !applied[lane.inst]) {
+			applied[lane.inst] = true;
+
+			ATmega32u4& mcu = *insts[lane.inst];
+			const uint64_t start = mcu.cpu.getTotalCycles();
+			for (const auto& in : lane.pending) {
+				mcu.dataspace.queueInput({ start + in.offset, in.port, in.mask, in.val });
+			}
+		}
+		lane.pending.clear();
+	}
+}
+
+uint32_t A32u4::LockstepGroup::stateKey(const ATmega32u4& mcu) {
+	// cheap prefilter, the flash and extras are only compared once the keys match
+	uint32_t h = 0;
+	DU_HASH_COMB(h, mcu.cpu.hash());
+	DU_HASH_COMB(h, mcu.dataspace.hash());
+	DU_HASH_COMB(h, mcu.usb.hash());
+	return h;
+}
+void A32u4::LockstepGroup::merge() {
+	quantaSinceMerge = 0;
+
+	std::vector<std::pair<uint32_t, size_t>> keys;
+	for (size_t i = 0; i < insts.size(); i++) {
+		// instances with inputs still queued would diverge later on
+		if (insts[i] && insts[i]->dataspace.getInputQueueLen() == 0)
+			keys.push_back({ stateKey(*insts[i]), i });
+	}
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<size_t> mergeInto(insts.size(), (size_t)-1);
+	for (size_t i = 0; i < keys.size(); i++) {
+		const size_t a = keys[i].second;
+		if (mergeInto[a] != (size_t)-1)
+			continue;
+		for (size_t j = i + 1; j < keys.size() && keys[j].first == keys[i].first; j++) {
+			const size_t b = keys[j].second;
+			if (mergeInto[b] == (size_t)-1 && *insts[a] == *insts[b])
+				mergeInto[b] = a;
+		}
+	}
+
+	for (size_t l = 0; l < lanes.size(); l++) {
+		const size_t target = mergeInto[lanes[l].inst];
+		if (target != (size_t)-1)
+			setLaneInst(l, target);
+	}
+}
+void A32u4::LockstepGroup::mergeNow() {
+	merge();
+}
+
+void A32u4::LockstepGroup::execute(size_t quanta) {
+	for (size_t q = 0; q < quanta; q++) {
+		splitByInputs();
+		applyInputs();
+
+		for (auto& inst : insts) {
+			if (inst)
+				inst->execute(quantumCycles, false);
+		}
+
+		if (mergeInterval > 0 && ++quantaSinceMerge >= mergeInterval)
+			merge();
+	}
+}
+
+size_t A32u4::LockstepGroup::getNumLanes() const {
+	return lanes.size();
+}
+size_t A32u4::LockstepGroup::getNumInstances() const {
+	size_t cnt = 0;
+	for (auto& inst : insts) {
+		if (inst)
+			cnt++;
+	}
+	return cnt;
+}
+
+const A32u4::ATmega32u4& A32u4::LockstepGroup::getLane(size_t lane) const {
+	return *insts[lanes[lane].inst];
+}
+A32u4::ATmega32u4& A32u4::LockstepGroup::getLaneMutable(size_t lane) {
+	const size_t inst = lanes[lane].inst;
+	if (instUsers[inst] > 1)
+		setLaneInst(lane, allocInst(*insts[inst]));
+	return *insts[lanes[lane].inst];
+}
@@ -0,0 +1,79 @@
+#ifndef __A32U4_LOCKSTEPGROUP_H__
+#define __A32U4_LOCKSTEPGROUP_H__
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+
+#include "../config.h"
+
+#include "../components/CPU.h" // for CPU::ClockFreq
+
+namespace A32u4 {
+	class ATmega32u4;
+
+	// many lanes running the same firmware in lockstep, differing only in their inputs
+	// lanes with identical state share one instance, which is only executed once per quantum
+	// a lane gets its own copy once its inputs differ, and lanes that end up in the same state again get merged
+	// only inputs given to the group are seen by the lanes, host callbacks/devices of shared instances are not per lane
+	class LockstepGroup {
+	public:
+		static constexpr uint64_t defaultQuantumCycles = CPU::ClockFreq / 1000; // 1ms
+
+		struct Input {
+			uint64_t offset; // cycles after the start of the next quantum
+			uint8_t port; // ATmega32u4::PinChange_PORTx
+			uint8_t mask;
+			uint8_t val;
+
+			bool operator==(const Input& other) const;
+		};
+	private:
+		struct Lane {
+			size_t inst;
+			std::vector<Input> pending; // inputs for the next quantum
+		};
+
+		std::vector<std::unique_ptr<ATmega32u4>> insts; // nullptr if the slot is free
+		std::vector<size_t> instUsers; // amount of lanes per instance
+		std::vector<Lane> lanes;
+
+		uint64_t quantumCycles = defaultQuantumCycles;
+		size_t mergeInterval = 1; // in quanta, 0 disables merging
+		size_t quantaSinceMerge = 0;
+
+		size_t allocInst(const ATmega32u4& src);
+		void releaseInst(size_t inst);
+		void setLaneInst(size_t lane, size_t inst);
+
+		void splitByInputs();
+		void applyInputs();
+		void merge();
+		static uint32_t stateKey(const ATmega32u4& mcu);
+	public:
+		// every lane starts as a copy of proto, which should already have its program loaded and be powered on
+		LockstepGroup(const ATmega32u4& proto, size_t numLanes);
+		~LockstepGroup();
+
+		void setQuantumCycles(uint64_t cycles);
+		void setMergeInterval(size_t quanta);
+
+		void queueInput(size_t lane, const Input& input);
+
+		// runs all lanes for the given amount of quanta
+		void execute(size_t quanta = 1);
+
+		// forces a merge check independent of the merge interval
+		void mergeNow();
+
+		size_t getNumLanes() const;
+		size_t getNumInstances() const; // amount of distinct states that get executed
+
+		// the instance might be shared with other lanes, so it must not be modified
+		const ATmega32u4& getLane(size_t lane) const;
+		// gives the lane its own instance if it is shared
+		ATmega32u4& getLaneMutable(size_t lane);
+	};
+}
+
+#endif
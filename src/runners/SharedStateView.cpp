@@ -0,0 +1,148 @@
+#include "SharedStateView.h"
+
+#include <cstring>
+#include <new>
+
+#include "../ATmega32u4.h"
+
+A32u4::SharedStateView::SharedStateView() {
+
+}
+A32u4::SharedStateView::~SharedStateView() {
+	close();
+}
+
+A32u4::SharedStateView::Header* A32u4::SharedStateView::header() {
+	return (Header*)segment.data();
+}
+
+bool A32u4::SharedStateView::create(const char* name_) {
+	close();
+
+	// start from an empty segment, an old one might have a different size or layout
+	MappedFile::removeShared(name_);
+	if (!segment.openShared(name_, MappedFile::Mode_ReadWrite, segmentSize))
+		return false;
+	name = name_;
+
+	std::memset(segment.data(), 0, segmentSize);
+	Header* h = new (segment.data()) Header();
+	std::memcpy(h->magic, magic, sizeof(magic));
+	h->version = layoutVersion;
+	h->headerSize = sizeof(Header);
+	h->dataOffset = dataOffset;
+	h->dataSize = DataSpace::Consts::data_size;
+	h->eepromOffset = eepromOffset;
+	h->eepromSize = DataSpace::Consts::eeprom_size;
+	h->flashOffset = flashOffset;
+	h->flashSize = Flash::sizeMax;
+	h->flashGeneration = flashGeneration = 1; // the empty image, so readers starting at 0 copy it at least once
+	h->generation.store(0, std::memory_order_release);
+	return true;
+}
+void A32u4::SharedStateView::close() {
+	if (!segment.isOpen())
+		return;
+	segment.close();
+	MappedFile::removeShared(name.c_str());
+	name.clear();
+}
+bool A32u4::SharedStateView::isOpen() const {
+	return segment.isOpen();
+}
+
+void A32u4::SharedStateView::publish(ATmega32u4& mcu) {
+	if (!segment.isOpen())
+		return;
+
+	Header* h = header();
+	uint8_t* seg = segment.data();
+
+	const uint64_t gen = h->generation.load(std::memory_order_relaxed);
+	h->generation.store(gen + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	h->cycle = mcu.cpu.getTotalCycles();
+	h->pc = mcu.cpu.getPC();
+	h->sp = mcu.dataspace.getSP();
+	const uint8_t* data = mcu.dataspace.getData();
+	h->sreg = data[DataSpace::Consts::SREG];
+	h->flags = (mcu.flash.isProgramLoaded() ? Flag_ProgramLoaded : 0) | (mcu.cpu.isSleeping() ? Flag_Sleeping : 0);
+
+	std::memcpy(seg + dataOffset, data, DataSpace::Consts::data_size);
+	std::memcpy(seg + eepromOffset, mcu.dataspace.getEEPROM(), DataSpace::Consts::eeprom_size);
+
+	// the flash rarely changes, comparing is cheaper than copying it and lets readers skip it
+	const uint8_t* flash = mcu.flash.getData();
+	if (std::memcmp(seg + flashOffset, flash, Flash::sizeMax) != 0) {
+		std::memcpy(seg + flashOffset, flash, Flash::sizeMax);
+		h->flashGeneration = ++flashGeneration;
+	}
+
+	h->generation.store(gen + 2, std::memory_order_release);
+}
+
+
+bool A32u4::SharedStateView::Reader::open(const char* name) {
+	close();
+	if (!segment.openShared(name, MappedFile::Mode_Read))
+		return false;
+
+	const Header* h = getHeader();
+	if (segment.size() < segmentSize || std::memcmp(h->magic, magic, sizeof(magic)) != 0 || h->version != layoutVersion) {
+		close();
+		return false;
+	}
+	return true;
+}
+void A32u4::SharedStateView::Reader::close() {
+	segment.close();
+}
+bool A32u4::SharedStateView::Reader::isOpen() const {
+	return segment.isOpen();
+}
+
+const A32u4::SharedStateView::Header* A32u4::SharedStateView::Reader::getHeader() const {
+	return (const Header*)segment.data();
+}
+const uint8_t* A32u4::SharedStateView::Reader::getSegment() const {
+	return segment.data();
+}
+
+bool A32u4::SharedStateView::Reader::read(State* out, size_t maxTries) const {
+	if (!segment.isOpen())
+		return false;
+
+	const Header* h = getHeader();
+	const uint8_t* seg = segment.data();
+	for (size_t i = 0; i < maxTries; i++) {
+		const uint64_t gen = h->generation.load(std::memory_order_acquire);
+		if (gen & 1)
+			continue;
+
+		const uint64_t cycle = h->cycle;
+		const uint64_t flashGen = h->flashGeneration;
+		const uint32_t pc = h->pc;
+		const uint16_t sp = h->sp;
+		const uint8_t sreg = h->sreg;
+		const uint8_t flags = h->flags;
+		std::memcpy(out->data, seg + dataOffset, sizeof(out->data));
+		std::memcpy(out->eeprom, seg + eepromOffset, sizeof(out->eeprom));
+		if (flashGen != out->flashGeneration)
+			std::memcpy(out->flash, seg + flashOffset, sizeof(out->flash));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (h->generation.load(std::memory_order_relaxed) != gen)
+			continue;
+
+		out->generation = gen / 2;
+		out->cycle = cycle;
+		out->flashGeneration = flashGen;
+		out->pc = pc;
+		out->sp = sp;
+		out->sreg = sreg;
+		out->flags = flags;
+		return true;
+	}
+	return false;
+}
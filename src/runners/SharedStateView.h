@@ -0,0 +1,115 @@
+#ifndef __A32U4_SHAREDSTATEVIEW_H__
+#define __A32U4_SHAREDSTATEVIEW_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "../config.h"
+#include "../components/DataSpace.h"
+#include "../components/Flash.h"
+#include "../utils/MappedFile.h"
+
+namespace A32u4 {
+	class ATmega32u4;
+
+	// publishes the state of an instance into a named shared memory segment, so other processes
+	// (profilers, memory viewers, test oracles) can map it read only and watch the instance without any serialization
+	//
+	// layout of the segment (host byte order, offsets from the start of the segment):
+	//   Header                          at 0
+	//   data space (Consts::data_size)  at Header::dataOffset
+	//   eeprom (Consts::eeprom_size)    at Header::eepromOffset
+	//   flash image (Flash::sizeMax)    at Header::flashOffset
+	// the header starts with "A32U4SV\0" and Header::version, readers should check both
+	//
+	// Header::generation works like a seqlock: it is odd while publish() is writing,
+	// so a reader copies what it needs and retries if generation was odd or changed in the meantime (Reader::read does that)
+	class SharedStateView {
+	public:
+		static constexpr uint32_t layoutVersion = 1;
+		static constexpr char magic[8] = { 'A','3','2','U','4','S','V','\0' };
+
+		enum {
+			Flag_ProgramLoaded = 1<<0,
+			Flag_Sleeping = 1<<1
+		};
+
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t headerSize;
+			uint32_t dataOffset, dataSize;
+			uint32_t eepromOffset, eepromSize;
+			uint32_t flashOffset, flashSize;
+			std::atomic<uint64_t> generation; // amount of publishes * 2, +1 while one is in progress
+			uint64_t cycle;
+			uint64_t flashGeneration; // changes whenever the flash image changed
+			uint32_t pc; // in words
+			uint16_t sp;
+			uint8_t sreg;
+			uint8_t flags; // Flag_x
+		};
+		static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free,
+			"the generation counter has to be a plain lock free word to be shared between processes");
+
+		static constexpr uint32_t dataOffset = 128;
+		static constexpr uint32_t eepromOffset = dataOffset + DataSpace::Consts::data_size;
+		static constexpr uint32_t flashOffset = eepromOffset + DataSpace::Consts::eeprom_size;
+		static constexpr uint32_t segmentSize = flashOffset + Flash::sizeMax;
+		static_assert(sizeof(Header) <= dataOffset, "the header does not fit in front of the data");
+
+		// copy of everything in the segment, taken by Reader::read
+		struct State {
+			uint64_t generation;
+			uint64_t cycle;
+			uint64_t flashGeneration;
+			uint32_t pc;
+			uint16_t sp;
+			uint8_t sreg;
+			uint8_t flags;
+			uint8_t data[DataSpace::Consts::data_size];
+			uint8_t eeprom[DataSpace::Consts::eeprom_size];
+			uint8_t flash[Flash::sizeMax];
+		};
+
+		// for the observing process (or thread)
+		class Reader {
+		private:
+			MappedFile segment;
+		public:
+			bool open(const char* name); // fails if the segment does not exist or has a different layout
+			void close();
+			bool isOpen() const;
+
+			const Header* getHeader() const;
+			const uint8_t* getSegment() const; // for reading the layout directly, without copying
+
+			// returns false if no consistent copy could be made within maxTries
+			// the flash image is only copied if its generation differs from the one already in out (set it to 0 on the first call)
+			bool read(State* out, size_t maxTries = 1000) const;
+		};
+	private:
+		MappedFile segment;
+		std::string name;
+		uint64_t flashGeneration = 0;
+
+		Header* header();
+	public:
+		SharedStateView();
+		~SharedStateView();
+
+		SharedStateView(const SharedStateView&) = delete;
+		SharedStateView& operator=(const SharedStateView&) = delete;
+
+		// creates the segment (replacing an old one with the same name)
+		bool create(const char* name);
+		void close(); // removes the segment, readers that have it mapped keep their (now frozen) view
+		bool isOpen() const;
+
+		// emulating thread only, call it at slice boundaries
+		void publish(ATmega32u4& mcu);
+	};
+}
+
+#endif
@@ -0,0 +1,31 @@
+#include "StatePublisher.h"
+
+#include <cstring>
+
+#include "../ATmega32u4.h"
+
+uint8_t A32u4::StatePublisher::Snapshot::getReg(uint8_t ind) const {
+	return data[ind];
+}
+uint8_t A32u4::StatePublisher::Snapshot::getSREG() const {
+	return data[DataSpace::Consts::SREG];
+}
+uint16_t A32u4::StatePublisher::Snapshot::getSP() const {
+	return (uint16_t)data[DataSpace::Consts::SPL] | ((uint16_t)data[DataSpace::Consts::SPH] << 8);
+}
+
+void A32u4::StatePublisher::publish(ATmega32u4& mcu) {
+	Snapshot snap;
+	snap.generation = ++generation;
+	snap.cycle = mcu.cpu.getTotalCycles();
+	snap.pc = mcu.cpu.getPC();
+	std::memcpy(snap.data, mcu.dataspace.getData(), sizeof(snap.data));
+	lock.store(snap);
+}
+
+void A32u4::StatePublisher::read(Snapshot* out) const {
+	lock.load(out);
+}
+uint64_t A32u4::StatePublisher::getGeneration() const {
+	return lock.getVersion();
+}
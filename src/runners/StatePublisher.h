@@ -0,0 +1,45 @@
+#ifndef __A32U4_STATEPUBLISHER_H__
+#define __A32U4_STATEPUBLISHER_H__
+
+#include <stdint.h>
+
+#include "../config.h"
+#include "../A32u4Types.h"
+#include "../components/DataSpace.h"
+#include "../utils/Seqlock.h"
+
+namespace A32u4 {
+	class ATmega32u4;
+
+	// makes the data space, registers and pc of an instance readable from other threads while it keeps running
+	// the emulating thread publishes at slice boundaries (AsyncRunner and BatchRunner do that if given a publisher),
+	// any amount of reader threads take consistent copies of the last published state without ever blocking it
+	// this replaces reading DataSpace::getData() from another thread, which races with the emulation
+	class StatePublisher {
+	public:
+		struct Snapshot {
+			uint64_t generation = 0; // 0 if nothing was published yet
+			uint64_t cycle = 0;
+			pc_t pc = 0;
+			// the whole data space with the io registers brought up to date
+			// so it also contains the general purpose registers (0-31), SREG and SP
+			uint8_t data[DataSpace::Consts::data_size];
+
+			uint8_t getReg(uint8_t ind) const;
+			uint8_t getSREG() const;
+			uint16_t getSP() const;
+		};
+	private:
+		Seqlock<Snapshot> lock;
+		uint64_t generation = 0; // writer only
+	public:
+		// emulating thread only
+		void publish(ATmega32u4& mcu);
+
+		// any thread
+		void read(Snapshot* out) const;
+		uint64_t getGeneration() const; // to skip reading if nothing changed
+	};
+}
+
+#endif
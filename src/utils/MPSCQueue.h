@@ -0,0 +1,78 @@
+#ifndef __A32U4_MPSCQUEUE_H__
+#define __A32U4_MPSCQUEUE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+namespace A32u4 {
+	// bounded lock-free queue for any amount of producer threads and exactly one consumer thread
+	// every cell has a sequence number that tells producers and the consumer whose turn it is
+	template<typename T>
+	class MPSCQueue {
+	private:
+		struct Cell {
+			std::atomic<size_t> seq;
+			T val;
+		};
+
+		std::unique_ptr<Cell[]> cells;
+		size_t mask = 0;
+
+		alignas(64) std::atomic<size_t> head{0}; // next write position, claimed by producers
+		alignas(64) size_t tail = 0; // next read position, only used by the consumer
+	public:
+		// capacity gets rounded up to a power of 2
+		MPSCQueue(size_t capacity) {
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			cells.reset(new Cell[size]);
+			mask = size - 1;
+			for (size_t i = 0; i < size; i++) {
+				cells[i].seq.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		// producer: returns false if the queue is full
+		bool push(const T& val) {
+			size_t pos = head.load(std::memory_order_relaxed);
+			for (;;) {
+				Cell& c = cells[pos & mask];
+				const size_t seq = c.seq.load(std::memory_order_acquire);
+				const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+				if (diff == 0) {
+					if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0) {
+					return false;
+				}
+				else {
+					pos = head.load(std::memory_order_relaxed);
+				}
+			}
+			Cell& c = cells[pos & mask];
+			c.val = val;
+			c.seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer: returns false if the queue is empty
+		bool pop(T* out) {
+			Cell& c = cells[tail & mask];
+			if (c.seq.load(std::memory_order_acquire) != tail + 1)
+				return false;
+			*out = c.val;
+			c.seq.store(tail + mask + 1, std::memory_order_release);
+			tail++;
+			return true;
+		}
+
+		size_t capacity() const {
+			return mask + 1;
+		}
+	};
+}
+
+#endif
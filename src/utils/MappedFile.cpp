@@ -0,0 +1,247 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+A32u4::MappedFile::MappedFile() {
+
+}
+A32u4::MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef _WIN32
+
+bool A32u4::MappedFile::open(const char* path, uint8_t mode_, size_t size) {
+	close();
+
+	const bool write = mode_ == Mode_ReadWrite;
+	HANDLE file = CreateFileA(path, GENERIC_READ | (write ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		write ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		return false;
+	}
+	if (size == 0)
+		size = (size_t)fileSize.QuadPart;
+	if (size == 0 || (!write && (size_t)fileSize.QuadPart < size)) {
+		CloseHandle(file);
+		return false;
+	}
+
+	DWORD protect = PAGE_READONLY, access = FILE_MAP_READ;
+	if (mode_ == Mode_ReadWrite) {
+		protect = PAGE_READWRITE;
+		access = FILE_MAP_WRITE;
+	}
+	else if (mode_ == Mode_CopyOnWrite) {
+		protect = PAGE_WRITECOPY;
+		access = FILE_MAP_COPY;
+	}
+
+	// the mapping extends the file if it is too small
+	HANDLE mapping = CreateFileMappingA(file, NULL, protect, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+	if (mapping == NULL) {
+		CloseHandle(file);
+		return false;
+	}
+	void* view = MapViewOfFile(mapping, access, 0, 0, size);
+	if (view == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	fileHandle = file;
+	origLen = (size_t)fileSize.QuadPart;
+	mappingHandle = mapping;
+	ptr = (uint8_t*)view;
+	len = size;
+	mode = mode_;
+	return true;
+}
+bool A32u4::MappedFile::openShared(const char* name, uint8_t mode_, size_t size) {
+	close();
+
+	const bool write = mode_ == Mode_ReadWrite;
+	HANDLE mapping;
+	if (write) {
+		if (size == 0)
+			return false;
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+	}
+	else {
+		mapping = OpenFileMappingA(mode_ == Mode_CopyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, FALSE, name);
+	}
+	if (mapping == NULL)
+		return false;
+
+	void* view = MapViewOfFile(mapping, write ? FILE_MAP_WRITE : (mode_ == Mode_CopyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ), 0, 0, size);
+	if (view == NULL) {
+		CloseHandle(mapping);
+		return false;
+	}
+	if (size == 0) {
+		// the exact size of the segment is not known, the view is rounded up to whole pages
+		MEMORY_BASIC_INFORMATION info;
+		if (VirtualQuery(view, &info, sizeof(info)) == 0) {
+			UnmapViewOfFile(view);
+			CloseHandle(mapping);
+			return false;
+		}
+		size = (size_t)info.RegionSize;
+	}
+
+	fileHandle = nullptr;
+	origLen = size;
+	mappingHandle = mapping;
+	ptr = (uint8_t*)view;
+	len = size;
+	mode = mode_;
+	return true;
+}
+void A32u4::MappedFile::removeShared(const char* name) {
+	(void)name; // named mappings are removed with their last handle
+}
+void A32u4::MappedFile::close() {
+	if (ptr) {
+		UnmapViewOfFile(ptr);
+		CloseHandle((HANDLE)mappingHandle);
+		if (fileHandle)
+			CloseHandle((HANDLE)fileHandle);
+	}
+	ptr = nullptr;
+	len = 0;
+	origLen = 0;
+	fileHandle = nullptr;
+	mappingHandle = nullptr;
+}
+void A32u4::MappedFile::sync(size_t off, size_t amt) {
+	if (!ptr || mode != Mode_ReadWrite || off >= len)
+		return;
+	if (amt > len - off)
+		amt = len - off;
+	FlushViewOfFile(ptr + off, amt);
+}
+
+#else
+
+bool A32u4::MappedFile::open(const char* path, uint8_t mode_, size_t size) {
+	close();
+
+	const bool write = mode_ == Mode_ReadWrite;
+	int file = ::open(path, write ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	if (file < 0)
+		return false;
+	return mapFd(file, mode_, size);
+}
+bool A32u4::MappedFile::openShared(const char* name, uint8_t mode_, size_t size) {
+	close();
+
+#ifdef __EMSCRIPTEN__
+	(void)name;
+	(void)size;
+	return false;
+#else
+	const bool write = mode_ == Mode_ReadWrite;
+	int file = shm_open(name, write ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	if (file < 0)
+		return false;
+	return mapFd(file, mode_, size);
+#endif
+}
+void A32u4::MappedFile::removeShared(const char* name) {
+#ifndef __EMSCRIPTEN__
+	shm_unlink(name);
+#else
+	(void)name;
+#endif
+}
+bool A32u4::MappedFile::mapFd(int file, uint8_t mode_, size_t size) {
+	const bool write = mode_ == Mode_ReadWrite;
+
+	struct stat st;
+	if (fstat(file, &st) != 0) {
+		::close(file);
+		return false;
+	}
+	if (size == 0)
+		size = (size_t)st.st_size;
+	if (size == 0 || ((size_t)st.st_size < size && (!write || ftruncate(file, (off_t)size) != 0))) {
+		::close(file);
+		return false;
+	}
+
+	int prot = PROT_READ, flags = MAP_SHARED;
+	if (mode_ == Mode_ReadWrite) {
+		prot |= PROT_WRITE;
+	}
+	else if (mode_ == Mode_CopyOnWrite) {
+		prot |= PROT_WRITE;
+		flags = MAP_PRIVATE;
+	}
+
+	void* view = mmap(nullptr, size, prot, flags, file, 0);
+	if (view == MAP_FAILED) {
+		::close(file);
+		return false;
+	}
+
+	fd = file;
+	origLen = (size_t)st.st_size;
+	ptr = (uint8_t*)view;
+	len = size;
+	mode = mode_;
+	return true;
+}
+void A32u4::MappedFile::close() {
+	if (ptr) {
+		munmap(ptr, len);
+		::close(fd);
+	}
+	ptr = nullptr;
+	len = 0;
+	origLen = 0;
+	fd = -1;
+}
+void A32u4::MappedFile::sync(size_t off, size_t amt) {
+	if (!ptr || mode != Mode_ReadWrite || off >= len)
+		return;
+	if (amt > len - off)
+		amt = len - off;
+
+	// msync needs a page aligned address
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t start = off - (off % pageSize);
+	msync(ptr + start, amt + (off - start), MS_ASYNC);
+}
+
+#endif
+
+bool A32u4::MappedFile::isOpen() const {
+	return ptr != nullptr;
+}
+uint8_t* A32u4::MappedFile::data() {
+	return ptr;
+}
+const uint8_t* A32u4::MappedFile::data() const {
+	return ptr;
+}
+size_t A32u4::MappedFile::size() const {
+	return len;
+}
+size_t A32u4::MappedFile::originalFileSize() const {
+	return origLen;
+}
@@ -0,0 +1,57 @@
+#ifndef __A32U4_MAPPEDFILE_H__
+#define __A32U4_MAPPEDFILE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace A32u4 {
+	// memory mapping of a whole file (mmap on posix, file mappings on windows)
+	// or of a named shared memory segment (shm_open on posix, named file mappings on windows)
+	class MappedFile {
+	public:
+		enum {
+			Mode_Read = 0,    // read only, pages are shared between all mappings of the file
+			Mode_ReadWrite,   // writes go to the file
+			Mode_CopyOnWrite  // writes are private to this mapping and never reach the file
+		};
+	private:
+		uint8_t* ptr = nullptr;
+		size_t len = 0;
+		size_t origLen = 0;
+		uint8_t mode = Mode_Read;
+
+#ifdef _WIN32
+		void* fileHandle = nullptr;
+		void* mappingHandle = nullptr;
+#else
+		int fd = -1;
+
+		bool mapFd(int file, uint8_t mode, size_t size);
+#endif
+	public:
+		MappedFile();
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		// size 0 maps the whole file, otherwise the file is created/extended to size bytes (only in Mode_ReadWrite)
+		bool open(const char* path, uint8_t mode, size_t size = 0);
+		// same as open, but for a shared memory segment. names should start with a '/' and contain no other ones
+		// the segment exists until removeShared is called (posix) or until the last mapping of it is closed (windows)
+		bool openShared(const char* name, uint8_t mode, size_t size = 0);
+		static void removeShared(const char* name);
+		void close();
+
+		bool isOpen() const;
+		uint8_t* data();
+		const uint8_t* data() const;
+		size_t size() const;
+		size_t originalFileSize() const; // size of the file before open() extended it
+
+		// start writing back the given range to the file (no-op if not in Mode_ReadWrite)
+		void sync(size_t off, size_t amt);
+	};
+}
+
+#endif
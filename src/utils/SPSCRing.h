@@ -0,0 +1,82 @@
+#ifndef __A32U4_SPSCRING_H__
+#define __A32U4_SPSCRING_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+namespace A32u4 {
+	// lock-free ring buffer for exactly one producer thread and one consumer thread
+	template<typename T>
+	class SPSCRing {
+	private:
+		std::vector<T> buf;
+		size_t mask = 0;
+
+		alignas(64) std::atomic<size_t> head{0}; // next write position, only written by the producer
+		alignas(64) std::atomic<size_t> tail{0}; // next read position, only written by the consumer
+	public:
+		SPSCRing(size_t capacity = 0) {
+			resize(capacity);
+		}
+
+		// not thread safe, capacity gets rounded up to a power of 2
+		void resize(size_t capacity) {
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			buf.assign(capacity ? size : 0, T());
+			mask = capacity ? size - 1 : 0;
+			head.store(0, std::memory_order_relaxed);
+			tail.store(0, std::memory_order_relaxed);
+		}
+
+		// producer: returns the amount of elements that fit
+		size_t push(const T* data, size_t len) {
+			const size_t h = head.load(std::memory_order_relaxed);
+			const size_t t = tail.load(std::memory_order_acquire);
+			const size_t amt = std::min(len, buf.size() - (h - t));
+			for (size_t i = 0; i < amt; i++) {
+				buf[(h + i) & mask] = data[i];
+			}
+			head.store(h + amt, std::memory_order_release);
+			return amt;
+		}
+		bool push(const T& val) {
+			return push(&val, 1) == 1;
+		}
+
+		// consumer: returns the amount of elements read
+		size_t pop(T* out, size_t maxLen) {
+			const size_t t = tail.load(std::memory_order_relaxed);
+			const size_t h = head.load(std::memory_order_acquire);
+			const size_t amt = std::min(maxLen, h - t);
+			for (size_t i = 0; i < amt; i++) {
+				out[i] = buf[(t + i) & mask];
+			}
+			tail.store(t + amt, std::memory_order_release);
+			return amt;
+		}
+
+		// consumer: like pop, but the elements stay in the ring
+		size_t peek(T* out, size_t maxLen) const {
+			const size_t t = tail.load(std::memory_order_relaxed);
+			const size_t h = head.load(std::memory_order_acquire);
+			const size_t amt = std::min(maxLen, h - t);
+			for (size_t i = 0; i < amt; i++) {
+				out[i] = buf[(t + i) & mask];
+			}
+			return amt;
+		}
+
+		size_t size() const {
+			return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+		}
+		size_t capacity() const {
+			return buf.size();
+		}
+	};
+}
+
+#endif
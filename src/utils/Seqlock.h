@@ -0,0 +1,65 @@
+#ifndef __A32U4_SEQLOCK_H__
+#define __A32U4_SEQLOCK_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+namespace A32u4 {
+	// holds one value that a single writer thread replaces and any amount of reader threads copy out
+	// the writer never waits, readers retry if the value changed while they were copying it
+	// the value is stored as atomic words, so a torn read is detected instead of being a data race
+	template<typename T>
+	class Seqlock {
+	private:
+		static_assert(std::is_trivially_copyable<T>::value, "Seqlock only works with trivially copyable types");
+		static constexpr size_t numWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+		alignas(64) std::atomic<uint64_t> seq{0}; // odd while the writer is copying
+		std::atomic<uint64_t> words[numWords] = {};
+	public:
+		// writer
+		void store(const T& val) {
+			uint64_t buf[numWords] = {};
+			std::memcpy(buf, &val, sizeof(T));
+
+			const uint64_t s = seq.load(std::memory_order_relaxed);
+			seq.store(s + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			for (size_t i = 0; i < numWords; i++) {
+				words[i].store(buf[i], std::memory_order_relaxed);
+			}
+			seq.store(s + 2, std::memory_order_release);
+		}
+
+		// readers: returns false if the writer was active during the copy (out is garbage then)
+		bool tryLoad(T* out) const {
+			const uint64_t s = seq.load(std::memory_order_acquire);
+			if (s & 1)
+				return false;
+
+			uint64_t buf[numWords];
+			for (size_t i = 0; i < numWords; i++) {
+				buf[i] = words[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) != s)
+				return false;
+
+			std::memcpy(out, buf, sizeof(T));
+			return true;
+		}
+		// spins until a consistent copy was made
+		void load(T* out) const {
+			while (!tryLoad(out));
+		}
+
+		// amount of stores that were completed
+		uint64_t getVersion() const {
+			return seq.load(std::memory_order_acquire) / 2;
+		}
+	};
+}
+
+#endif
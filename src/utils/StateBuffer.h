@@ -0,0 +1,77 @@
+#ifndef __A32U4_STATEBUFFER_H__
+#define __A32U4_STATEBUFFER_H__
+
+#include <stdint.h>
+#include <cstring>
+#include <streambuf>
+
+namespace A32u4 {
+	// sequential access to a caller provided state buffer, used by the buffer based getState/setState overloads
+	// the buffer size is checked once up front (ATmega32u4::getStateSize), so these dont check anything
+	struct StateWriter {
+		uint8_t* ptr;
+
+		template<typename T>
+		void write(const T& val) {
+			std::memcpy(ptr, &val, sizeof(T));
+			ptr += sizeof(T);
+		}
+		void write(const void* data, size_t len) {
+			std::memcpy(ptr, data, len);
+			ptr += len;
+		}
+	};
+	struct StateReader {
+		const uint8_t* ptr;
+
+		template<typename T>
+		void read(T* val) {
+			std::memcpy(val, ptr, sizeof(T));
+			ptr += sizeof(T);
+		}
+		void read(void* data, size_t len) {
+			std::memcpy(data, ptr, len);
+			ptr += len;
+		}
+	};
+
+	// lets the stream based getState/setState work on a fixed block of memory without copying it
+	// (used for the parts that only have a stream version, like the extras)
+	// with a nullptr buffer nothing is stored, but written() still counts the bytes
+	class StateStreamBuf : public std::streambuf {
+	private:
+		size_t counted = 0;
+	public:
+		StateStreamBuf(uint8_t* data, size_t len) {
+			setp((char*)data, (char*)data + len);
+			setg((char*)data, (char*)data, (char*)data + len);
+		}
+		StateStreamBuf(const uint8_t* data, size_t len) : StateStreamBuf((uint8_t*)data, len) {
+
+		}
+
+		size_t written() const {
+			return (size_t)(pptr() - pbase()) + counted;
+		}
+		size_t read() const {
+			return (size_t)(gptr() - eback());
+		}
+	protected:
+		std::streamsize xsputn(const char* s, std::streamsize n) override {
+			if (pbase() == nullptr) {
+				counted += (size_t)n;
+				return n;
+			}
+			return std::streambuf::xsputn(s, n);
+		}
+		int_type overflow(int_type ch) override {
+			if (pbase() == nullptr && !traits_type::eq_int_type(ch, traits_type::eof())) {
+				counted++;
+				return ch;
+			}
+			return traits_type::eof();
+		}
+	};
+}
+
+#endif
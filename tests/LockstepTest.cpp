@@ -0,0 +1,85 @@
+// checks that LockstepGroup lanes keep inputs that were queued quanta ahead when they get split off into their own instance,
+// and that lanes given the same inputs in a different order keep sharing one instance
+
+#include <stdint.h>
+#include <cstdio>
+#include <vector>
+
+#include "ATmega32u4.h"
+#include "runners/LockstepGroup.h"
+
+namespace {
+	// the main loop copies PINB to r16
+	std::vector<uint16_t> makeProgram() {
+		std::vector<uint16_t> prog(128, 0);
+		prog[0] = 0xC000 | (64 - 1);      // rjmp main
+		const uint16_t main[] = {
+			0xB103,                       // loop: in r16, PINB
+			0x9513,                       // inc r17
+			0xCFFD                        // rjmp loop
+		};
+		for (size_t i = 0; i < sizeof(main) / sizeof(main[0]); i++) {
+			prog[64 + i] = main[i];
+		}
+		return prog;
+	}
+
+	size_t fails = 0;
+	void check(bool cond, const char* what) {
+		if (!cond) {
+			std::printf("failed: %s\n", what);
+			fails++;
+		}
+	}
+}
+
+int main() {
+	constexpr uint64_t quantum = 1000;
+	const std::vector<uint16_t> prog = makeProgram();
+
+	A32u4::ATmega32u4 proto;
+	proto.flash.loadFromMemory((const uint8_t*)prog.data(), prog.size() * 2);
+	proto.powerOn();
+
+	{
+		A32u4::LockstepGroup group(proto, 3);
+		group.setQuantumCycles(quantum);
+		group.setMergeInterval(0);
+
+		// same input on every lane two quanta ahead, so it ends up in the queue of the shared instance
+		for (size_t l = 0; l < 3; l++) {
+			group.queueInput(l, { 2 * quantum + quantum / 2, A32u4::ATmega32u4::PinChange_PORTB, 0x01, 0x01 });
+		}
+		group.execute(1);
+		check(group.getNumInstances() == 1, "lanes with the same inputs share an instance");
+
+		// lane 1 gets split off by a differing input, lane 2 by getLaneMutable
+		group.queueInput(1, { 0, A32u4::ATmega32u4::PinChange_PORTB, 0x02, 0x02 });
+		group.execute(1);
+		group.getLaneMutable(2);
+		check(group.getNumInstances() == 3, "differing lanes got split off");
+
+		group.execute(2);
+		check((group.getLaneMutable(0).dataspace.getDataByte(16) & 0x01) != 0, "input applied in the original instance");
+		check(group.getLaneMutable(1).dataspace.getDataByte(16) == 0x03, "input applied in the instance split by inputs");
+		check((group.getLaneMutable(2).dataspace.getDataByte(16) & 0x01) != 0, "input applied in the instance split by getLaneMutable");
+	}
+
+	{
+		A32u4::LockstepGroup group(proto, 2);
+		group.setQuantumCycles(quantum);
+		group.setMergeInterval(0); // merging would hide a needless split
+
+		const A32u4::LockstepGroup::Input a = { 10, A32u4::ATmega32u4::PinChange_PORTB, 0x01, 0x01 };
+		const A32u4::LockstepGroup::Input b = { 10, A32u4::ATmega32u4::PinChange_PORTB, 0x02, 0x02 };
+		group.queueInput(0, a);
+		group.queueInput(0, b);
+		group.queueInput(1, b);
+		group.queueInput(1, a);
+		group.execute(1);
+		check(group.getNumInstances() == 1, "the order inputs are given in doesnt split lanes");
+	}
+
+	std::printf(fails == 0 ? "all lockstep checks passed\n" : "%zu lockstep checks failed\n", fails);
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// runs copies of one program on many threads through BatchRunner (with other threads reading their published state)
+// and checks that every copy ends up exactly like a copy that ran on its own
+// configure with -DA32U4_SANITIZE_THREAD=ON to have ThreadSanitizer check the multi instance execution for data races
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+#include "ATmega32u4.h"
+#include "runners/BatchRunner.h"
+#include "runners/StatePublisher.h"
+
+namespace {
+	// timer0 overflow interrupt counting in r17, the main loop counting in r18 and storing it to ram
+	std::vector<uint16_t> makeProgram() {
+		std::vector<uint16_t> prog(128, 0);
+		prog[0] = 0xC000 | (64 - 1);      // rjmp main
+		prog[23 * 2] = 0x9513;            // inc r17
+		prog[23 * 2 + 1] = 0x9518;        // reti
+		const uint16_t main[] = {
+			0xE001,                       // ldi r16, 1
+			0x9300, 0x006E,               // sts TIMSK0, r16
+			0x9300, 0x0045,               // sts TCCR0B, r16
+			0x9478,                       // sei
+			0x9523,                       // loop: inc r18
+			0x9320, 0x0200,               // sts 0x200, r18
+			0xCFFC                        // rjmp loop
+		};
+		for (size_t i = 0; i < sizeof(main) / sizeof(main[0]); i++) {
+			prog[64 + i] = main[i];
+		}
+		return prog;
+	}
+
+	std::unique_ptr<A32u4::ATmega32u4> makeInstance(const std::vector<uint16_t>& prog) {
+		std::unique_ptr<A32u4::ATmega32u4> mcu(new A32u4::ATmega32u4());
+		mcu->flash.loadFromMemory((const uint8_t*)prog.data(), prog.size() * 2);
+		mcu->powerOn();
+		return mcu;
+	}
+}
+
+int main(int argc, char** argv) {
+	const size_t numCopies = argc > 1 ? (size_t)std::atoi(argv[1]) : 16;
+	const size_t numThreads = argc > 2 ? (size_t)std::atoi(argv[2]) : 4;
+	const uint64_t cycleBudget = A32u4::CPU::ClockFreq / 20; // 50ms
+
+	const std::vector<uint16_t> prog = makeProgram();
+
+	std::unique_ptr<A32u4::ATmega32u4> ref = makeInstance(prog);
+	{
+		A32u4::BatchRunner runner(1);
+		runner.run({ { ref.get(), cycleBudget } });
+	}
+
+	std::vector<std::unique_ptr<A32u4::ATmega32u4>> mcus;
+	std::unique_ptr<A32u4::StatePublisher[]> publishers(new A32u4::StatePublisher[numCopies]);
+	std::vector<A32u4::BatchRunner::Job> jobs;
+	for (size_t i = 0; i < numCopies; i++) {
+		mcus.push_back(makeInstance(prog));
+		A32u4::BatchRunner::Job job{ mcus.back().get(), cycleBudget };
+		job.publisher = &publishers[i];
+		jobs.push_back(job);
+	}
+
+	std::atomic<bool> done{ false };
+	std::thread reader([&] {
+		std::unique_ptr<A32u4::StatePublisher::Snapshot> snap(new A32u4::StatePublisher::Snapshot());
+		while (!done.load(std::memory_order_acquire)) {
+			for (size_t i = 0; i < numCopies; i++) {
+				publishers[i].read(snap.get());
+			}
+		}
+	});
+
+	A32u4::BatchRunner runner(numThreads);
+	const std::vector<A32u4::BatchRunner::Result> results = runner.run(jobs);
+	done.store(true, std::memory_order_release);
+	reader.join();
+
+	// the io registers (e.g. the timer count) are updated lazily, publishing did that for the copies but not for ref
+	ref->dataspace.getData();
+	size_t fails = 0;
+	for (size_t i = 0; i < numCopies; i++) {
+		A32u4::ATmega32u4& mcu = *mcus[i];
+		mcu.dataspace.getData();
+		if (results[i].stopReason != A32u4::BatchRunner::StopReason_Budget || mcu.hash() != ref->hash()) {
+			std::printf("copy %zu differs: stop reason %u, hash %08x instead of %08x\n", i, (unsigned)results[i].stopReason, (unsigned)mcu.hash(), (unsigned)ref->hash());
+			fails++;
+		}
+	}
+
+	std::printf("%zu of %zu copies on %zu threads match the single threaded run\n", numCopies - fails, numCopies, runner.getNumThreads());
+	return fails == 0 ? 0 : 1;
+}